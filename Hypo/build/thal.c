@@ -123,7 +123,7 @@ void Reset(void) {
 }
 
 // *** Fast trigonometry approximation functions
-float finvSqrt(float x) {
+THAL_RAMFUNC float finvSqrt(float x) {
     union {
         float f;
         int i;
@@ -134,7 +134,7 @@ float finvSqrt(float x) {
     return y * (1.5f - 0.5f * x * y * y);
 }
 
-float fatan2(float y, float x) {
+THAL_RAMFUNC float fatan2(float y, float x) {
 	if (x == 0.0f) {
 		if (y > 0.0f) return M_PI_2;
 		if (y == 0.0f) return 0.0f;
@@ -156,7 +156,7 @@ float fatan2(float y, float x) {
 	return atan;
 }
 
-float fasin(float x) {
+THAL_RAMFUNC float fasin(float x) {
     float temp, arcsin, xabs;
     xabs = fabsf(x);
     temp = M_PI_2 - (1.5707288f + (-0.2121144f + (0.0742610f - 0.0187293f*xabs)*xabs)*xabs)/finvSqrt(1-xabs);
@@ -164,7 +164,7 @@ float fasin(float x) {
     return arcsin;
 }
 
-float fsin(float x) {
+THAL_RAMFUNC float fsin(float x) {
     const float B = 4/M_PI;
     const float C = -4/(M_PI*M_PI);
 
@@ -180,7 +180,7 @@ float fsin(float x) {
     return y;
 }
 
-float fcos(float x) {
+THAL_RAMFUNC float fcos(float x) {
     return fsin(x+M_PI_2);
 }
 
@@ -343,6 +343,9 @@ void WaitDelay(unsigned int milliseconds) {
 	void SysTick_Handler(void) {
 		FUNCSysTicks++; // increment tick timer variable for use with Delays
         if(FUNCTimeout>0) FUNCTimeout--;
+        #if (WHO_AM_I == I_AM_HYPO || WHO_AM_I == I_AM_HYPX) && UART_EN && XBEE_EN
+            if(FUNCXBeeATTimer>0) FUNCXBeeATTimer--;
+        #endif
 		if(SysTickInterrupt) SysTickInterrupt();  // Run user-supplied interrupt function if available
         if(SDTick) SDTick();
 	}
@@ -1240,7 +1243,7 @@ void PIOINT3_IRQHandler(void) {
     
     
     #if UART_USE_OUTBUFFER
-        unsigned char FUNCUARTBuffer[UART_BUFFER_SIZE];
+        unsigned char FUNCUARTBuffer[UART_BUFFER_SIZE] BSS_SRAM1;
         volatile unsigned short FUNCUARTBufferPush, FUNCUARTBufferPop;
         
         unsigned short UARTBufferWritable(void) {
@@ -1513,7 +1516,7 @@ void PIOINT3_IRQHandler(void) {
 	}
 	 
 	// ****** Interrupt handler - I2C state is implemented using interrupts
-	void I2C_IRQHandler(void) {
+	THAL_RAMFUNC void I2C_IRQHandler(void) {
         unsigned char state;
         state = LPC_I2C->STAT & 0xff;
         
@@ -3109,7 +3112,7 @@ unsigned char PRGPoll(void) {
 #if ILINK_EN & SSP0_EN
     volatile unsigned char FUNCILinkState;
     volatile unsigned short FUNCILinkID, FUNCILinkChecksumA, FUNCILinkChecksumB, FUNCILinkLength, FUNCILinkPacket;
-    unsigned short FUNCILinkRxBuffer[ILINK_RXBUFFER_SIZE];
+    unsigned short FUNCILinkRxBuffer[ILINK_RXBUFFER_SIZE] BSS_SRAM1;
     
     void ILinkInit(unsigned short speed) {
         SSP0Init(speed);
@@ -3253,7 +3256,7 @@ unsigned char PRGPoll(void) {
     }
     
     //#if ILINK_EN == 2
-        unsigned short FUNCILinkTxBuffer[ILINK_TXBUFFER_SIZE];
+        unsigned short FUNCILinkTxBuffer[ILINK_TXBUFFER_SIZE] BSS_SRAM1;
         unsigned int FUNCILinkTxBufferBusy;
         volatile unsigned short FUNCILinkTxBufferPushPtr, FUNCILinkTxBufferPopPtr;
 
@@ -4320,7 +4323,7 @@ unsigned char PRGPoll(void) {
         #if GPS_METHOD == 1
             volatile unsigned char FUNCGPSState, FUNCGPSChecksumA, FUNCGPSChecksumB, FUNCGPSID1, FUNCGPSID2;
             volatile unsigned short FUNCGPSLength, FUNCGPSPacket, FUNCGPSID;
-            unsigned char FUNCGPSBuffer[GPS_BUFFER_SIZE];
+            unsigned char FUNCGPSBuffer[GPS_BUFFER_SIZE] BSS_SRAM1;
         
             void GPSSetRate(unsigned short id, unsigned char rate) {
                 unsigned char id1, id2;
@@ -4444,9 +4447,16 @@ unsigned char PRGPoll(void) {
     #if FLASH_EN
         volatile unsigned int FUNCFlashCR0Reset, FUNCFlashCPSRReset;
         
-        volatile unsigned int FUNCFlashCurrentSector;
-        unsigned char FUNCFlashSectorBuffer[4096];
-        volatile unsigned char FUNCFlashBufferChanged;
+        unsigned int FUNCFlashAppendStart, FUNCFlashAppendEnd;
+        unsigned int FUNCFlashAppendAddr;
+        unsigned int FUNCFlashEraseAddr;
+        unsigned int FUNCFlashEraseAhead;
+        
+        #if FLASH_BUFFERED
+            volatile unsigned int FUNCFlashCurrentSector;
+            unsigned char FUNCFlashSectorBuffer[4096];
+            volatile unsigned char FUNCFlashBufferChanged;
+        #endif
         
         void FlashInit(void) {
             SSP1Init(12000); // Init SPI port at 12MHz
@@ -4470,8 +4480,10 @@ unsigned char PRGPoll(void) {
             
             FlashEnd();
             
-            FUNCFlashCurrentSector = 0xffffffff;
-            FUNCFlashBufferChanged = 0;
+            #if FLASH_BUFFERED
+                FUNCFlashCurrentSector = 0xffffffff;
+                FUNCFlashBufferChanged = 0;
+            #endif
         }
         
         void FlashStart(void) {
@@ -4494,6 +4506,19 @@ unsigned char PRGPoll(void) {
             FlashCLR();
         }
         
+        unsigned char FlashBusy(void) {
+            unsigned char status;
+            
+            FlashStart();
+            FlashSEL();
+            SSP1WriteByte(0x05); // Read status register
+            status = SSP1ReadByte();
+            FlashCLR();
+            FlashEnd();
+            
+            return status & 0x1;
+        }
+        
         void FlashWrEn(void) {
             FlashSEL();
             SSP1WriteByte(0x06); // enables write access
@@ -4616,12 +4641,7 @@ unsigned char PRGPoll(void) {
             FlashWait();    // Wait for busy
             
             // Read byte
-            FlashSEL();
-            SSP1WriteByte(0x03);
-            SSP1WriteByte(address >> 16);
-            SSP1WriteByte(address >> 8);
-            SSP1WriteByte(address >> 0);
-            //SSP1WriteByte(0); // dummy byte if using fast read 0x0b, do not use if using regular read 0x03
+            FlashReadCommand(address);
             data = SSP1ReadByte();
             FlashCLR();
             
@@ -4631,24 +4651,26 @@ unsigned char PRGPoll(void) {
         }
         
         unsigned char FlashVerify(unsigned int address, unsigned char * data, unsigned int length) {
-            unsigned int i;
+            unsigned char chunk[16];
+            unsigned int i, n;
             
             FlashStart();
             FlashWait();    // Wait for busy
             
-            // Read byte
-            FlashSEL();
-            SSP1WriteByte(0x03);
-            SSP1WriteByte(address >> 16);
-            SSP1WriteByte(address >> 8);
-            SSP1WriteByte(address >> 0);
-            //SSP1WriteByte(0); // dummy byte if using fast read 0x0b, do not use if using regular read 0x03
-            for(i=0; i<length; i++) {
-                if(SSP1ReadByte() != data[i]) {
-                    FlashCLR();
-                    FlashEnd();
-                    return 0;
+            // Read in chunks, each one is finished before it's compared so nothing is left in the FIFO when bailing out early
+            FlashReadCommand(address);
+            while(length) {
+                n = (length > sizeof(chunk)) ? sizeof(chunk) : length;
+                FlashBurstRead(chunk, n);
+                for(i=0; i<n; i++) {
+                    if(chunk[i] != data[i]) {
+                        FlashCLR();
+                        FlashEnd();
+                        return 0;
+                    }
                 }
+                data += n;
+                length -= n;
             }
             FlashCLR();
             FlashEnd();
@@ -4732,28 +4754,97 @@ unsigned char PRGPoll(void) {
         }
         
         void FlashRawRead(unsigned int address, unsigned char * data, unsigned int length) {
-            unsigned int i;
-            
             if(length > 0) {
                 FlashStart();
                 FlashWait();    // Wait for busy
                 
-                // Read byte
-                FlashSEL();
-                SSP1WriteByte(0x03);
-                SSP1WriteByte(address >> 16);
-                SSP1WriteByte(address >> 8);
-                SSP1WriteByte(address >> 0);
-                //SSP1WriteByte(0); // dummy byte if using fast read 0x0b, do not use if using regular read 0x03
-                for(i=0; i<length; i++) {
-                    data[i] = SSP1ReadByte();
-                }
+                FlashReadCommand(address);
+                FlashBurstRead(data, length);
                 FlashCLR();
                 
                 FlashEnd();
             }
         }
         
+        // Selects the chip and sends a read command for address, the data can then be clocked in with SSP1ReadByte or FlashBurstRead
+        void FlashReadCommand(unsigned int address) {
+            FlashSEL();
+            #if FLASH_FAST_READ
+                SSP1WriteByte(0x0b);
+            #else
+                SSP1WriteByte(0x03);
+            #endif
+            SSP1WriteByte(address >> 16);
+            SSP1WriteByte(address >> 8);
+            SSP1WriteByte(address >> 0);
+            #if FLASH_FAST_READ
+                SSP1WriteByte(0); // dummy byte for fast read 0x0b
+            #endif
+        }
+        
+        // Clocks length bytes of a read in, keeping the SSP's 8 frame FIFO topped up so that the bus doesn't sit idle between bytes
+        // waiting for each one to be collected.  There are never more than 8 frames in flight so the receive FIFO can't overrun, and
+        // they have all been collected when this returns.
+        void FlashBurstRead(unsigned char * data, unsigned int length) {
+            unsigned int sent = 0;
+            unsigned int received = 0;
+            
+            while(received < length) {
+                while(sent < length && sent - received < 8 && (LPC_SSP1->SR & 0x02)) { // Transmit FIFO Not Full
+                    LPC_SSP1->DR = 0xff;
+                    sent++;
+                }
+                while(LPC_SSP1->SR & 0x04) { // Receive FIFO Not Empty
+                    data[received++] = LPC_SSP1->DR;
+                }
+            }
+        }
+        
+        // *** Append functions
+        // Sequential writes into a ring of sectors from start to end, one page at a time, programmed straight into flash that was
+        // erased in advance so that there's no read-erase-rewrite and no sector buffer.  FlashAppendService() keeps eraseAhead
+        // sectors erased in front of the append address without ever waiting on the flash, it starts at most one erase per call.
+        void FlashAppendInit(unsigned int start, unsigned int end, unsigned int address, unsigned int erased, unsigned int eraseAhead) {
+            FUNCFlashAppendStart = start & 0xfffff000;
+            FUNCFlashAppendEnd = end & 0xfffff000;
+            FUNCFlashAppendAddr = address;      // next page to program
+            FUNCFlashEraseAddr = erased & 0xfffff000; // first sector that isn't known to be erased
+            FUNCFlashEraseAhead = eraseAhead;
+        }
+        
+        unsigned int FlashAppendAddress(void) {
+            return FUNCFlashAppendAddr;
+        }
+        
+        unsigned int FlashAppendEraseAddress(void) {
+            return FUNCFlashEraseAddr; // start of the next sector to be erased, everything up to it from the append address is erased
+        }
+        
+        unsigned int FlashAppendSpace(void) {
+            unsigned int size = FUNCFlashAppendEnd - FUNCFlashAppendStart;
+            return (FUNCFlashEraseAddr + size - FUNCFlashAppendAddr) % size;
+        }
+        
+        unsigned char FlashAppendService(void) {
+            if(FlashBusy()) return 1;
+            if(FlashAppendSpace() >= FUNCFlashEraseAhead * 0x1000) return 0;
+            
+            FlashErase4k(FUNCFlashEraseAddr);   // returns as soon as the erase has started
+            FUNCFlashEraseAddr += 0x1000;
+            if(FUNCFlashEraseAddr >= FUNCFlashAppendEnd) FUNCFlashEraseAddr = FUNCFlashAppendStart;
+            return 1;
+        }
+        
+        unsigned char FlashAppendPage(unsigned char * data, unsigned int length) {
+            if(length > FLASH_PAGE_SIZE || FlashAppendSpace() < FLASH_PAGE_SIZE) return 0;
+            
+            FlashRawWrite(FUNCFlashAppendAddr, data, length); // the rest of the page is left erased
+            FUNCFlashAppendAddr += FLASH_PAGE_SIZE;
+            if(FUNCFlashAppendAddr >= FUNCFlashAppendEnd) FUNCFlashAppendAddr = FUNCFlashAppendStart;
+            return 1;
+        }
+        
+    #if FLASH_BUFFERED
         void FlashBufferSector(unsigned int address) {
             FlashFlushBuffer(); // FUNCFlashBufferChanged = 0 is in here
             if((address & 0xfffff000) != FUNCFlashCurrentSector) {
@@ -4834,7 +4925,7 @@ unsigned char PRGPoll(void) {
                 }
             }
         }
-        
+    #endif
         
     #endif
     #endif
@@ -4851,9 +4942,20 @@ unsigned char PRGPoll(void) {
         volatile unsigned char FUNCXBeetBufCount;
         
         volatile unsigned int FUNCXBeeState;
-        volatile unsigned short FUNCXBeeLength, FUNCXBeeID, FUNCXBeePacket;
+        volatile unsigned short FUNCXBeeLength, FUNCXBeePacket;
         volatile unsigned char FUNCXBeeChecksum;
-        unsigned char FUNCXBeeBuffer[XBEE_BUFFER_SIZE];
+        
+        // Receive ring: the interrupt stores each frame (ID then data) whole and contiguous in here and records where it
+        // is, then XBeeProcess() hands it to XBeeMessage() in place.  Frames that won't fit before the end of the ring
+        // go back to the start, so the end of the last frame (push) can be behind the start of the oldest one (pop).
+        unsigned char FUNCXBeeRing[XBEE_RING_SIZE] BSS_SRAM1;
+        volatile unsigned short FUNCXBeeRingPush, FUNCXBeeRingPop;
+        volatile unsigned short FUNCXBeeFrameStart;
+        unsigned short FUNCXBeeFrameOffset[XBEE_FRAME_COUNT] BSS_SRAM1;
+        unsigned short FUNCXBeeFrameLength[XBEE_FRAME_COUNT] BSS_SRAM1;
+        volatile unsigned char FUNCXBeeFramePush, FUNCXBeeFramePop;
+        volatile unsigned char FUNCXBeeProcessing;
+        volatile unsigned int FUNCXBeeDrops;
         
         unsigned char XBeeSendATCommand(void) {
             xbee_at_command.frameID = Random() | 0x1;
@@ -4862,7 +4964,7 @@ unsigned char PRGPoll(void) {
             // check status
             xbee_at_response.isNew = 0;
             FUNCTimeout = 1000;
-            while(FUNCTimeout > 0 && xbee_at_response.isNew == 0);
+            while(FUNCTimeout > 0 && xbee_at_response.isNew == 0) XBeeProcess();
             if(xbee_at_response.frameID == xbee_at_command.frameID && xbee_at_response.commandStatus == 0) {
                 return 1;
             }
@@ -4896,236 +4998,187 @@ unsigned char PRGPoll(void) {
         unsigned char XBeeSendPacket(void) {
             xbee_transmit_request.frameID = Random() | 0x01;
             xbee_transmit_request.broadcastRadius = 0;
-            xbee_transmit_request.options = 0x01; // disable ACK;
+            #if XBEE_TX_ACK
+                xbee_transmit_request.options = 0x00; // ACK and retry, the outcome comes back in a transmit status frame
+            #else
+                xbee_transmit_request.options = 0x01; // disable ACK;
+            #endif
 
             XBeeSendFrame(ID_XBEE_TRANSMITREQUEST, (unsigned char *)&xbee_transmit_request, sizeof(xbee_transmit_request)-2-255+xbee_transmit_request.varLen);
 
             return 1;
         }
 
-        void XBeeAllowJoin() {
-            XBeeStopJoin();
+        // AT command queue: commands are sent one at a time, the response is matched on frame ID and handed to the
+        // command's callback (status 0xff if there was no response within XBEE_AT_TIMEOUT).  XBeeATPoll() sends the
+        // next command and handles timeouts, XBeeATResponse() is given AT response frames by the receive path.
+        xbee_at_queued_t FUNCXBeeATQueue[XBEE_AT_QUEUE];
+        volatile unsigned char FUNCXBeeATPush, FUNCXBeeATPop;
+        volatile unsigned char FUNCXBeeATState;     // 0 idle, 1 waiting to send the head command, 2 waiting for its response
+        volatile unsigned char FUNCXBeeATFrameID;
+        volatile unsigned short FUNCXBeeATTimer;    // counted down by SysTick
+        
+        unsigned char XBeeQueueAT(unsigned char ATCommand1, unsigned char ATCommand2, const unsigned char * parameter, unsigned char length, unsigned short delay, XBeeATCallback_t callback) {
+            unsigned int i;
+            unsigned char next;
             
-            // set NJ
-            xbee_at_command.frameID = Random() | 0x1;
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'J';
-            xbee_at_command.parameterValue[0] = XBEE_JOINPERIOD;
-            xbee_at_command.varLen = 1;
-            XBeeSendATCommand();
+            if(length > 16) return 0;
+            
+            __disable_irq(); // commands are queued from the main loop and from callbacks
+            next = (FUNCXBeeATPush + 1) % XBEE_AT_QUEUE;
+            if(next == FUNCXBeeATPop) {
+                __enable_irq();
+                return 0;
+            }
+            FUNCXBeeATQueue[FUNCXBeeATPush].ATCommand1 = ATCommand1;
+            FUNCXBeeATQueue[FUNCXBeeATPush].ATCommand2 = ATCommand2;
+            for(i=0; i<length; i++) {
+                FUNCXBeeATQueue[FUNCXBeeATPush].parameterValue[i] = parameter[i];
+            }
+            FUNCXBeeATQueue[FUNCXBeeATPush].varLen = length;
+            FUNCXBeeATQueue[FUNCXBeeATPush].delay = delay;
+            FUNCXBeeATQueue[FUNCXBeeATPush].callback = callback;
+            FUNCXBeeATPush = next;
+            __enable_irq();
+            return 1;
         }
         
-        void XBeeStopJoin() {
-            // set NJ
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'J';
-            xbee_at_command.parameterValue[0] = 0x00;
-            xbee_at_command.varLen = 1;
-            XBeeSendATCommand();
+        unsigned char XBeeQueueATByte(unsigned char ATCommand1, unsigned char ATCommand2, unsigned char value, XBeeATCallback_t callback) {
+            return XBeeQueueAT(ATCommand1, ATCommand2, &value, 1, 0, callback);
         }
-
         
-        void XBeeJoin() {
-            xbee_at_response.isNew = 0;
-            
-            // NR to network reset
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-
-            // NJ0 to prevent others joining
-            XBeeStopJoin();
-            
-            // PL# to set power level
-            xbee_at_command.ATCommand1 = 'P';
-            xbee_at_command.ATCommand2 = 'L';
-            xbee_at_command.parameterValue[0] = XBEE_POWER_LEVEL;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // JN1 to enable join notification
-            xbee_at_command.ATCommand1 = 'J';
-            xbee_at_command.ATCommand2 = 'N';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // CE0 to disable coordinator mode
-            xbee_at_command.ATCommand1 = 'C';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // ID0 to set PAN ID to 0 (autofind network)
-            xbee_at_command.ATCommand1 = 'I';
-            xbee_at_command.ATCommand2 = 'D';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // EE1 for encryption enable
-            xbee_at_command.ATCommand1 = 'E';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+        unsigned char XBeeATBusy(void) {
+            return (FUNCXBeeATState != 0 || FUNCXBeeATPush != FUNCXBeeATPop);
+        }
+        
+        unsigned char XBeeATFree(void) {
+            // the command being sent or waited on keeps its slot until it completes
+            return XBEE_AT_QUEUE - 1 - (FUNCXBeeATPush + XBEE_AT_QUEUE - FUNCXBeeATPop) % XBEE_AT_QUEUE;
+        }
+        
+        void FUNCXBeeATComplete(unsigned char frameID, unsigned char status, unsigned char * data, unsigned short length) {
+            XBeeATCallback_t callback;
             
-            // D6 to enable RTS flow control
-            xbee_at_command.ATCommand1 = 'D';
-            xbee_at_command.ATCommand2 = '6';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            // the response and the timeout can turn up together, only the first one to get here completes the command
+            __disable_irq();
+            if(FUNCXBeeATState != 2 || FUNCXBeeATFrameID != frameID) {
+                __enable_irq();
+                return;
+            }
             
-            // KY### to set link key
-            xbee_at_command.ATCommand1 = 'K';
-            xbee_at_command.ATCommand2 = 'Y';
-            xbee_at_command.parameterValue[0] = 'U';
-            xbee_at_command.parameterValue[1] = 'N';
-            xbee_at_command.parameterValue[2] = 'I';
-            xbee_at_command.parameterValue[3] = 'V';
-            xbee_at_command.parameterValue[4] = 'E';
-            xbee_at_command.parameterValue[5] = 'R';
-            xbee_at_command.parameterValue[6] = 'S';
-            xbee_at_command.parameterValue[7] = 'A';
-            xbee_at_command.parameterValue[8] = 'L';
-            xbee_at_command.parameterValue[9] = '_';
-            xbee_at_command.parameterValue[10] = 'A';
-            xbee_at_command.parameterValue[11] = 'I';
-            xbee_at_command.parameterValue[12] = 'R';
-            xbee_at_command.parameterValue[13] = '1';
-            xbee_at_command.parameterValue[14] = '2';
-            xbee_at_command.parameterValue[15] = '3';
-            xbee_at_command.varLen = 16;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            // free the slot first, the callback may well queue another command
+            callback = FUNCXBeeATQueue[FUNCXBeeATPop].callback;
+            FUNCXBeeATFrameID = 0;
+            FUNCXBeeATPop = (FUNCXBeeATPop + 1) % XBEE_AT_QUEUE;
+            FUNCXBeeATState = 0;
+            __enable_irq();
+            if(callback) callback(status, data, length);
+        }
+        
+        void XBeeATPoll(void) {
+            unsigned int i;
             
-            // AC to apply
-            xbee_at_command.ATCommand1 = 'A';
-            xbee_at_command.ATCommand2 = 'C';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            if(FUNCXBeeATState == 0) {
+                if(FUNCXBeeATPush == FUNCXBeeATPop) return;
+                FUNCXBeeATTimer = (FUNCXBeeATQueue[FUNCXBeeATPop].delay * 1000) / SYSTICK_US;
+                FUNCXBeeATState = 1;
+            }
             
-            while(1) {
-                Delay(100);
-                
-                // AI0 to get association information
+            if(FUNCXBeeATState == 1 && FUNCXBeeATTimer == 0) {
                 xbee_at_command.frameID = Random() | 0x1;
-                xbee_at_command.ATCommand1 = 'A';
-                xbee_at_command.ATCommand2 = 'I';
-                xbee_at_command.varLen = 0;
-                //if(!XBeeSendATCommand()) XBeeCommFail();
-                if(!XBeeSendATCommand()) Delay(1000);
-                if(xbee_at_response.commandData[0] == 0) break;
+                xbee_at_command.ATCommand1 = FUNCXBeeATQueue[FUNCXBeeATPop].ATCommand1;
+                xbee_at_command.ATCommand2 = FUNCXBeeATQueue[FUNCXBeeATPop].ATCommand2;
+                for(i=0; i<FUNCXBeeATQueue[FUNCXBeeATPop].varLen; i++) {
+                    xbee_at_command.parameterValue[i] = FUNCXBeeATQueue[FUNCXBeeATPop].parameterValue[i];
+                }
+                xbee_at_command.varLen = FUNCXBeeATQueue[FUNCXBeeATPop].varLen;
+                
+                FUNCXBeeATFrameID = xbee_at_command.frameID;
+                FUNCXBeeATTimer = (XBEE_AT_TIMEOUT * 1000) / SYSTICK_US;
+                FUNCXBeeATState = 2;
+                XBeeSendFrame(ID_XBEE_ATCOMMAND, (unsigned char *)&xbee_at_command, sizeof(xbee_at_command)-2-16+xbee_at_command.varLen);
             }
-            
-            // WR to write changes
-            xbee_at_command.ATCommand1 = 'W';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            else if(FUNCXBeeATState == 2 && FUNCXBeeATTimer == 0) {
+                FUNCXBeeATComplete(FUNCXBeeATFrameID, 0xff, 0, 0);
+            }
+        }
+        
+        unsigned char XBeeATResponse(unsigned char * buffer, unsigned short length) {
+            // buffer is the AT response frame data: frame ID, AT command (2 bytes), status, then any data
+            if(FUNCXBeeATState != 2 || length < 4 || buffer[0] != FUNCXBeeATFrameID) return 0;
+            FUNCXBeeATComplete(buffer[0], buffer[3], buffer + 4, length - 4);
+            return 1;
+        }
+        
+        void XBeeATRequire(unsigned char status, unsigned char * data, unsigned short length) {
+            if(status != 0) XBeeCommFail();
         }
 
+        void XBeeAllowJoin() {
+            XBeeStopJoin();
+            XBeeQueueATByte('N', 'J', XBEE_JOINPERIOD, 0);
+        }
         
-        void XBeeCoordinatorJoin() {
-            xbee_at_response.isNew = 0;
-            
-            // NR to network reset
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set Powerlevel
-            xbee_at_command.ATCommand1 = 'P';
-            xbee_at_command.ATCommand2 = 'L';
-            xbee_at_command.parameterValue[0] = XBEE_POWER_LEVEL;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set CE mode
-            xbee_at_command.ATCommand1 = 'C';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set PAN ID
-            xbee_at_command.ATCommand1 = 'I';
-            xbee_at_command.ATCommand2 = 'D';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // encryption enable
-            xbee_at_command.ATCommand1 = 'E';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-
-            // encryption options
-            xbee_at_command.ATCommand1 = 'E';
-            xbee_at_command.ATCommand2 = 'O';
-            xbee_at_command.parameterValue[0] = 0x02;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set network key to zero
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'K';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set link key
-            xbee_at_command.ATCommand1 = 'K';
-            xbee_at_command.ATCommand2 = 'Y';
-            xbee_at_command.parameterValue[0] = 'U';
-            xbee_at_command.parameterValue[1] = 'N';
-            xbee_at_command.parameterValue[2] = 'I';
-            xbee_at_command.parameterValue[3] = 'V';
-            xbee_at_command.parameterValue[4] = 'E';
-            xbee_at_command.parameterValue[5] = 'R';
-            xbee_at_command.parameterValue[6] = 'S';
-            xbee_at_command.parameterValue[7] = 'A';
-            xbee_at_command.parameterValue[8] = 'L';
-            xbee_at_command.parameterValue[9] = '_';
-            xbee_at_command.parameterValue[10] = 'A';
-            xbee_at_command.parameterValue[11] = 'I';
-            xbee_at_command.parameterValue[12] = 'R';
-            xbee_at_command.parameterValue[13] = '1';
-            xbee_at_command.parameterValue[14] = '2';
-            xbee_at_command.parameterValue[15] = '3';
-            xbee_at_command.varLen = 16;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+        void XBeeStopJoin() {
+            XBeeQueueATByte('N', 'J', 0x00, 0);
+        }
+
+        void FUNCXBeeJoinAssociated(unsigned char status, unsigned char * data, unsigned short length) {
+            if(status == 0 && length > 0 && data[0] == 0) {
+                // WR to write changes
+                XBeeQueueAT('W', 'R', 0, 0, 0, XBeeATRequire);
+            }
+            else {
+                // AI0 to get association information, not associated yet so keep asking
+                XBeeQueueAT('A', 'I', 0, 0, status ? 1100 : 100, FUNCXBeeJoinAssociated);
+            }
+        }
+        
+        unsigned char XBeeJoin() {
+            static const unsigned char key[16] = {'U','N','I','V','E','R','S','A','L','_','A','I','R','1','2','3'};
+            unsigned char ok = 1;
             
-            // set NJ
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'J';
-            xbee_at_command.parameterValue[0] = 0x00;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            // all or nothing, a sequence cut short leaves the radio half set up
+            if(XBeeATFree() < 12) return 0;
             
-            // WR to write changes
-            xbee_at_command.ATCommand1 = 'W';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            ok &= XBeeQueueAT('N', 'R', 0, 0, 0, XBeeATRequire);   // NR to network reset
+            ok &= XBeeQueueATByte('N', 'J', 0x00, 0);             // NJ0 to prevent others joining
+            ok &= XBeeQueueATByte('P', 'L', XBEE_POWER_LEVEL, XBeeATRequire);   // PL# to set power level
+            ok &= XBeeQueueATByte('J', 'N', 1, XBeeATRequire);    // JN1 to enable join notification
+            ok &= XBeeQueueATByte('C', 'E', 0, XBeeATRequire);    // CE0 to disable coordinator mode
+            ok &= XBeeQueueATByte('I', 'D', 0, XBeeATRequire);    // ID0 to set PAN ID to 0 (autofind network)
+            ok &= XBeeQueueATByte('E', 'E', 1, XBeeATRequire);    // EE1 for encryption enable
+            ok &= XBeeQueueATByte('D', '6', 1, XBeeATRequire);    // D6 to enable RTS flow control
+            ok &= XBeeQueueAT('K', 'Y', key, 16, 0, XBeeATRequire); // KY### to set link key
+            ok &= XBeeQueueAT('A', 'C', 0, 0, 0, XBeeATRequire);   // AC to apply
+            ok &= XBeeQueueAT('A', 'I', 0, 0, 100, FUNCXBeeJoinAssociated);
+            return ok;
+        }
+
+        void FUNCXBeeCoordinatorFormed(unsigned char status, unsigned char * data, unsigned short length) {
+            if(status == 0) XBeeAllowJoin();
+            else XBeeQueueAT('A', 'I', 0, 0, 100, FUNCXBeeCoordinatorFormed); // AI to get association information
+        }
+        
+        unsigned char XBeeCoordinatorJoin() {
+            static const unsigned char key[16] = {'U','N','I','V','E','R','S','A','L','_','A','I','R','1','2','3'};
+            unsigned char ok = 1;
             
-            while(1) {
-                Delay(100);
-                
-                // AI0 to get association information
-                xbee_at_command.frameID = Random() | 0x1;
-                xbee_at_command.ATCommand1 = 'A';
-                xbee_at_command.ATCommand2 = 'I';
-                xbee_at_command.varLen = 0;
-                if(XBeeSendATCommand()) break;
-            }
+            // all or nothing, a sequence cut short leaves the radio half set up and never gets to allow joins
+            if(XBeeATFree() < 11) return 0;
             
-            XBeeAllowJoin();
+            ok &= XBeeQueueAT('N', 'R', 0, 0, 0, XBeeATRequire);   // NR to network reset
+            ok &= XBeeQueueATByte('P', 'L', XBEE_POWER_LEVEL, XBeeATRequire);   // set Powerlevel
+            ok &= XBeeQueueATByte('C', 'E', 1, XBeeATRequire);    // set CE mode
+            ok &= XBeeQueueATByte('I', 'D', 0, XBeeATRequire);    // set PAN ID
+            ok &= XBeeQueueATByte('E', 'E', 1, XBeeATRequire);    // encryption enable
+            ok &= XBeeQueueATByte('E', 'O', 0x02, XBeeATRequire); // encryption options
+            ok &= XBeeQueueATByte('N', 'K', 0, XBeeATRequire);    // set network key to zero
+            ok &= XBeeQueueAT('K', 'Y', key, 16, 0, XBeeATRequire); // set link key
+            ok &= XBeeQueueATByte('N', 'J', 0x00, XBeeATRequire); // set NJ
+            ok &= XBeeQueueAT('W', 'R', 0, 0, 0, XBeeATRequire);   // WR to write changes
+            ok &= XBeeQueueAT('A', 'I', 0, 0, 100, FUNCXBeeCoordinatorFormed);
+            return ok;
         }
 
         void XBeeSendFrame(unsigned char id, unsigned char * buffer, unsigned short length) {
@@ -5148,6 +5201,7 @@ unsigned char PRGPoll(void) {
         void XBeeSetDefaults(void) {
             unsigned char changes = 0;
             // Try to enter AT mode at 115200 baud
+            FUNCXBeeState = 0; // replies only go in the text buffer while not in a frame
             FUNCXBeetBufCount = 0;
             FUNCTimeout = 1000;
             UARTWrite((unsigned char *)"+++", 3);
@@ -5286,6 +5340,11 @@ unsigned char PRGPoll(void) {
 
         void XBeeInit(void) {
             FUNCXBeeState = 0;
+            FUNCXBeeRingPush = 0;
+            FUNCXBeeRingPop = 0;
+            FUNCXBeeFramePush = 0;
+            FUNCXBeeFramePop = 0;
+            FUNCXBeeProcessing = 0;
             UARTInit(115200);
             FUNCXBeetBufCount = 0;
             
@@ -5301,7 +5360,7 @@ unsigned char PRGPoll(void) {
             // Start timeout and wait to see if XBee is already configured (should receive modem_status API frame)
             FUNCTimeout = 1000;
             xbee_modem_status.isNew = 0;
-            while(FUNCTimeout > 0 && xbee_modem_status.isNew == 0);
+            while(FUNCTimeout > 0 && xbee_modem_status.isNew == 0) XBeeProcess();
             
             if(xbee_modem_status.isNew == 0) {
                 XBeeSetDefaults();
@@ -5309,50 +5368,89 @@ unsigned char PRGPoll(void) {
         }
         
         
+        void XBeeProcess(void) {
+            // Hand complete frames to XBeeMessage, outside of the interrupt.  Frames are released in order once
+            // XBeeMessage returns, so the buffer it's given is only valid until then
+            unsigned char frame;
+            unsigned short offset, length;
+            
+            if(FUNCXBeeProcessing) return; // already running lower down (e.g. waiting for an AT response), leave it to that
+            FUNCXBeeProcessing = 1;
+            
+            while(FUNCXBeeFramePop != FUNCXBeeFramePush) {
+                frame = FUNCXBeeFramePop;
+                offset = FUNCXBeeFrameOffset[frame];
+                length = FUNCXBeeFrameLength[frame];
+                
+                if(FUNCXBeeRing[offset] != ID_XBEE_ATRESPONSE || XBeeATResponse(&FUNCXBeeRing[offset+1], length-1) == 0) {
+                    if(XBeeMessage) XBeeMessage(FUNCXBeeRing[offset], &FUNCXBeeRing[offset+1], length-1);
+                }
+                
+                FUNCXBeeRingPop = offset + length;
+                FUNCXBeeFramePop = (frame + 1) % XBEE_FRAME_COUNT;
+            }
+            
+            XBeeATPoll();
+            
+            FUNCXBeeProcessing = 0;
+        }
+        
         void XBUARTInterrupt(unsigned char byte) {
-            // insert into buffer
-            if(FUNCXBeetBufCount < TBUF_LEN) FUNCXBeetBuf[FUNCXBeetBufCount++] = byte;
+            unsigned short pop;
             
             switch(FUNCXBeeState) {
                 default: // fall through to 0
                 case 0: // find start character 0x7e
                     if(byte == 0x7e) FUNCXBeeState++;
+                    else if(FUNCXBeetBufCount < TBUF_LEN) FUNCXBeetBuf[FUNCXBeetBufCount++] = byte; // AT command mode replies
                     break;
                 case 1: // length MSB
                     FUNCXBeeLength = byte << 8;
                     FUNCXBeeState++;
                     break;
-                case 2: // length LSB
+                case 2: // length LSB, length value includes ID
                     FUNCXBeeLength |= byte;
-                    if(FUNCXBeeLength > 1) FUNCXBeeState++;
-                    else FUNCXBeeState = 0;
                     FUNCXBeePacket = 0;
                     FUNCXBeeChecksum = 0;
-                    break;
-                case 3: // cmd frame
-                    FUNCXBeeID = byte;
-                    FUNCXBeeLength--; // length value includes ID, we need length in terms of payload size
-                    FUNCXBeeState++;
-                    FUNCXBeeChecksum += byte;
-                    break;
-                case 4: // cmd data
-                    if(FUNCXBeePacket < XBEE_BUFFER_SIZE) {
-                        FUNCXBeeBuffer[FUNCXBeePacket] = byte;
+                    if(FUNCXBeeLength < 2 || FUNCXBeeLength > XBEE_BUFFER_SIZE) {
+                        FUNCXBeeState = 0;
+                        break;
                     }
-                    FUNCXBeePacket++;
                     
-                    if(FUNCXBeePacket >= FUNCXBeeLength) FUNCXBeeState++;
+                    // find room for the whole frame in one piece, going back to the start if it won't fit on the end
+                    pop = FUNCXBeeRingPop;
+                    FUNCXBeeState = 5;
+                    if(FUNCXBeeRingPush >= pop) {
+                        if(FUNCXBeeRingPush + FUNCXBeeLength < XBEE_RING_SIZE) FUNCXBeeState = 3;
+                        else if(FUNCXBeeLength < pop) {
+                            FUNCXBeeRingPush = 0;
+                            FUNCXBeeState = 3;
+                        }
+                    }
+                    else if(FUNCXBeeRingPush + FUNCXBeeLength < pop) FUNCXBeeState = 3;
+                    
+                    if((FUNCXBeeFramePush + 1) % XBEE_FRAME_COUNT == FUNCXBeeFramePop) FUNCXBeeState = 5;
                     
+                    if(FUNCXBeeState == 3) FUNCXBeeFrameStart = FUNCXBeeRingPush;
+                    else FUNCXBeeDrops++;
+                    break;
+                case 3: // ID and data
+                    FUNCXBeeRing[FUNCXBeeFrameStart + FUNCXBeePacket++] = byte;
                     FUNCXBeeChecksum += byte;
+                    if(FUNCXBeePacket >= FUNCXBeeLength) FUNCXBeeState++;
                     break;
-                case 5: // checksum
+                case 4: // checksum
                     if(0xff - FUNCXBeeChecksum == byte) {
-                        if(XBeeMessage) XBeeMessage(FUNCXBeeID, FUNCXBeeBuffer, FUNCXBeeLength);
-                    }
-                    else {
+                        FUNCXBeeFrameOffset[FUNCXBeeFramePush] = FUNCXBeeFrameStart;
+                        FUNCXBeeFrameLength[FUNCXBeeFramePush] = FUNCXBeeLength;
+                        FUNCXBeeRingPush = FUNCXBeeFrameStart + FUNCXBeeLength;
+                        FUNCXBeeFramePush = (FUNCXBeeFramePush + 1) % XBEE_FRAME_COUNT; // publish once it's all in
                     }
                     FUNCXBeeState = 0;
                     break;
+                case 5: // no room, skip the frame and its checksum
+                    if(++FUNCXBeePacket > FUNCXBeeLength) FUNCXBeeState = 0;
+                    break;
                 case 0xff: // bypass mode
                     if(XBeeMessage) XBeeMessage(0, &byte, 1);
                     break;
@@ -28,6 +28,43 @@
     #define PACKED __attribute__ ((packed))
 #endif
 
+// RAMFUNC functions are copied to sram0 at startup (.ramfunc in linker.ld) to run without flash
+// wait states. long_call lets flash callers reach them without going through a linker veneer
+#ifndef RAMFUNC
+    #if RAMFUNC_EN
+        #define RAMFUNC __attribute__ ((section(".ramfunc"), long_call, optimize(RAMFUNC_OPTIMIZE)))
+    #else
+        #define RAMFUNC
+    #endif
+#endif
+
+// Large zeroed (BSS_) or initialised (DATA_) buffers can be moved out of sram0 into the secondary banks, the
+// .bss_RAM2/3 and .data_RAM2/3 rules in linker.ld pick them up and startup zeroes or copies them like sram0's.
+// The USB ROM driver owns usbsram, so DATA_USBSRAM/BSS_USBSRAM fall back to sram0 when USB is enabled
+#if RAM_BANKS_EN
+    #define BSS_SRAM1       __attribute__ ((section(".bss.$sram1")))
+    #define DATA_SRAM1      __attribute__ ((section(".data.$sram1")))
+#else
+    #define BSS_SRAM1
+    #define DATA_SRAM1
+#endif
+
+#if RAM_BANKS_EN && !USB_EN
+    #define BSS_USBSRAM     __attribute__ ((section(".bss.$usbsram")))
+    #define DATA_USBSRAM    __attribute__ ((section(".data.$usbsram")))
+#else
+    #define BSS_USBSRAM
+    #define DATA_USBSRAM
+#endif
+
+#ifndef THAL_RAMFUNC
+    #if THAL_RAMFUNC_EN
+        #define THAL_RAMFUNC RAMFUNC
+    #else
+        #define THAL_RAMFUNC
+    #endif
+#endif
+
 #ifndef TRUE
     #define TRUE        1
     #define FALSE       0
@@ -81,11 +118,11 @@ static inline unsigned int MakeInt(unsigned char byte4, unsigned char byte3, uns
 */
 
 // *** Fast trig approximation functions
-float finvSqrt(float x);
-float fatan2(float y, float x);
-float fasin(float x);
-float fsin(float x);
-float fcos(float x);
+THAL_RAMFUNC float finvSqrt(float x);
+THAL_RAMFUNC float fatan2(float y, float x);
+THAL_RAMFUNC float fasin(float x);
+THAL_RAMFUNC float fsin(float x);
+THAL_RAMFUNC float fcos(float x);
 
 // *** Random number functions
 #if RAND_MERSENNE
@@ -1394,6 +1431,7 @@ static inline void RSTReset(void) { ResetInit(); }
         void FlashStart(void);
         void FlashEnd(void);
         void FlashWait(void);
+        unsigned char FlashBusy(void);
         void FlashWrEn(void);
         void FlashEraseChip(void);
         void FlashErase4k(unsigned int address);
@@ -1409,18 +1447,34 @@ static inline void RSTReset(void) { ResetInit(); }
         void FlashRawWrite(unsigned int address, unsigned char * data, unsigned int length);
         unsigned char FlashRawReadByte(unsigned int address);
         void FlashRawRead(unsigned int address, unsigned char * data, unsigned int length);
+        void FlashReadCommand(unsigned int address);
+        void FlashBurstRead(unsigned char * data, unsigned int length);
         unsigned char FlashVerify(unsigned int address, unsigned char * data, unsigned int length);
         
+        // sequential appends into pre-erased space
+        extern unsigned int FUNCFlashAppendStart, FUNCFlashAppendEnd;
+        extern unsigned int FUNCFlashAppendAddr;
+        extern unsigned int FUNCFlashEraseAddr;
+        extern unsigned int FUNCFlashEraseAhead;
+        void FlashAppendInit(unsigned int start, unsigned int end, unsigned int address, unsigned int erased, unsigned int eraseAhead);
+        unsigned int FlashAppendAddress(void);
+        unsigned int FlashAppendEraseAddress(void);
+        unsigned int FlashAppendSpace(void);
+        unsigned char FlashAppendService(void);
+        unsigned char FlashAppendPage(unsigned char * data, unsigned int length);
+        
         // buffered versions of the above
-        extern volatile unsigned int FUNCFlashCurrentSector;
-        extern unsigned char FUNCFlashSectorBuffer[4096];
-        extern volatile unsigned char FUNCFlashSectorChanged;
-        void FlashBufferSector(unsigned int address);
-        void FlashFlushBuffer(void);
-        void FlashWriteByte(unsigned int address, unsigned char data);
-        void FlashWrite(unsigned int address, unsigned char * data, unsigned int length);
-        unsigned char FlashReadByte(unsigned int address);
-        void FlashRead(unsigned int address, unsigned char * data, unsigned int length);
+        #if FLASH_BUFFERED
+            extern volatile unsigned int FUNCFlashCurrentSector;
+            extern unsigned char FUNCFlashSectorBuffer[4096];
+            extern volatile unsigned char FUNCFlashBufferChanged;
+            void FlashBufferSector(unsigned int address);
+            void FlashFlushBuffer(void);
+            void FlashWriteByte(unsigned int address, unsigned char data);
+            void FlashWrite(unsigned int address, unsigned char * data, unsigned int length);
+            unsigned char FlashReadByte(unsigned int address);
+            void FlashRead(unsigned int address, unsigned char * data, unsigned int length);
+        #endif
         
     #endif
 #endif
@@ -1515,6 +1569,17 @@ static inline void RSTReset(void) { ResetInit(); }
             unsigned short varLen;
         } PACKED xbee_node_identification_indicator_t;
         
+        typedef void (*XBeeATCallback_t)(unsigned char status, unsigned char * data, unsigned short length);
+        
+        typedef struct xbee_at_queued_struct {
+            unsigned char ATCommand1;
+            unsigned char ATCommand2;
+            unsigned char parameterValue[16];
+            unsigned char varLen;
+            unsigned short delay;           // ms to wait before sending
+            XBeeATCallback_t callback;
+        } xbee_at_queued_t;
+        
         extern xbee_modem_status_t xbee_modem_status;
         extern xbee_at_command_t xbee_at_command;
         extern xbee_at_response_t xbee_at_response;
@@ -1528,9 +1593,12 @@ static inline void RSTReset(void) { ResetInit(); }
         unsigned int XBeetBufCompare(unsigned char * compare, unsigned int length);
         
         extern volatile unsigned int FUNCXBeeState;
-        extern volatile unsigned short FUNCXBeeLength, FUNCXBeeID, FUNCXBeePacket;
+        extern volatile unsigned short FUNCXBeeLength, FUNCXBeePacket;
         extern volatile unsigned char FUNCXBeeChecksum;
-        extern unsigned char FUNCXBeeBuffer[XBEE_BUFFER_SIZE];
+        extern unsigned char FUNCXBeeRing[XBEE_RING_SIZE];
+        extern volatile unsigned short FUNCXBeeRingPush, FUNCXBeeRingPop;
+        extern volatile unsigned int FUNCXBeeDrops;
+        void XBeeProcess(void);
     
         extern WEAK void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length);
         void XBeeInit(void);
@@ -1538,12 +1606,20 @@ static inline void RSTReset(void) { ResetInit(); }
         void XBeeCommFail(void);
         void XBeeSetDefaults(void);
         void XBeeFactoryReset(void);
-        void XBeeCoordinatorJoin(void);
+        unsigned char XBeeCoordinatorJoin(void);
         void XBeeAllowJoin(void);
         void XBeeStopJoin(void);
-        void XBeeJoin(void);
+        unsigned char XBeeJoin(void);
         void XBeeSendFrame(unsigned char id, unsigned char * buffer, unsigned short length);
         unsigned char XBeeSendATCommand(void);
+        unsigned char XBeeQueueAT(unsigned char ATCommand1, unsigned char ATCommand2, const unsigned char * parameter, unsigned char length, unsigned short delay, XBeeATCallback_t callback);
+        unsigned char XBeeQueueATByte(unsigned char ATCommand1, unsigned char ATCommand2, unsigned char value, XBeeATCallback_t callback);
+        unsigned char XBeeATBusy(void);
+        unsigned char XBeeATFree(void);
+        void XBeeATPoll(void);
+        unsigned char XBeeATResponse(unsigned char * buffer, unsigned short length);
+        void XBeeATRequire(unsigned char status, unsigned char * data, unsigned short length);
+        extern volatile unsigned short FUNCXBeeATTimer;
         unsigned char XBeeSendPacket(void);
         unsigned char XBeeWriteBroadcast(unsigned char * buffer, unsigned short length);
         unsigned char XBeeWriteCoordinator(unsigned char * buffer, unsigned short length);
@@ -9,21 +9,72 @@
 #define THAL_PANIC          3           // Number of seconds after no message from Thalamus before considering Thalamus fail
 #define IDLE_SPRF           0.9         // Some filtering on the CPU load
 #define IDLE_MAX            0x1ff480    // Set this to the number that the idleCounter counts up to every second.  This is used to measure the CPU load - when there are no interrupts (i.e. processor not "busy"), the idleCounter is being incremented
-
-#define MAX_WAYPOINTS       20 // TODO: maybe move waypoints into EEPROM
+#define LINK_CAPACITY_MAX   100         // Link capacity estimate is a percentage of the requested stream rates
+#define LINK_CAPACITY_MIN   10          // Never throttle the streams below this percentage
+#define LINK_CAPACITY_STEP  5           // Additive increase per second while frames are getting through cleanly
+#define LINK_RETRY_LIMIT    2           // Average MAC retries per delivered frame above which the link counts as congested
+#define TRUNCATE_TIMEOUT    3           // Number of seconds after the last TRUNCATE announcement from Hypx before going back to full payloads
+
+#define MAX_WAYPOINTS       512 // Missions are stored in SPI flash, only WAYPOINT_CACHE of them are held in RAM at a time
+#define WAYPOINT_CACHE      4   // number of waypoints from waypointCurrent onwards kept in RAM
+#define MISSION_FLASH_ADDR  0x000000    // start of the mission area in SPI flash, header sector followed by the records
+#define MISSION_MAGIC       0x4d495332  // "MIS2", marks a completely received mission in the header
+#define MISSION_PATCH_MAGIC 0x50415443  // "PATC", marks a complete sector image in the scratch sector
+#define MISSION_COPY_RECORDS 8          // records copied per message loop while patching a sector
+#define MISSION_SCRATCH_ADDR ((MISSION_RECORD_ADDR(MAX_WAYPOINTS) + 0xfff) & 0xfffff000) // spare sector after the records, used when patching them in place
 #define WAYPOINT_HOME       MAX_WAYPOINTS+1 // there is one waypoint storage location that is never used between Waypoint home and the last waypoint, this is in case I screw up with the waypoint management and accidentally try to send the craft back to home by mistake
 #define WAYPOINT_TEMP       MAX_WAYPOINTS+2
 #define WAYPOINT_TIMEOUT    500/MESSAGE_LOOP_HZ // value = timeout in ms / message_loop_hz
 #define WAYPOINT_TRIES      5   // number of times to retry waypoint
+#define WAYPOINT_WINDOW     4   // number of MISSION_REQUESTs kept outstanding while receiving a mission
 #define WAYPOINT_MIN_RADIUS 1
 #define WAYPOINT_SAFE_HEIGHT 2  // altitude above home to use
+#define GPS_PREDICT_MAX     400 // Maximum time in ms to dead-reckon from the last GPS fix (fixes normally arrive every 200ms)
+
+#define LOG_FLASH_ADDR      (MISSION_SCRATCH_ADDR + 0x1000) // flight recorder uses the rest of the SPI flash after the mission area
+#define LOG_FLASH_END       0x200000    // end of the SPI flash (16Mbit), the log wraps round to LOG_FLASH_ADDR here
+#define LOG_MAGIC           0x474c      // "LG", marks a log block header
+#define LOG_BLOCK_SIZE      FLASH_PAGE_SIZE // bytes per log block including its header, each block is appended as one flash page
+#define LOG_ERASE_AHEAD     2           // number of 4k sectors kept erased in front of the write pointer
+#define LOG_IO_DIVIDER      5           // attitude and raw IMU are logged every message loop, inputs, outputs and status every this many
+#define LOG_CHUNK_SIZE      32          // bytes of log in each MEMORY_VECT of a download
+#define LOG_VECT_VER        0x4c        // MEMORY_VECT ver field that marks it as a log download chunk
+#define LOG_DL_WINDOW       32          // chunks that can be sent ahead of the GCS's last acknowledgement
+#define LOG_DL_RATE         50          // chunks per second at full link capacity, scaled by linkCapacity the same as the streams
+#define LOG_DL_TIMEOUT      1           // seconds without an acknowledgement before sending again from the oldest unacknowledged chunk
+#define LOG_DL_ABANDON      10          // seconds without an acknowledgement before giving up on the download
+// Log download commands, sent as COMMAND_LONG to mavlinkID.  The ids are custom ones below MAV_CMD_NAV_WAYPOINT (16),
+// alongside the custom 0 reset, each is answered with a COMMAND_ACK:
+//   LOG_CMD_DOWNLOAD with param1 -1: sends LOGFIRST, LOGEND and LOGCHUNKS as NAMED_VALUE_INTs, the log being the chunks
+//     from LOGFIRST up to (not including) LOGEND, wrapping round at LOGCHUNKS.  Refused while recording.
+//   LOG_CMD_DOWNLOAD with param1 a chunk: streams chunks from there as MEMORY_VECTs with ver LOG_VECT_VER, address the
+//     chunk number and value its LOG_CHUNK_SIZE bytes, up to LOG_DL_WINDOW ahead of the last acknowledgement
+//   LOG_CMD_ACK: sent by the GCS several times a second, see below.  Without one for LOG_DL_TIMEOUT the window is sent
+//     again, and after LOG_DL_ABANDON the download stops and has to be restarted from the first missing chunk.
+//   LOG_CMD_STOP: ends the download
+// tools/logdl.c is the reference receiver, and tools/logsim.c runs this code against a simulated flash and lossy link.
+#define LOG_CMD_DOWNLOAD    1           // custom COMMAND_LONG: param1 first chunk (-1 to only report the log), param2 chunk to stop at (-1 for the end)
+#define LOG_CMD_ACK         2           // custom COMMAND_LONG: param1 next chunk wanted, param2 to param7 missing chunks before it to resend (-1 if unused)
+#define LOG_CMD_STOP        3           // custom COMMAND_LONG: abandon the download
 
 
 // *** Status stuff
 volatile unsigned int allowTransmit;
 
+// *** Link capacity stuff
+// The XBee interrupt counts up the transmit status frames, the RIT works out the difference once a second and adjusts
+// linkCapacity: halved on any delivery failure or heavy retrying, otherwise increased by LINK_CAPACITY_STEP.
+volatile unsigned short linkTxDelivered;    // only written by the XBee interrupt
+volatile unsigned short linkTxFailed;       // only written by the XBee interrupt
+volatile unsigned short linkTxRetries;      // only written by the XBee interrupt
+unsigned short linkLastDelivered;
+unsigned short linkLastFailed;
+unsigned short linkLastRetries;
+unsigned int linkCapacity;
+
 // *** LEDs and buttons stuff
 volatile unsigned int flashVLED;
+unsigned char xbeeJoining;        // join AT commands are queued up, flashVLED until they have all gone
 volatile unsigned int PRGTimer;
 volatile unsigned int PRGLastState;
 volatile unsigned int PRGPushTime;
@@ -40,12 +91,18 @@ unsigned short heartbeatWatchdog;
 unsigned short gpsWatchdog;
 unsigned short thalWatchdog;
 
+// *** Payload truncation stuff
+// Hypx announces that it will zero-fill truncated payloads by sending a NAMED_VALUE_INT "TRUNCATE" once a second, and
+// until that stops arriving MAVSendPacket leaves the trailing zeros of each payload off.
+volatile unsigned char linkTruncate;
+unsigned short linkTruncateWatchdog;
+
 // *** MAVLINK stuff
 unsigned char mavlinkID;
 
 // Sent messages
 mavlink_status_t mavlink_status;
-mavlink_message_t mavlink_tx_msg;
+const unsigned char mavlinkCRCExtra[256] = MAVLINK_MESSAGE_CRCS;
 mavlink_heartbeat_t mavlink_heartbeat;
 mavlink_sys_status_t mavlink_sys_status;
 mavlink_gps_raw_int_t mavlink_gps_raw_int;
@@ -62,6 +119,7 @@ mavlink_gps_global_origin_t mavlink_gps_global_origin;
 mavlink_named_value_float_t mavlink_named_value_float;
 mavlink_named_value_int_t mavlink_named_value_int;
 mavlink_debug_vect_t mavlink_debug_vect;
+mavlink_memory_vect_t mavlink_memory_vect;
 mavlink_debug_t mavlink_debug;
 mavlink_statustext_t mavlink_statustext;
 
@@ -87,6 +145,9 @@ mavlink_mission_clear_all_t mavlink_mission_clear_all;
 mavlink_mission_set_current_t mavlink_mission_set_current;
 mavlink_mission_current_t mavlink_mission_current;
 mavlink_set_mode_t mavlink_set_mode;
+mavlink_named_value_int_t mavlink_named_value_int_rx;
+mavlink_mission_write_partial_list_t mavlink_mission_write_partial_list;
+mavlink_mission_request_partial_list_t mavlink_mission_request_partial_list;
 
 // Disabled messages
 // mavlink_global_position_setpoint_int_t
@@ -96,12 +157,9 @@ mavlink_set_mode_t mavlink_set_mode;
 
 mavlink_mission_request_list_t mavlink_mission_request_list;
 
-// Variables
-unsigned char mavlink_message_buf[MAVLINK_MAX_PACKET_LEN];
-unsigned short mavlink_message_len;
-
 // Timers
-unsigned char dataRate[MAV_DATA_STREAM_ENUM_END];
+unsigned char dataRate[MAV_DATA_STREAM_ENUM_END];    // rates requested by the GCS
+unsigned char streamRate[MAV_DATA_STREAM_ENUM_END];  // rates actually used, scaled by linkCapacity
 unsigned char heartbeatCounter;
 unsigned short extra3ChannelCounter;
 unsigned short extra2ChannelCounter;
@@ -116,12 +174,19 @@ unsigned int gpsSendCounter, posupdate;
 
 // Functions
 void MAVLinkInit(void);
+void MAVSendPacket(unsigned char msgid, unsigned char compid, void * packet, unsigned char length);
 void MAVSendHeartbeat(void);
 void MAVSendFloat(char * name, float value);
 void MAVSendInt(char * name, int value);
+void LinkCapacityUpdate(void);
+void LinkApplyRates(void);
 void MAVSendVector(char * name, float valX, float valY, float valZ);
 void MAVSendText(unsigned char severity, char * text);
+void MAVSendMissionItem(unsigned short seq, unsigned char targetSystem, unsigned char targetComponent);
+unsigned int MAVSendQueuedParams(void);
 void MAVLinkParse(unsigned char UARTData);
+void MAVLinkParseBuffer(unsigned char * buffer, unsigned int length);
+void MAVLinkDispatch(void);
 
 // *** GPS stuff
 gps_nav_posecef_t gps_nav_posecef;
@@ -148,15 +213,44 @@ ilink_atdemand_t ilink_atdemand;
 ilink_gpsfly_t ilink_gpsfly;
 ilink_debug_t ilink_debug;
 
-typedef struct paramBuffer_struct {
+// *** Parameter mirror
+// Hypo keeps a copy of Thalamus's parameter table, filled once Thalamus identifies itself and updated whenever Thalamus sends
+// a parameter back (which it does after every PARAM_SET).  List and read requests from the GCS are answered from here,
+// only writes go across the ILink.
+typedef struct paramMirror_struct {
+    char name[16];
+    float value;
+} paramMirror_t;
+
+#define PARAM_MIRROR_SIZE   96  // should be at least Thalamus's paramCount, past that the parameters are relayed instead
+#define PARAM_SEND_PER_TICK 2   // number of PARAM_VALUEs sent to the GCS per RIT tick
+
+paramMirror_t paramMirror[PARAM_MIRROR_SIZE] BSS_USBSRAM;
+unsigned char paramMirrorHave[(PARAM_MIRROR_SIZE+7)/8];     // bitmap of entries received from Thalamus
+unsigned char paramSendPending[(PARAM_MIRROR_SIZE+7)/8];    // bitmap of entries waiting to go to the GCS
+unsigned short paramMirrorCount, paramMirrorReceived, paramSendScan;
+unsigned char paramMirrorComplete, paramListPending;
+
+// If Thalamus turns out to have more parameters than that, list and read requests go to Thalamus and what it sends back is
+// passed straight on to the GCS through this queue, the same as before there was a mirror
+typedef struct paramRelay_struct {
     char name[16];
     float value;
     unsigned short id;
-} paramBuffer_t;
+} paramRelay_t;
+
+#define PARAM_RELAY_SIZE    16
+
+paramRelay_t paramRelay[PARAM_RELAY_SIZE];
+unsigned short paramRelayPush, paramRelayPop, paramRelayCount;  // paramRelayCount is Thalamus's paramCount
+unsigned char paramMirrorOverflow;
+
+#define PARAM_BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 0x7)))
+#define PARAM_BIT_SET(map, i)   ((map)[(i) >> 3] |= (1 << ((i) & 0x7)))
+#define PARAM_BIT_CLR(map, i)   ((map)[(i) >> 3] &= ~(1 << ((i) & 0x7)))
 
-#define PARAMBUFFER_SIZE    50
-paramBuffer_t paramBuffer[PARAMBUFFER_SIZE];
-unsigned int paramPointer = PARAMBUFFER_SIZE;
+void ParamMirrorRequest(void);
+void ParamQueueAll(void);
 
 // *** Xbee stuff
 xbee_modem_status_t xbee_modem_status;
@@ -174,20 +268,190 @@ typedef struct {
     float param2;
     float param3;
     float param4;
-    float x;
-    float y;
-    float z;
+    int north;      // position in mm in the local NED frame, see NavToLocal()
+    int east;
+    int down;
 } waypointStruct;
 
-waypointStruct waypoint[MAX_WAYPOINTS+3];
+// Packed mission record as stored in flash, positions are kept global so that the records don't need rewriting if home moves
+typedef struct {
+    unsigned short command;
+    unsigned char autocontinue;
+    unsigned char reserved;
+    float param1;
+    float param2;
+    float param3;
+    float param4;
+    int lat;        // 1e-7 degrees
+    int lon;
+    int alt;        // mm above MSL
+} PACKED missionRecord_t; // 32 bytes, 127 of them to a 4k sector
+
+typedef struct {
+    unsigned int magic;
+    unsigned short count;
+    unsigned short countCheck;  // ~count
+} PACKED missionHeader_t;
+
+// Written to the last record slot of the scratch sector once it holds the complete new image of a record sector, a reset
+// from then until the patch has finished is recovered by MissionLoad() copying the image back
+typedef struct {
+    unsigned int magic;
+    unsigned int sector;        // address of the record sector the image is for
+    unsigned int sectorCheck;   // ~sector
+    unsigned int length;        // bytes of records in the image
+} PACKED missionMarker_t;
+
+// Only 127 records go in each sector so that the one left over in the scratch sector can hold the marker
+#define MISSION_SECTOR_RECORDS      127
+#define MISSION_SECTOR_ADDR(seq)    (MISSION_FLASH_ADDR + 0x1000 + ((seq) / MISSION_SECTOR_RECORDS) * 0x1000)
+#define MISSION_RECORD_ADDR(seq)    (MISSION_SECTOR_ADDR(seq) + ((seq) % MISSION_SECTOR_RECORDS) * sizeof(missionRecord_t))
+#define MISSION_MARKER_ADDR         (MISSION_SCRATCH_ADDR + MISSION_SECTOR_RECORDS * sizeof(missionRecord_t))
+
+waypointStruct waypoint[WAYPOINT_CACHE];    // lookahead window, waypoint[0] is waypointCacheBase
+waypointStruct waypointHome;
+unsigned short waypointCacheBase, waypointCacheCount;
+
+void MissionLoad(void);
+void MissionErase(unsigned short count);
+void MissionCommit(unsigned short count);
+void MissionWriteItem(unsigned short seq, missionRecord_t * record);
+unsigned char MissionQueueItem(unsigned short seq, missionRecord_t * record, unsigned char state);
+void MissionReadItem(unsigned short seq, missionRecord_t * record);
+unsigned char MissionPendingFree(void);
+void MissionService(void);
+void WaypointPrefetch(unsigned short seq);
+unsigned char WaypointAvailable(unsigned short seq);
+waypointStruct * WaypointGet(unsigned short seq);
+
+// Slow flash work for the mission is done a step per message loop by MissionService(), which never waits on the flash
+#define MISSION_JOB_IDLE    0
+#define MISSION_JOB_ERASE   1   // erasing the sectors from missionJobAddr up to missionJobEnd, one per message loop
+#define MISSION_JOB_COPY    2   // building the new image of missionPatchSector in the scratch sector
+#define MISSION_JOB_SWAP    3   // image and marker are written, erasing missionPatchSector
+#define MISSION_JOB_WRITE   4   // copying the image back into missionPatchSector
+
+unsigned char missionJob;
+unsigned int missionJobAddr, missionJobEnd;
+unsigned int missionPatchSector;
+
+// Received items wait here until MissionService() writes them, those of a partial upload are patched into the live mission
+// with all the others for the same sector going in together
+#define MISSION_PENDING     WAYPOINT_WINDOW
+#define MISSION_SLOT_FREE   0
+#define MISSION_SLOT_PATCH  1   // waiting for the next patch of its sector
+#define MISSION_SLOT_CLAIMED 2  // being written by the patch under way
+#define MISSION_SLOT_WRITE  3   // goes straight into the erased area of a new mission
+
+typedef struct {
+    unsigned short seq;
+    unsigned char state;
+    missionRecord_t record;
+} missionPending_t;
+
+missionPending_t missionPending[MISSION_PENDING];
+unsigned char missionCommitPending;     // the header is written once the flash work before it is done
+unsigned short missionCommitCount;
 
 unsigned short waypointCurrent, waypointCount, waypointReceiveIndex;
 unsigned char waypointTries, waypointValid, waypointHomeValid, waypointGo, waypointReached;
 unsigned short waypointTimer;
+
+// Mission upload, items in [waypointUploadStart, waypointUploadEnd) are requested up to WAYPOINT_WINDOW at a time,
+// and a bitmap of the ones received means that after a timeout only the gaps are requested again
+unsigned char waypointUploading, waypointPartial;
+unsigned short waypointUploadStart, waypointUploadEnd, waypointRequestCursor;
+unsigned char waypointInFlight;
+unsigned char waypointReceived[(MAX_WAYPOINTS+7)/8];
+#define WAYPOINT_RECEIVED(seq)  (waypointReceived[(seq) >> 3] & (1 << ((seq) & 0x7)))
+
+// Partial mission download, items in [waypointSendCursor, waypointSendEnd) are streamed out from the RIT
+unsigned short waypointSendCursor, waypointSendEnd;
+unsigned char waypointSendID, waypointSendComp;
 unsigned int waypointLoiter;
 unsigned char waypointProviderID, waypointProviderComp;
 float waypointPhase;
 
+// *** Flight recorder
+// While Thalamus is armed, timestamped ILink and GPS messages are packed into LOG_BLOCK_SIZE blocks which are appended to a
+// circular log in SPI flash.  Each block has its own header and CRC, so after a power cut the end of the log is found again
+// from the headers, and a block that was only half programmed is simply skipped when the log is read back.
+typedef struct {
+    unsigned short magic;       // LOG_MAGIC
+    unsigned short flight;      // goes up by one every time recording starts
+    unsigned int seq;           // counts up across the whole log, the newest block is the one with the highest
+    unsigned int seqCheck;      // ~seq, so that a header torn by a power cut isn't taken for a real one
+    unsigned short used;        // bytes of records following the header
+    unsigned short crc;         // over the header up to here, and the records
+} PACKED logHeader_t;
+
+typedef struct {
+    unsigned char source;       // LOG_SOURCE_xxx
+    unsigned char length;       // bytes of message following
+    unsigned short id;          // ILink or UBX message ID
+    unsigned int time;          // sysMS
+} PACKED logRecord_t;
+
+#define LOG_SOURCE_ILINK    1
+#define LOG_SOURCE_GPS      2
+
+unsigned char logBlock[2][LOG_BLOCK_SIZE];  // the RIT fills one while the other waits to be programmed
+unsigned int logFill;                       // block being filled
+unsigned int logFillUsed;                   // bytes of it used, header included
+unsigned char logReady;                     // the other block is sealed and waiting to be programmed
+unsigned int logSeq;
+unsigned short logFlight;
+unsigned char logRecording;
+unsigned int logDrops;                      // records (or the end of a flight) lost because both blocks were full
+unsigned int logPollCounter;
+unsigned int logStatusCounter;              // message loops since the last THALSTAT
+
+void LogInit(void);
+void LogStart(void);
+void LogSeal(void);
+void LogRecord(unsigned char source, unsigned short id, void * data, unsigned int length);
+void LogPoll(void);
+void LogService(void);
+
+// *** Log download
+// The GCS asks for the log with custom COMMAND_LONGs, and it goes out as MEMORY_VECTs whose address is the chunk number counted
+// in LOG_CHUNK_SIZE from LOG_FLASH_ADDR.  Up to LOG_DL_WINDOW chunks are sent ahead of the GCS's acknowledgement, which also
+// lists chunks it's missing so only those are sent again, and a download can be resumed from any chunk by starting it again there.
+#define LOG_CHUNKS          ((LOG_FLASH_END - LOG_FLASH_ADDR) / LOG_CHUNK_SIZE) // has to fit in the 16 bit MEMORY_VECT address
+#define LOG_RESEND_SIZE     6
+#define LOG_DL_COST         (MESSAGE_LOOP_HZ * LINK_CAPACITY_MAX) // credit used up by each chunk
+
+unsigned char logDownloading;
+unsigned char logReportPending;             // LOGFIRST, LOGEND and LOGCHUNKS are sent once the flash is free to find LOGFIRST
+unsigned short logSendBase;                 // oldest chunk not acknowledged yet
+unsigned short logSendNext;                 // next chunk to send for the first time
+unsigned short logSendEnd;                  // chunk to stop at
+unsigned short logResend[LOG_RESEND_SIZE];  // chunks the GCS said it was missing
+unsigned int logResendCount;
+unsigned int logSendCredit;                 // goes up by LOG_DL_RATE * linkCapacity each message loop
+unsigned int logSendTimer;                  // message loops since the last acknowledgement
+unsigned int logSendSilence;
+
+unsigned int LogOldestAddress(void);
+unsigned int LogChunkDistance(unsigned int from, unsigned int to);
+void LogDownloadCommand(mavlink_command_long_t * command);
+void LogDownloadService(void);
+void LogSendChunk(unsigned short chunk);
+
+// *** Local navigation frame
+// Waypoints and GPS fixes are converted into integer mm offsets north/east/down of an origin (home when it is known) so that
+// navigation doesn't need float degrees, which only resolve to around 1m, or a fcos() of the current latitude on every fix
+#define NAV_LAT_SCALE       728727  // mm per 1e-7 degree of latitude in Q16: 6371000000*PI()/180/10000000*65536
+
+int navOriginLat;           // origin in 1e-7 degrees
+int navOriginLon;
+int navOriginAlt;           // origin altitude above MSL in mm
+int navLonScale;            // mm per 1e-7 degree of longitude in Q16, this is NAV_LAT_SCALE*cos(origin latitude)
+unsigned char navOriginValid;
+
+void NavSetOrigin(int lat, int lon, int alt);
+void NavToLocal(int lat, int lon, int alt, int * north, int * east, int * down);
+
 float lat_diff_i;
 float lon_diff_i;
 
@@ -198,24 +462,34 @@ float GPS_Kd = 0.1f;
 unsigned int gpsFixed;
 unsigned int gpsChange;
 
+unsigned int gpsFixTime;        // sysMS at the last position fix
+unsigned int gpsPredictValid;
+float gpsFixNorth;              // target minus craft at the last fix in m
+float gpsFixEast;
+
 unsigned int horizontalHold;
-float horizontalHoldLon;
-float horizontalHoldLat;
+int horizontalHoldNorth;
+int horizontalHoldEast;
 
 // ****************************************************************************
 // *** Initialiseation
 // ****************************************************************************
 
 void setup() {
+    unsigned int i;
+    
     // *** LED setup
     LEDInit(PLED);
     LEDOn(PLED);
     flashVLED = 0;
+    xbeeJoining = 0;
     
     // *** Timers and couters
     heartbeatWatchdog = 0;
     gpsWatchdog = 0;
     thalWatchdog = 0;
+    linkTruncate = 0;
+    linkTruncateWatchdog = 0;
     sysMS = 0;
     sysUS = 0;
     idleCount = 0;
@@ -237,6 +511,8 @@ void setup() {
     lon_diff_i = 0;
     horizontalHold = 0;
     gpsFixed = 0;
+    navOriginValid = 0;
+    gpsPredictValid = 0;
     
     mavlink_sys_status.onboard_control_sensors_present |= MAVLINK_SENSOR_GPS | MAVLINK_CONTROL_Z | MAVLINK_CONTROL_XY;
     mavlink_sys_status.onboard_control_sensors_enabled |= MAVLINK_SENSOR_GPS;
@@ -250,6 +526,19 @@ void setup() {
     waypointValid = 0;
     waypointTimer = 0;
     waypointReceiveIndex = 0;
+    waypointUploading = 0;
+    waypointPartial = 0;
+    waypointSendCursor = 0;
+    waypointSendEnd = 0;
+    waypointCacheCount = 0;
+    missionJob = MISSION_JOB_IDLE;
+    missionCommitPending = 0;
+    for(i=0; i<MISSION_PENDING; i++) missionPending[i].state = MISSION_SLOT_FREE;
+    
+    // *** Missions persist in SPI flash
+    FlashInit();
+    MissionLoad();
+    LogInit();
     
     // *** Establish ILink and Look for Thalamus
     ILinkInit(6000);
@@ -289,6 +578,9 @@ void MAVLinkInit() {
     dataRate[MAV_DATA_STREAM_EXTRA1] = 0;
     dataRate[MAV_DATA_STREAM_EXTRA2] = 0;
     dataRate[MAV_DATA_STREAM_EXTRA3] = 0;
+    
+    linkCapacity = LINK_CAPACITY_MAX;
+    LinkApplyRates();
 }
 
 // ****************************************************************************
@@ -305,9 +597,13 @@ void loop() {
         }
         
         if(PRGPushTime > 3000) {
-            flashVLED = 0xffffffffUL;
-            XBeeJoin();
-            flashVLED = 5;
+            if(XBeeJoin()) { // only queues up the AT commands, XBeeProcess() in the RIT sends them
+                flashVLED = 0xffffffffUL; // keeps flashing until the join has gone through
+                xbeeJoining = 1;
+            }
+            else {
+                flashVLED = 1; // AT queue too full to take the whole join, nothing was queued so press again
+            }
             
             PRGPushTime = 0;
             PRGTimer = 0;
@@ -315,6 +611,11 @@ void loop() {
         }
     }
     
+    if(xbeeJoining && XBeeATBusy() == 0) {
+        xbeeJoining = 0;
+        flashVLED = 5;
+    }
+    
     if(xbee_modem_status.isNew) {
         xbee_modem_status.isNew = 0;
         if(xbee_modem_status.status == 2) {
@@ -322,6 +623,8 @@ void loop() {
         }
         else if(xbee_modem_status.status == 3) {
             allowTransmit = 0;
+            linkCapacity = LINK_CAPACITY_MIN; // start low and probe back up once re-associated
+            LinkApplyRates();
         }
     }
 }
@@ -366,6 +669,7 @@ void RITInterrupt(void) {
     gpsWatchdog++;
     statusCounter++;
     thalWatchdog++;
+    linkTruncateWatchdog++;
     rawSensorStreamCounter++;
     extStatusStreamCounter++;
     rcChannelCounter++;
@@ -394,6 +698,12 @@ void RITInterrupt(void) {
         mavlink_gps_raw_int.satellites_visible = 0;
         gpsFixed = 0;
     }
+    
+    // Truncation watchdog, if Hypx has gone quiet it may have been swapped for something that doesn't zero-fill
+    if(linkTruncateWatchdog >= MESSAGE_LOOP_HZ*TRUNCATE_TIMEOUT) {
+        linkTruncateWatchdog = MESSAGE_LOOP_HZ*(TRUNCATE_TIMEOUT+1); // prevent overflow
+        linkTruncate = 0;
+    }
         
     // Thalamus watchdog
     if(thalWatchdog >= MESSAGE_LOOP_HZ*THAL_PANIC) {
@@ -410,6 +720,9 @@ void RITInterrupt(void) {
     GPSFetchData();
     XBeeAllow();
     
+    // *** Process XBee frames (and the MAVLink messages in them) held by the XBee interrupt
+    XBeeProcess();
+    
     // *** Status and GPS
     if(statusCounter >= MESSAGE_LOOP_HZ/5) {
         statusCounter = 0;
@@ -459,157 +772,190 @@ void RITInterrupt(void) {
             mavlink_gps_raw_int.vel = gps_nav_velned.gSpeed;
             mavlink_gps_raw_int.cog = gps_nav_velned.heading / 100; // because GPS assumes cog IS heading.
         }
+    }
+    
+    // until home is set the frame is anchored on the first fix
+    if(posupdate == 1 && gpsFixed == 1 && navOriginValid == 0) NavSetOrigin(gps_nav_posllh.lat, gps_nav_posllh.lon, gps_nav_posllh.hMSL);
+    
+    // send GPS position, if the waypoint would have to be read while the flash is busy erasing the fix is used on the next tick
+    if(posupdate == 1 && gpsFixed == 1 && (horizontalHold != 0 || WaypointAvailable(waypointCurrent))) {
+        posupdate = 0;
         
-        // send GPS position
-        if(posupdate == 1 && gpsFixed == 1) {
-            posupdate = 0;
-            
-            float craftX = gps_nav_posllh.lat / 10000000.0f;
-            float craftY = gps_nav_posllh.lon / 10000000.0f;
-            float craftZ = (float)gps_nav_posllh.hMSL/ 1000.0f;
+        int craftNorth, craftEast, craftDown;
+        NavToLocal(gps_nav_posllh.lat, gps_nav_posllh.lon, gps_nav_posllh.hMSL, &craftNorth, &craftEast, &craftDown);
+        
+        int targetNorth;
+        int targetEast;
+        int targetDown;
+        float targetYaw;
+        
+        if(horizontalHold == 1) { // request horizontal hold
+            horizontalHoldNorth = craftNorth;
+            horizontalHoldEast = craftEast;
+            horizontalHold = 2; // now in hold
+        }
+        
+        if(horizontalHold == 2) { // with hold
+            targetNorth = horizontalHoldNorth;
+            targetEast = horizontalHoldEast;
+            targetDown = craftDown;
+            targetYaw = 42.0f;
+        }
+        else if((waypointCurrent == WAYPOINT_HOME && waypointHomeValid == 1) || (waypointCurrent < waypointCount && waypointValid == 1)) { // with 
+            waypointStruct * wp = WaypointGet(waypointCurrent);
+            targetNorth = wp->north;
+            targetEast = wp->east;
+            targetDown = wp->down;
+            targetYaw = wp->param4 * 0.01745329251994329577f; // param4 is yaw angle, degrees to radian conversion M_PI / 180.0f = 0.01745329251994329577...
+        }
+        else {
+            targetNorth = craftNorth;
+            targetEast = craftEast;
+            targetDown = craftDown;
+            targetYaw = 42.0f;
+        }
+        
+        // all in mm
+        int lat_diff = targetNorth - craftNorth;
+        int lon_diff = targetEast - craftEast;
+        int alt_diff = craftDown - targetDown;
+        
+        lat_diff_i += lat_diff / 1000.0f;
+        lon_diff_i += lon_diff / 1000.0f;
+
+        // stamp the fix, the north/east demands are dead-reckoned from here on every RIT tick until the next fix arrives
+        gpsFixTime = sysMS;
+        gpsFixNorth = lat_diff / 1000.0f;
+        gpsFixEast = lon_diff / 1000.0f;
+        gpsPredictValid = 1;
+        
+        ilink_gpsfly.headingDemand = targetYaw;
+        ilink_gpsfly.altitudeDemand = (navOriginAlt - targetDown) / 1000.0f;
+        ilink_gpsfly.altitude = (float)gps_nav_posllh.hMSL / 1000.0f;
+        ilink_gpsfly.vAcc = (float)gps_nav_posllh.vAcc / 1000.0f; // we think this is 1 sigma
+        ilink_gpsfly.velD = (float)gps_nav_velned.velD / 100.0f;
+        
+        
+        if(horizontalHold == 0 && ((waypointCurrent == WAYPOINT_HOME && waypointHomeValid == 1) || (waypointCurrent < waypointCount && waypointValid == 1))) {
+            waypointStruct * wp = WaypointGet(waypointCurrent);
+            int radius = wp->param2 * 1000; // param2 is radius in QGroumdcontrol 1.0.1
+            if(radius < WAYPOINT_MIN_RADIUS*1000) radius = WAYPOINT_MIN_RADIUS*1000;
             
-            float targetX;
-            float targetY;
-            float targetZ;
-            float targetYaw;
+            //float lat_diff2 = lat_diff; // for orbit phase calculation
+            //float lon_diff2 = lon_diff;
             
-            if(horizontalHold == 1) { // request horizontal hold
-                horizontalHoldLat = craftX;
-                horizontalHoldLon = craftY;
-                horizontalHold = 2; // now in hold
-            }
+            // assume cube of sides 2*radius rather than a sphere for target detection
+            if(lat_diff < 0) lat_diff = -lat_diff;
+            if(lon_diff < 0) lon_diff = -lon_diff;
+            if(alt_diff < 0) alt_diff = -alt_diff;
             
-            if(horizontalHold == 2) { // with hold
-                targetX = horizontalHoldLat;
-                targetY = horizontalHoldLon;
-                targetZ = craftZ;
-                targetYaw = 42.0f;
-            }
-            else if((waypointCurrent == WAYPOINT_HOME && waypointHomeValid == 1) || (waypointCurrent < waypointCount && waypointValid == 1)) { // with 
-                targetX = waypoint[waypointCurrent].x;
-                targetY = waypoint[waypointCurrent].y;
-                targetZ = waypoint[waypointCurrent].z;
-                targetYaw = waypoint[waypointCurrent].param4 * 0.01745329251994329577f; // param4 is yaw angle, degrees to radian conversion M_PI / 180.0f = 0.01745329251994329577...
-            }
-            else {
-                targetX = craftX;
-                targetY = craftY;
-                targetZ = craftZ;
-                targetYaw = 42.0f;
-            }
-                
-            float lat_diff = (double)(targetX - craftX) * (double)111194.92664455873734580834; // 111194.92664455873734580834f is radius of earth and deg-rad conversion: 6371000*PI()/180
-            float lon_diff = (double)(targetY - craftY) * (double)111194.92664455873734580834 * fcos((float)((double)craftX*(double)0.01745329251994329577)); // 0.01745329251994329577f is deg-rad conversion PI()/180
-            float alt_diff = (float)(targetZ - craftZ);
+            if(lat_diff < radius && lon_diff < radius && alt_diff < radius) {
             
-            lat_diff_i += lat_diff;
-            lon_diff_i += lon_diff;
-
-            ilink_gpsfly.northDemand = GPS_Kp*lat_diff /*+ GPS_Ki*lat_diff_i*/ + GPS_Kd*( 0 /*targ vel*/ - gps_nav_velned.velN / 100.0f);
-            ilink_gpsfly.eastDemand = GPS_Kp*lon_diff /*+ GPS_Ki*lon_diff_i*/ + GPS_Kd*( 0 /*targ vel*/- gps_nav_velned.velE / 100.0f);
-            ilink_gpsfly.headingDemand = targetYaw;
-            ilink_gpsfly.altitudeDemand = targetZ;
-            ilink_gpsfly.altitude = craftZ;
-            ilink_gpsfly.vAcc = (float)gps_nav_posllh.vAcc / 1000.0f; // we think this is 1 sigma
-            ilink_gpsfly.velD = (float)gps_nav_velned.velD / 100.0f;
+                // target reached
+                if(waypointReached == 0) {
+                    waypointReached = 1;
+                    waypointLoiter = 0;
+                    
+                    mavlink_mission_item_reached.seq = waypointCurrent;
 
-            XBeeInhibit();
-            ILinkSendMessage(ID_ILINK_GPSFLY, (unsigned short *) & ilink_gpsfly, sizeof(ilink_gpsfly)/2-1);
-            XBeeAllow();
-            
+                    MAVSendPacket(MAVLINK_MSG_ID_MISSION_ITEM_REACHED, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_mission_item_reached, MAVLINK_MSG_ID_MISSION_ITEM_REACHED_LEN);
+                    
+                    // waypointPhase = fatan2(-lon_diff2, -lat_diff2);
+                    
+                }
+            }
             
-            if(horizontalHold == 0 && ((waypointCurrent == WAYPOINT_HOME && waypointHomeValid == 1) || (waypointCurrent < waypointCount && waypointValid == 1))) {
-                float radius = waypoint[waypointCurrent].param2; // param2 is radius in QGroumdcontrol 1.0.1
-                if(radius < 1) radius = 1;
-                
-                //float lat_diff2 = lat_diff; // for orbit phase calculation
-                //float lon_diff2 = lon_diff;
-                
-                // assume cube of sides 2*radius rather than a sphere for target detection
-                if(lat_diff < 0) lat_diff = -lat_diff;
-                if(lon_diff < 0) lon_diff = -lon_diff;
-                if(alt_diff < 0) alt_diff = -alt_diff;
-                
-                if(lat_diff < radius && lon_diff < radius && alt_diff < radius) {
-                
-                    // target reached
-                    if(waypointReached == 0) {
-                        waypointReached = 1;
-                        waypointLoiter = 0;
+            if(waypointReached == 1) {
+                switch(wp->command) {
+                    case MAV_CMD_NAV_WAYPOINT:
+                        if(waypointLoiter >= wp->param1) { // Param1 in this case is wait time
+                            if(waypointCurrent < waypointCount) {
+                                waypointCurrent ++;
+                                waypointReached = 0;
+                                waypointLoiter = 0;
+                            }
+                        }
                         
-                        mavlink_mission_item_reached.seq = waypointCurrent;
-
-                        mavlink_msg_mission_item_reached_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_mission_item_reached);
-                        mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                        XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                        XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                        XBeeAllow();
+                        /*ilink_payldctrl.camRoll = 0;
+                        ilink_payldctrl.camPitch = 0;
+                        ilink_payldctrl.camYaw = wp->param4 * 0.01745329251994329577f; // param4 is yaw angle, degrees to radian conversion M_PI / 180.0f = 0.01745329251994329577...;
+                        ilink_payldctrl.controlMask = 0b100;
+                        XBeeInhibit();
+                        ILinkSendMessage(ID_ILINK_PAYLDCTRL, (unsigned short *) & ilink_payldctrl, sizeof(ilink_payldctrl)/2-1);
+                        XBeeAllow();*/
                         
-                        // waypointPhase = fatan2(-lon_diff2, -lat_diff2);
+                        // TODO: tween yaw between waypoints
                         
-                    }
-                }
-                
-                if(waypointReached == 1) {
-                    switch(waypoint[waypointCurrent].command) {
-                        case MAV_CMD_NAV_WAYPOINT:
-                            if(waypointLoiter >= waypoint[waypointCurrent].param1) { // Param1 in this case is wait time
-                                if(waypointCurrent < waypointCount) {
-                                    waypointCurrent ++;
-                                    waypointReached = 0;
-                                    waypointLoiter = 0;
-                                }
-                            }
-                            
-                            /*ilink_payldctrl.camRoll = 0;
-                            ilink_payldctrl.camPitch = 0;
-                            ilink_payldctrl.camYaw = waypoint[waypointCurrent].param4 * 0.01745329251994329577f; // param4 is yaw angle, degrees to radian conversion M_PI / 180.0f = 0.01745329251994329577...;
-                            ilink_payldctrl.controlMask = 0b100;
-                            XBeeInhibit();
-                            ILinkSendMessage(ID_ILINK_PAYLDCTRL, (unsigned short *) & ilink_payldctrl, sizeof(ilink_payldctrl)/2-1);
-                            XBeeAllow();*/
-                            
-                            // TODO: tween yaw between waypoints
-                            
-                            break;
+                        break;
+                    
+                    case MAV_CMD_NAV_LOITER_UNLIM:
+                    case MAV_CMD_NAV_LOITER_TIME:
+                    case MAV_CMD_NAV_LOITER_TURNS:
+                        // attempting to achieve a speed of 3m/s
+                        //waypointPhase += 0.1;
                         
-                        case MAV_CMD_NAV_LOITER_UNLIM:
-                        case MAV_CMD_NAV_LOITER_TIME:
-                        case MAV_CMD_NAV_LOITER_TURNS:
-                            // attempting to achieve a speed of 3m/s
-                            //waypointPhase += 0.1;
-                            
-                            // don't need to do anything to hold position
-                            // TODO: loiter radius/time/turns
-                            
-                            /*ilink_payldctrl.camRoll = 0;
-                            ilink_payldctrl.camPitch = 0;
-                            ilink_payldctrl.camYaw = waypoint[waypointCurrent].param4 * M_PI / 180.0f;
-                            ilink_payldctrl.controlMask = 0b100;
-                            XBeeInhibit();
-                            ILinkSendMessage(ID_ILINK_PAYLDCTRL, (unsigned short *) & ilink_payldctrl, sizeof(ilink_payldctrl)/2-1);
-                            XBeeAllow();*/
-                            break;
-                            
-                            
-                        case MAV_CMD_NAV_RETURN_TO_LAUNCH:
-                            waypointCurrent = WAYPOINT_HOME;
-                            waypointReached = 0;
-                            break;
-                            
-                        case MAV_CMD_NAV_LAND:
-                            //ilink_position.state = 0; // LAND NOW
-                            break;
-                    }
+                        // don't need to do anything to hold position
+                        // TODO: loiter radius/time/turns
+                        
+                        /*ilink_payldctrl.camRoll = 0;
+                        ilink_payldctrl.camPitch = 0;
+                        ilink_payldctrl.camYaw = wp->param4 * M_PI / 180.0f;
+                        ilink_payldctrl.controlMask = 0b100;
+                        XBeeInhibit();
+                        ILinkSendMessage(ID_ILINK_PAYLDCTRL, (unsigned short *) & ilink_payldctrl, sizeof(ilink_payldctrl)/2-1);
+                        XBeeAllow();*/
+                        break;
+                        
+                        
+                    case MAV_CMD_NAV_RETURN_TO_LAUNCH:
+                        waypointCurrent = WAYPOINT_HOME;
+                        waypointReached = 0;
+                        break;
+                        
+                    case MAV_CMD_NAV_LAND:
+                        //ilink_position.state = 0; // LAND NOW
+                        break;
                 }
             }
         }
     }
+    
+    // *** Mission lookahead
+    // keep the next few waypoints in RAM so that the flash is read here as waypointCurrent advances, rather than when the waypoint is needed
+    if(waypointValid == 1 && waypointCurrent < waypointCount && FlashBusy() == 0) {
+        WaypointPrefetch(waypointCurrent);
+    }
+    
+    // *** GPS dead-reckoning
+    // GPS fixes only arrive at 5Hz, so in between them the craft position is propagated along the last NAV_VELNED velocity and
+    // the demands are recalculated and sent to Thalamus at the full message loop rate rather than holding a stale demand for 200ms
+    if(gpsPredictValid == 1 && gpsFixed == 1) {
+        unsigned int dt = sysMS - gpsFixTime;
+        if(dt > GPS_PREDICT_MAX) dt = GPS_PREDICT_MAX; // don't extrapolate too far if fixes stop arriving
+        
+        float velN = gps_nav_velned.velN / 100.0f;
+        float velE = gps_nav_velned.velE / 100.0f;
+        
+        // the diffs are target minus craft, so they shrink as the craft moves
+        float predNorth = gpsFixNorth - velN * (float)dt / 1000.0f;
+        float predEast = gpsFixEast - velE * (float)dt / 1000.0f;
+        
+        ilink_gpsfly.northDemand = GPS_Kp*predNorth /*+ GPS_Ki*lat_diff_i*/ + GPS_Kd*( 0 /*targ vel*/ - velN);
+        ilink_gpsfly.eastDemand = GPS_Kp*predEast /*+ GPS_Ki*lon_diff_i*/ + GPS_Kd*( 0 /*targ vel*/- velE);
+        
+        XBeeInhibit();
+        ILinkSendMessage(ID_ILINK_GPSFLY, (unsigned short *) & ilink_gpsfly, sizeof(ilink_gpsfly)/2-1);
+        XBeeAllow();
+    }
+    else {
+        gpsPredictValid = 0;
+    }
 
     // *** MAVLink messages
     if(heartbeatCounter >= MESSAGE_LOOP_HZ) { // 1Hz loop
         heartbeatCounter = 0;
         MAVSendHeartbeat();
+        LinkCapacityUpdate();
         
         unsigned short load = (1000*(IDLE_MAX - idleCount))/IDLE_MAX; // Idle load is calculated here as this loop runs at 1Hz
         if(mavlink_sys_status.load == 0) mavlink_sys_status.load = load;
@@ -619,56 +965,57 @@ void RITInterrupt(void) {
         idleCount = 0;
     }
     
+    if(missionJob == MISSION_JOB_ERASE) waypointTimer = 0; // no requests go out until the mission area has been erased
+    if(MissionPendingFree() < MISSION_PENDING) waypointTimer = 0; // nor time out while the items already here are written
+    
     if(allowTransmit) {
-        if(paramPointer < PARAMBUFFER_SIZE) {
-            unsigned int i;
-            // shunt this along to GCS
-            for(i=0; i<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; i++) {
-                mavlink_param_value.param_id[i] = paramBuffer[paramPointer].name[i];
-                if(paramBuffer[paramPointer].name[i] == '\0') break;
-            }
-            mavlink_param_value.param_value = paramBuffer[paramPointer].value;
-            mavlink_param_value.param_count = ilink_thalparam_rx.paramCount; // this value shouldn't change
-            mavlink_param_value.param_index = paramBuffer[paramPointer].id;
-            mavlink_param_value.param_type = MAV_PARAM_TYPE_REAL32;
-            
-            paramPointer++;
-            
-            mavlink_msg_param_value_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_param_value);
-            mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-            XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-            XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-            XBeeAllow();
+        if(MAVSendQueuedParams()) {
+            // parameters have this tick's slot
         }
-        else if(waypointReceiveIndex < waypointCount) {
+        else if(waypointUploading && missionJob != MISSION_JOB_ERASE) {
             if(waypointTimer > WAYPOINT_TIMEOUT) {
-                mavlink_mission_request.seq = waypointReceiveIndex;
-                mavlink_mission_request.target_system = waypointProviderID;
-                mavlink_mission_request.target_component = waypointProviderComp;
-                mavlink_msg_mission_request_encode(mavlinkID, MAV_COMP_ID_MISSIONPLANNER, &mavlink_tx_msg, &mavlink_mission_request);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                
+                // nothing has arrived for a while, assume the outstanding requests were lost and go back over the gaps
                 waypointTimer = 0;
+                waypointInFlight = 0;
+                waypointRequestCursor = waypointUploadStart;
                 waypointTries++;
+                
+                if(waypointTries > WAYPOINT_TRIES) { // timeout failure
+                    waypointUploading = 0;
+                    if(waypointPartial == 0) waypointCount = 0; // a failed partial update leaves the rest of the mission running
+                    MAVSendText(255, "Receiving Waypoint timeout");
+                }
             }
-            if(waypointTries > waypointTries) { // timeout failure
-                waypointCount = 0;
-                MAVSendText(255, "Receiving Waypoint timeout");
+            
+            if(waypointUploading && waypointInFlight < WAYPOINT_WINDOW && waypointInFlight < MissionPendingFree()) {
+                // skip over anything already received
+                while(waypointRequestCursor < waypointUploadEnd && WAYPOINT_RECEIVED(waypointRequestCursor)) waypointRequestCursor++;
+                
+                if(waypointRequestCursor < waypointUploadEnd) {
+                    mavlink_mission_request.seq = waypointRequestCursor;
+                    mavlink_mission_request.target_system = waypointProviderID;
+                    mavlink_mission_request.target_component = waypointProviderComp;
+                    MAVSendPacket(MAVLINK_MSG_ID_MISSION_REQUEST, MAV_COMP_ID_MISSIONPLANNER, &mavlink_mission_request, MAVLINK_MSG_ID_MISSION_REQUEST_LEN);
+                    
+                    waypointRequestCursor++;
+                    waypointInFlight++;
+                }
             }
         }
+        else if(waypointSendCursor < waypointSendEnd && FlashBusy() == 0) {
+            MAVSendMissionItem(waypointSendCursor, waypointSendID, waypointSendComp);
+            waypointSendCursor++;
+        }
         //else if(ilink_thalctrl_rx.isNew) {
             // TODO translate mavlink command to thalctrl
             /*ilink_thalctrl_rx.isNew = 0;
             if(ilink_thalctrl_rx.command == MAVLINK_MSG_ID_COMMAND_LONG) {
                 mavlink_command_ack.result = 0;
                 mavlink_command_ack.command = ilink_thalctrl_rx.data;
-                mavlink_msg_command_ack_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_command_ack);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
+                MAVSendPacket(MAVLINK_MSG_ID_COMMAND_ACK, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_command_ack, MAVLINK_MSG_ID_COMMAND_ACK_LEN);
             }*/
         //}
-        else if(dataRate[MAV_DATA_STREAM_RAW_SENSORS] && rawSensorStreamCounter >= MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_RAW_SENSORS]) {
+        else if(streamRate[MAV_DATA_STREAM_RAW_SENSORS] && rawSensorStreamCounter >= MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_RAW_SENSORS]) {
             rawSensorStreamCounter = 0;
             
             if(ilink_rawimu.isNew) {
@@ -683,18 +1030,14 @@ void RITInterrupt(void) {
                 mavlink_raw_imu.ymag = ilink_rawimu.yMag;
                 mavlink_raw_imu.zmag = ilink_rawimu.zMag;
                 
-                mavlink_msg_raw_imu_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_raw_imu);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                XBeeAllow();
+                MAVSendPacket(MAVLINK_MSG_ID_RAW_IMU, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_raw_imu, MAVLINK_MSG_ID_RAW_IMU_LEN);
             }
             XBeeInhibit();
             ILinkPoll(ID_ILINK_RAWIMU);
             XBeeAllow();
             
         }
-        else if(dataRate[MAV_DATA_STREAM_EXTENDED_STATUS] && extStatusStreamCounter >= MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_EXTENDED_STATUS]) {
+        else if(streamRate[MAV_DATA_STREAM_EXTENDED_STATUS] && extStatusStreamCounter >= MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_EXTENDED_STATUS]) {
             extStatusStreamCounter = 0;
             // GPS_STATUS, CONTROL_STATUS, AUX_STATUS
             
@@ -765,14 +1108,10 @@ void RITInterrupt(void) {
             XBeeAllow();
             
             // Note: system load was calculated in the Heartbeat as it is on an invariable 1Hz loop)
-            mavlink_msg_sys_status_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_sys_status);
-            mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-            XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-            XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-            XBeeAllow();
+            MAVSendPacket(MAVLINK_MSG_ID_SYS_STATUS, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_sys_status, MAVLINK_MSG_ID_SYS_STATUS_LEN);
             
         }
-        else if(dataRate[MAV_DATA_STREAM_RC_CHANNELS] && rcChannelCounter >= MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_RC_CHANNELS]) {
+        else if(streamRate[MAV_DATA_STREAM_RC_CHANNELS] && rcChannelCounter >= MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_RC_CHANNELS]) {
             // RC_CHANNELS_SCALED, RC_CHANNELS_RAW, SERVO_OUTPUT_RAW
              rcChannelCounter= 0;
              
@@ -789,11 +1128,7 @@ void RITInterrupt(void) {
                 mavlink_servo_output_raw.servo8_raw = 0;
                 mavlink_servo_output_raw.port = 0;
                 
-                /*mavlink_msg_servo_output_raw_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_servo_output_raw);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                XBeeAllow();*/
+                /*MAVSendPacket(MAVLINK_MSG_ID_SERVO_OUTPUT_RAW, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_servo_output_raw, MAVLINK_MSG_ID_SERVO_OUTPUT_RAW_LEN);*/
                 //MAVSendVector("OUTPUT0", ilink_outputs0.channel[0], ilink_outputs0.channel[1], ilink_outputs0.channel[2]);
                 //MAVSendVector("OUTPUT1", ilink_outputs0.channel[3], ilink_outputs0.channel[4], ilink_outputs0.channel[5]);
                 MAVSendInt("MOTOR_N", ilink_outputs0.channel[0]);
@@ -820,11 +1155,7 @@ void RITInterrupt(void) {
                 mavlink_rc_channels_raw.port = 0;
                 mavlink_rc_channels_raw.rssi = 255;
                 
-                mavlink_msg_rc_channels_raw_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_rc_channels_raw);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                XBeeAllow();
+                MAVSendPacket(MAVLINK_MSG_ID_RC_CHANNELS_RAW, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_rc_channels_raw, MAVLINK_MSG_ID_RC_CHANNELS_RAW_LEN);
                 /*
                 mavlink_rc_channels_scaled.time_boot_ms = sysMS;
                 mavlink_rc_channels_scaled.chan1_scaled = (signed int)ilink_inputs0.channel[0] * 11.8;
@@ -840,18 +1171,14 @@ void RITInterrupt(void) {
                 mavlink_rc_channels_scaled.port = 0;
                 mavlink_rc_channels_scaled.rssi = 255;
                 
-                mavlink_msg_rc_channels_scaled_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_rc_channels_scaled);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                XBeeAllow();*/
+                MAVSendPacket(MAVLINK_MSG_ID_RC_CHANNELS_SCALED, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_rc_channels_scaled, MAVLINK_MSG_ID_RC_CHANNELS_SCALED_LEN);*/
             }
             XBeeInhibit();
             ILinkPoll(ID_ILINK_INPUTS0);
             XBeeAllow();
              
         }
-        else if(dataRate[MAV_DATA_STREAM_RAW_CONTROLLER] && rawControllerCounter >= MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_RAW_CONTROLLER]) {
+        else if(streamRate[MAV_DATA_STREAM_RAW_CONTROLLER] && rawControllerCounter >= MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_RAW_CONTROLLER]) {
             //ATTITUDE_CONTROLLER_OUTPUT, POSITION_CONTROLLER_OUTPUT, NAV_CONTROLLER_OUTPUT
             rawControllerCounter = 0;
             
@@ -865,31 +1192,23 @@ void RITInterrupt(void) {
                 mavlink_attitude.pitchspeed = ilink_attitude.pitchRate;
                 mavlink_attitude.yawspeed = ilink_attitude.yawRate;
                 
-                mavlink_msg_attitude_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_attitude);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                XBeeAllow();
+                MAVSendPacket(MAVLINK_MSG_ID_ATTITUDE, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_attitude, MAVLINK_MSG_ID_ATTITUDE_LEN);
             }
             XBeeInhibit();
             ILinkPoll(ID_ILINK_ATTITUDE);
             XBeeAllow();
             
         }
-        else if(dataRate[MAV_DATA_STREAM_POSITION] && positionStreamCounter >= MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_POSITION]) {
+        else if(streamRate[MAV_DATA_STREAM_POSITION] && positionStreamCounter >= MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_POSITION]) {
             positionStreamCounter= 0;
 
             if(gpsChange) {
                 mavlink_gps_raw_int.time_usec = sysUS;
                 
-                mavlink_msg_gps_raw_int_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_gps_raw_int);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                XBeeAllow();
+                MAVSendPacket(MAVLINK_MSG_ID_GPS_RAW_INT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_gps_raw_int, MAVLINK_MSG_ID_GPS_RAW_INT_LEN);
             }
         }
-        else if(dataRate[MAV_DATA_STREAM_EXTRA1] && extra1ChannelCounter >= MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_EXTRA1]) {
+        else if(streamRate[MAV_DATA_STREAM_EXTRA1] && extra1ChannelCounter >= MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_EXTRA1]) {
             extra1ChannelCounter = 0;
                     
             if(ilink_scaledimu.isNew) {
@@ -904,18 +1223,14 @@ void RITInterrupt(void) {
                 mavlink_scaled_imu.ymag = ilink_scaledimu.yMag;
                 mavlink_scaled_imu.zmag = ilink_scaledimu.zMag;
                 
-                mavlink_msg_scaled_imu_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_scaled_imu);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                XBeeAllow();
+                MAVSendPacket(MAVLINK_MSG_ID_SCALED_IMU, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_scaled_imu, MAVLINK_MSG_ID_SCALED_IMU_LEN);
             }
             XBeeInhibit();
             ILinkPoll(ID_ILINK_SCALEDIMU);
             XBeeAllow();
             
         }
-        else if(dataRate[MAV_DATA_STREAM_EXTRA2] && extra2ChannelCounter > MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_EXTRA2]) {
+        else if(streamRate[MAV_DATA_STREAM_EXTRA2] && extra2ChannelCounter > MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_EXTRA2]) {
             extra2ChannelCounter = 0;
             
             if(ilink_altitude.isNew) {
@@ -928,7 +1243,7 @@ void RITInterrupt(void) {
             ILinkPoll(ID_ILINK_ALTITUDE);
             XBeeAllow();
         }
-        else if(dataRate[MAV_DATA_STREAM_EXTRA3] && extra3ChannelCounter > MESSAGE_LOOP_HZ/dataRate[MAV_DATA_STREAM_EXTRA3]) {
+        else if(streamRate[MAV_DATA_STREAM_EXTRA3] && extra3ChannelCounter > MESSAGE_LOOP_HZ/streamRate[MAV_DATA_STREAM_EXTRA3]) {
             extra3ChannelCounter = 0;
             
             if(ilink_debug.isNew) {
@@ -950,6 +1265,9 @@ void RITInterrupt(void) {
         }
     }
     
+    // *** Flight recorder
+    LogPoll();
+    
     // *** Process ILink
     /*XBeeInhibit();
     ILinkFetchData();
@@ -960,273 +1278,1169 @@ void RITInterrupt(void) {
     XBeeInhibit();
     ILinkFetchData();
     XBeeAllow();
+    
+    // *** Mission storage and flight recorder, each does at most one erase or a short write, and nothing while the flash is busy
+    MissionService();
+    LogService();
+    LogDownloadService();
 }
 
 // ****************************************************************************
-// *** Communications
+// *** Navigation
 // ****************************************************************************
 
-// *** Mavlink messages
-void MAVSendHeartbeat(void) {
-    //if(allowTransmit) {
-        mavlink_msg_heartbeat_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_heartbeat);
-        mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-        XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeWriteCoordinator if it is interrupted.
-        XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-        XBeeAllow();
-    //}
+void NavSetOrigin(int lat, int lon, int alt) {
+    int north, east, down;
+    
+    if(navOriginValid) {
+        // a held position is kept in local coordinates, so it's moved by the old to new origin offset to stay in the same place
+        NavToLocal(lat, lon, alt, &north, &east, &down);
+        horizontalHoldNorth -= north;
+        horizontalHoldEast -= east;
+    }
+    
+    navOriginLat = lat;
+    navOriginLon = lon;
+    navOriginAlt = alt;
+    navLonScale = NAV_LAT_SCALE * fcos((float)lat * (0.01745329251994329577f / 10000000.0f)); // the only trig in the navigation, done once per origin
+    navOriginValid = 1;
+    
+    waypointCacheCount = 0; // cached waypoints are relative to the old origin, they get converted again on the next fetch
 }
 
-void MAVSendFloat(char * name, float value) {
-    if(allowTransmit) {
-        unsigned int i;
-        for(i=0; i<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; i++) {
-            mavlink_named_value_float.name[i] = name[i];
-            if(name[i] == '\0') break;
+void NavToLocal(int lat, int lon, int alt, int * north, int * east, int * down) {
+    // lat/lon in 1e-7 degrees, alt in mm above MSL, output in mm
+    *north = ((long long)(lat - navOriginLat) * NAV_LAT_SCALE) >> 16;
+    *east = ((long long)(lon - navOriginLon) * navLonScale) >> 16;
+    *down = navOriginAlt - alt;
+}
+
+// ****************************************************************************
+// *** Mission storage
+// ****************************************************************************
+
+// The mission lives in SPI flash: a header sector at MISSION_FLASH_ADDR, followed by one packed missionRecord_t per item.
+// The area is erased when an upload starts and the records are programmed as they arrive, then the header is written last
+// so that a partly received mission is never loaded.  Only the raw flash functions are used, the buffered ones would pull in
+// a 4kb sector buffer that Hypo doesn't have the RAM for.
+// Items of a partial upload replace records of the live mission, which means erasing their sector.  The new sector is put
+// together in the scratch sector first and marked complete, then copied back, so a reset at any point leaves either the old
+// sector or an image that MissionLoad() finishes copying.
+
+void MissionLoad(void) {
+    missionHeader_t header;
+    missionMarker_t marker;
+    missionRecord_t copy;
+    unsigned int offset;
+    
+    FlashRawRead(MISSION_MARKER_ADDR, (unsigned char *)&marker, sizeof(marker));
+    if(marker.magic == MISSION_PATCH_MAGIC && marker.sectorCheck == ~marker.sector && (marker.sector & 0xfff) == 0 &&
+            marker.sector >= MISSION_FLASH_ADDR + 0x1000 && marker.sector < MISSION_SCRATCH_ADDR &&
+            marker.length <= MISSION_SECTOR_RECORDS * sizeof(missionRecord_t)) {
+        // a patch was cut short after its image was complete, the raw functions wait for each erase so this can go straight through
+        FlashErase4k(marker.sector);
+        for(offset=0; offset<marker.length; offset+=sizeof(missionRecord_t)) {
+            FlashRawRead(MISSION_SCRATCH_ADDR + offset, (unsigned char *)&copy, sizeof(copy));
+            FlashRawWrite(marker.sector + offset, (unsigned char *)&copy, sizeof(copy));
         }
-        mavlink_named_value_float.time_boot_ms = sysMS;
-        mavlink_named_value_float.value = value;
-        mavlink_msg_named_value_float_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_named_value_float);
-        mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-        XBeeInhibit();
-        XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-        XBeeAllow();
+        FlashErase4k(MISSION_SCRATCH_ADDR);
+    }
+    
+    FlashRawRead(MISSION_FLASH_ADDR, (unsigned char *)&header, sizeof(header));
+    
+    if(header.magic == MISSION_MAGIC && header.count == (unsigned short)~header.countCheck && header.count <= MAX_WAYPOINTS) {
+        waypointCount = header.count;
+        waypointValid = 1;
     }
+    waypointCacheCount = 0;
 }
 
-void MAVSendInt(char * name, int value) {
-    if(allowTransmit) {
-        unsigned int i;
-        for(i=0; i<MAVLINK_MSG_NAMED_VALUE_INT_FIELD_NAME_LEN; i++) {
-            mavlink_named_value_int.name[i] = name[i];
-            if(name[i] == '\0') break;
-        }
-        mavlink_named_value_int.time_boot_ms = sysMS;
-        mavlink_named_value_int.value = value;
-        mavlink_msg_named_value_int_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_named_value_int);
-        mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-        XBeeInhibit();
-        XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-        XBeeAllow();
+void MissionErase(unsigned short count) {
+    unsigned int i;
+    if(count > MAX_WAYPOINTS) count = MAX_WAYPOINTS;
+    
+    // items still waiting to be patched in belonged to the old mission
+    for(i=0; i<MISSION_PENDING; i++) missionPending[i].state = MISSION_SLOT_FREE;
+    
+    // header sector and every sector that the records will land in, then the scratch sector, MissionService() starts the erases
+    missionJob = MISSION_JOB_ERASE;
+    missionJobAddr = MISSION_FLASH_ADDR;
+    missionJobEnd = MISSION_RECORD_ADDR(count);
+    missionCommitPending = 0;
+    waypointCacheCount = 0;
+}
+
+void MissionCommit(unsigned short count) {
+    missionHeader_t header;
+    header.magic = MISSION_MAGIC;
+    header.count = count;
+    header.countCheck = ~count;
+    FlashRawWrite(MISSION_FLASH_ADDR, (unsigned char *)&header, sizeof(header));
+}
+
+void MissionWriteItem(unsigned short seq, missionRecord_t * record) {
+    FlashRawWrite(MISSION_RECORD_ADDR(seq), (unsigned char *)record, sizeof(missionRecord_t));
+    
+    if(seq >= waypointCacheBase && seq < waypointCacheBase + waypointCacheCount) {
+        waypointCacheCount = 0; // the window holds the old version of this item
     }
 }
 
-void MAVSendVector(char * name, float valX, float valY, float valZ) {
-    if(allowTransmit) {
-        unsigned int i;
-        for(i=0; i<MAVLINK_MSG_DEBUG_VECT_FIELD_NAME_LEN; i++) {
-            mavlink_debug_vect.name[i] = name[i];
-            if(name[i] == '\0') break;
-        }
-        mavlink_debug_vect.time_usec = sysUS;
-        mavlink_debug_vect.x = valX;
-        mavlink_debug_vect.y = valY;
-        mavlink_debug_vect.z = valZ;
-        mavlink_msg_debug_vect_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_debug_vect);
-        mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-        XBeeInhibit();
-        XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-        XBeeAllow();
+missionPending_t * MissionPendingFind(unsigned short seq, unsigned char state) {
+    unsigned int i;
+    for(i=0; i<MISSION_PENDING; i++) {
+        if(missionPending[i].state == state && missionPending[i].seq == seq) return &missionPending[i];
     }
+    return 0;
 }
 
-void MAVSendText(unsigned char severity, char * text) {
-    if(allowTransmit) {
-        unsigned int i;
-        mavlink_statustext.severity = severity;
-        for(i=0; i<MAVLINK_MSG_STATUSTEXT_FIELD_TEXT_LEN; i++) {
-            mavlink_statustext.text[i] = text[i];
-            if(text[i] == '\0') break;
-        }
-        mavlink_msg_statustext_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_statustext);
-        mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-        XBeeInhibit();
-        XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-        XBeeAllow();
+unsigned char MissionPendingFree(void) {
+    unsigned int i;
+    unsigned char count = 0;
+    for(i=0; i<MISSION_PENDING; i++) {
+        if(missionPending[i].state == MISSION_SLOT_FREE) count++;
     }
+    return count;
 }
 
-// XBee interrupt (for MAVLink)
-void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length) {
-    unsigned char * ptr = 0;
-    unsigned int j;
+void MissionReadItem(unsigned short seq, missionRecord_t * record) {
+    unsigned int address = MISSION_RECORD_ADDR(seq);
+    missionPending_t * slot;
     
-    switch(id) {
-        case ID_XBEE_MODEMSTATUS:
-            ptr = (unsigned char *) &xbee_modem_status;
-            xbee_modem_status.isNew = 1;
+    // an item that hasn't been written yet is newer than what's in the flash
+    slot = MissionPendingFind(seq, MISSION_SLOT_PATCH);
+    if(slot == 0) slot = MissionPendingFind(seq, MISSION_SLOT_CLAIMED);
+    if(slot == 0) slot = MissionPendingFind(seq, MISSION_SLOT_WRITE);
+    if(slot) {
+        *record = slot->record;
+        return;
+    }
+    
+    // and while its sector is erased or part written, the whole of it is in the scratch sector
+    if((missionJob == MISSION_JOB_SWAP || missionJob == MISSION_JOB_WRITE) && MISSION_SECTOR_ADDR(seq) == missionPatchSector) {
+        address = MISSION_SCRATCH_ADDR + (address - missionPatchSector);
+    }
+    FlashRawRead(address, (unsigned char *)record, sizeof(missionRecord_t));
+}
+
+// Queues a received item for MissionService() to write (MISSION_SLOT_WRITE) or patch in (MISSION_SLOT_PATCH), returns 0 if
+// there's no room for it yet
+unsigned char MissionQueueItem(unsigned short seq, missionRecord_t * record, unsigned char state) {
+    missionPending_t * slot;
+    unsigned int i;
+    
+    slot = MissionPendingFind(seq, state); // replaced again before the last one went in
+    for(i=0; i<MISSION_PENDING && slot == 0; i++) {
+        if(missionPending[i].state == MISSION_SLOT_FREE) slot = &missionPending[i];
+    }
+    if(slot == 0) return 0;
+    
+    slot->seq = seq;
+    slot->record = *record;
+    slot->state = state;
+    
+    if(seq >= waypointCacheBase && seq < waypointCacheBase + waypointCacheCount) {
+        waypointCacheCount = 0; // picked up again by the next prefetch, from the slot until it's in the flash
+    }
+    return 1;
+}
+
+// Called every message loop, starts the next erase once the last one has finished, writes the queued items and the header
+// after them and works through the patches a few records at a time.  Nothing else in the message loop writes the mission.
+void MissionService(void) {
+    missionPending_t * slot;
+    missionMarker_t marker;
+    missionRecord_t copy;
+    unsigned short seq;
+    unsigned int i;
+    
+    if(FlashBusy()) return;
+    
+    switch(missionJob) {
+        case MISSION_JOB_IDLE:
+            slot = 0;
+            for(i=0; i<MISSION_PENDING; i++) {
+                if(missionPending[i].state == MISSION_SLOT_WRITE) {
+                    MissionWriteItem(missionPending[i].seq, &missionPending[i].record);
+                    missionPending[i].state = MISSION_SLOT_FREE;
+                    slot = &missionPending[i];
+                }
+            }
+            if(slot) break; // that's this message loop's flash work
+            
+            for(i=0; i<MISSION_PENDING && slot == 0; i++) {
+                if(missionPending[i].state == MISSION_SLOT_PATCH) slot = &missionPending[i];
+            }
+            
+            if(slot) {
+                // every item waiting for the same sector goes in with this patch
+                missionPatchSector = MISSION_SECTOR_ADDR(slot->seq);
+                for(i=0; i<MISSION_PENDING; i++) {
+                    if(missionPending[i].state == MISSION_SLOT_PATCH && MISSION_SECTOR_ADDR(missionPending[i].seq) == missionPatchSector) {
+                        missionPending[i].state = MISSION_SLOT_CLAIMED;
+                    }
+                }
+                
+                missionJobEnd = MISSION_RECORD_ADDR(waypointCount - 1) + sizeof(missionRecord_t) - missionPatchSector; // no need to copy the unused end of the last sector
+                if(missionJobEnd > MISSION_SECTOR_RECORDS * sizeof(missionRecord_t)) missionJobEnd = MISSION_SECTOR_RECORDS * sizeof(missionRecord_t);
+                missionJobAddr = 0;
+                missionJob = MISSION_JOB_COPY;
+                FlashErase4k(MISSION_SCRATCH_ADDR);
+            }
+            else if(missionCommitPending) {
+                missionCommitPending = 0;
+                MissionCommit(missionCommitCount);
+                waypointValid = 1;
+            }
             break;
-        case ID_XBEE_ATRESPONSE:
-            ptr = (unsigned char *) &xbee_at_response;
-            xbee_at_response.isNew = 1;
-            xbee_at_response.varLen = length - 4;
+        case MISSION_JOB_ERASE:
+            if(missionJobAddr < missionJobEnd) {
+                FlashErase4k(missionJobAddr); // returns as soon as the erase has started
+                missionJobAddr += 0x1000;
+            }
+            else if(missionJobAddr != MISSION_SCRATCH_ADDR + 0x1000) {
+                // so that a patch of the old mission that was cut short doesn't get finished over the new one
+                FlashErase4k(MISSION_SCRATCH_ADDR);
+                missionJobAddr = MISSION_SCRATCH_ADDR + 0x1000;
+            }
+            else {
+                missionJob = MISSION_JOB_IDLE; // and the last one has finished
+            }
             break;
-        case ID_XBEE_RECEIVEPACKET:
-            /*ptr = (unsigned char *) &xbee_receive_packet;
-            xbee_receive_packet.isNew = 1;
-            xbee_receive_packet.varLen = length - 11;*/
+        case MISSION_JOB_COPY:
+            for(i=0; i<MISSION_COPY_RECORDS && missionJobAddr < missionJobEnd; i++) {
+                seq = ((missionPatchSector - MISSION_FLASH_ADDR - 0x1000) >> 12) * MISSION_SECTOR_RECORDS + missionJobAddr / sizeof(missionRecord_t);
+                slot = MissionPendingFind(seq, MISSION_SLOT_CLAIMED);
+                if(slot) copy = slot->record;
+                else FlashRawRead(missionPatchSector + missionJobAddr, (unsigned char *)&copy, sizeof(copy));
+                FlashRawWrite(MISSION_SCRATCH_ADDR + missionJobAddr, (unsigned char *)&copy, sizeof(copy));
+                missionJobAddr += sizeof(missionRecord_t);
+            }
+            
+            if(missionJobAddr >= missionJobEnd) {
+                // the image is complete, from here on a reset finishes the patch from it
+                marker.magic = MISSION_PATCH_MAGIC;
+                marker.sector = missionPatchSector;
+                marker.sectorCheck = ~missionPatchSector;
+                marker.length = missionJobEnd;
+                FlashRawWrite(MISSION_MARKER_ADDR, (unsigned char *)&marker, sizeof(marker));
+                missionJob = MISSION_JOB_SWAP;
+            }
+            break;
+        case MISSION_JOB_SWAP:
+            FlashErase4k(missionPatchSector);
+            missionJobAddr = 0;
+            missionJob = MISSION_JOB_WRITE;
+            break;
+        case MISSION_JOB_WRITE:
+            for(i=0; i<MISSION_COPY_RECORDS && missionJobAddr < missionJobEnd; i++) {
+                FlashRawRead(MISSION_SCRATCH_ADDR + missionJobAddr, (unsigned char *)&copy, sizeof(copy));
+                FlashRawWrite(missionPatchSector + missionJobAddr, (unsigned char *)&copy, sizeof(copy));
+                missionJobAddr += sizeof(missionRecord_t);
+            }
             
-            // bypass copy, send direct to MAVLINK Parse
-            for(j=11; j<length; j++) {
-                MAVLinkParse(buffer[j]);
+            if(missionJobAddr >= missionJobEnd) {
+                for(i=0; i<MISSION_PENDING; i++) {
+                    if(missionPending[i].state == MISSION_SLOT_CLAIMED) missionPending[i].state = MISSION_SLOT_FREE;
+                }
+                FlashErase4k(MISSION_SCRATCH_ADDR); // which clears the marker
+                missionJob = MISSION_JOB_IDLE;
             }
             break;
     }
+}
+
+void WaypointLoad(waypointStruct * wp, unsigned short seq) {
+    missionRecord_t record;
+    MissionReadItem(seq, &record);
     
-    if(ptr) {
-        for(j=0; j<length; j++) {
-            ptr[j] = buffer[j];
-        }
-    }
+    wp->command = record.command;
+    wp->autocontinue = record.autocontinue;
+    wp->param1 = record.param1;
+    wp->param2 = record.param2;
+    wp->param3 = record.param3;
+    wp->param4 = record.param4;
+    NavToLocal(record.lat, record.lon, record.alt, &wp->north, &wp->east, &wp->down);
 }
 
-void MAVLinkParse(unsigned char UARTData) {
-    if(mavlink_parse_char(MAVLINK_COMM_0, UARTData, &mavlink_rx_msg, &mavlink_status)) {
-        //mavlinkSendDebugV("MSGID", mavlink_rx_msg.msgid, 0, 0);
-        switch(mavlink_rx_msg.msgid) {
-             case MAVLINK_MSG_ID_HEARTBEAT:
-                // count heartbeat messages
-                heartbeatWatchdog = 0;
-                allowTransmit = 1;
-                break;
-             case MAVLINK_MSG_ID_MANUAL_CONTROL:
-                mavlink_msg_manual_control_decode(&mavlink_rx_msg, &mavlink_manual_control);
-                if(mavlink_manual_control.target == mavlinkID) {
-                    ilink_atdemand.roll = mavlink_manual_control.roll;
-                    ilink_atdemand.pitch = mavlink_manual_control.pitch;
-                    ilink_atdemand.yaw = mavlink_manual_control.yaw;
-                    ilink_atdemand.thrust = mavlink_manual_control.thrust;
-                    ILinkSendMessage(ID_ILINK_ATDEMAND, (unsigned short *) & ilink_atdemand, sizeof(ilink_atdemand)/2-1);
+void WaypointPrefetch(unsigned short seq) {
+    unsigned short i, keep;
+    
+    if(seq >= waypointCacheBase && seq < waypointCacheBase + waypointCacheCount) {
+        if(seq == waypointCacheBase && waypointCacheCount == WAYPOINT_CACHE) return; // window is already full and where it should be
+        
+        // slide the window forward, keeping the items that are still at or ahead of seq
+        keep = waypointCacheBase + waypointCacheCount - seq;
+        for(i=0; i<keep; i++) {
+            waypoint[i] = waypoint[seq - waypointCacheBase + i];
+        }
+    }
+    else {
+        keep = 0;
+    }
+    
+    waypointCacheBase = seq;
+    waypointCacheCount = keep;
+    
+    // then stream in the rest
+    while(waypointCacheCount < WAYPOINT_CACHE && waypointCacheBase + waypointCacheCount < waypointCount) {
+        WaypointLoad(&waypoint[waypointCacheCount], waypointCacheBase + waypointCacheCount);
+        waypointCacheCount++;
+    }
+}
+
+// Whether WaypointGet() can return seq without having to wait for the flash
+unsigned char WaypointAvailable(unsigned short seq) {
+    if(seq == WAYPOINT_HOME || waypointValid == 0 || seq >= waypointCount) return 1; // nothing to read
+    if(seq >= waypointCacheBase && seq < waypointCacheBase + waypointCacheCount) return 1;
+    return (FlashBusy() == 0);
+}
+
+waypointStruct * WaypointGet(unsigned short seq) {
+    if(seq == WAYPOINT_HOME) return &waypointHome;
+    
+    if(seq < waypointCacheBase || seq >= waypointCacheBase + waypointCacheCount) {
+        WaypointPrefetch(seq); // cache miss, this normally only happens when jumping around the mission
+    }
+    return &waypoint[seq - waypointCacheBase];
+}
+
+// ****************************************************************************
+// *** Flight recorder
+// ****************************************************************************
+
+// The log area is a ring of 4k sectors written with the FlashAppend functions, which keep LOG_ERASE_AHEAD sectors erased in
+// front of the write pointer (overwriting the oldest flights) and program each block as one page.  Everything runs from the
+// RIT, the same as the mission code, so the two never use the SPI flash at the same time.
+
+void LogInit(void) {
+    logHeader_t header;
+    unsigned int address, newest, next;
+    
+    logFill = 0;
+    logFillUsed = sizeof(logHeader_t);
+    logReady = 0;
+    logRecording = 0;
+    logDrops = 0;
+    logPollCounter = 0;
+    logStatusCounter = 0;
+    logSeq = 0;
+    logFlight = 0;
+    logDownloading = 0;
+    logReportPending = 0;
+    
+    // the newest sector is the one whose first block has the highest sequence number, only one header per sector is read
+    newest = 0;
+    for(address = LOG_FLASH_ADDR; address < LOG_FLASH_END; address += 0x1000) {
+        FlashRawRead(address, (unsigned char *)&header, sizeof(header));
+        if(header.magic == LOG_MAGIC && header.seqCheck == ~header.seq && (newest == 0 || header.seq > logSeq)) {
+            newest = address;
+            logSeq = header.seq;
+            logFlight = header.flight;
+        }
+    }
+    
+    if(newest == 0) {
+        // nothing logged yet, the first sector gets erased before it is used
+        FlashAppendInit(LOG_FLASH_ADDR, LOG_FLASH_END, LOG_FLASH_ADDR, LOG_FLASH_ADDR, LOG_ERASE_AHEAD);
+        return;
+    }
+    
+    // then along that sector to the first block that was never started, a torn block still counts as used
+    for(address = newest + LOG_BLOCK_SIZE; address < newest + 0x1000; address += LOG_BLOCK_SIZE) {
+        FlashRawRead(address, (unsigned char *)&header, sizeof(header));
+        if(header.magic == 0xffff && header.seq == 0xffffffff) break;
+        if(header.magic == LOG_MAGIC && header.seqCheck == ~header.seq && header.seq > logSeq) {
+            logSeq = header.seq;
+            logFlight = header.flight;
+        }
+    }
+    logSeq++;
+    
+    next = newest + 0x1000;
+    if(next >= LOG_FLASH_END) next = LOG_FLASH_ADDR;
+    
+    if(address == newest + 0x1000) {
+        // sector is full, the erase ahead of it may not have finished before power went so it is done again
+        FlashAppendInit(LOG_FLASH_ADDR, LOG_FLASH_END, next, next, LOG_ERASE_AHEAD);
+    }
+    else {
+        FlashAppendInit(LOG_FLASH_ADDR, LOG_FLASH_END, address, next, LOG_ERASE_AHEAD);
+    }
+}
+
+void LogStart(void) {
+    if(logFillUsed > sizeof(logHeader_t)) {
+        // the end of the last flight hasn't been sealed yet
+        if(logReady) logDrops++;
+        else LogSeal();
+    }
+    logFillUsed = sizeof(logHeader_t);
+    logFlight++;
+    logRecording = 1;
+    logDownloading = 0; // the flash bandwidth is needed for the recording
+}
+
+// Finishes the header of the block being filled and hands it over to LogService
+void LogSeal(void) {
+    logHeader_t * header = (logHeader_t *)logBlock[logFill];
+    unsigned short checksum;
+    unsigned int i;
+    
+    header->magic = LOG_MAGIC;
+    header->flight = logFlight;
+    header->seq = logSeq++;
+    header->seqCheck = ~header->seq;
+    header->used = logFillUsed - sizeof(logHeader_t);
+    
+    checksum = crc_calculate(logBlock[logFill], sizeof(logHeader_t) - 2);
+    for(i=sizeof(logHeader_t); i<logFillUsed; i++) {
+        crc_accumulate(logBlock[logFill][i], &checksum);
+    }
+    header->crc = checksum;
+    
+    logReady = 1;
+    logFill = 1 - logFill;
+    logFillUsed = sizeof(logHeader_t);
+}
+
+void LogRecord(unsigned char source, unsigned short id, void * data, unsigned int length) {
+    logRecord_t * record;
+    unsigned char * ptr = data;
+    unsigned int i;
+    
+    if(logRecording == 0 || length > LOG_BLOCK_SIZE - sizeof(logHeader_t) - sizeof(logRecord_t)) return;
+    
+    if(logFillUsed + sizeof(logRecord_t) + length > LOG_BLOCK_SIZE) {
+        if(logReady) {
+            logDrops++; // flash hasn't kept up
+            return;
+        }
+        LogSeal();
+    }
+    
+    record = (logRecord_t *)&logBlock[logFill][logFillUsed];
+    record->source = source;
+    record->length = length;
+    record->id = id;
+    record->time = sysMS;
+    logFillUsed += sizeof(logRecord_t);
+    
+    for(i=0; i<length; i++) {
+        logBlock[logFill][logFillUsed++] = ptr[i];
+    }
+}
+
+// Polls Thalamus for the logged messages independently of the MAVLink streams, and for its status often enough to see arming
+void LogPoll(void) {
+    logPollCounter++;
+    logStatusCounter++;
+    
+    XBeeInhibit();
+    if(logRecording) {
+        ILinkPoll(ID_ILINK_ATTITUDE);
+        ILinkPoll(ID_ILINK_RAWIMU);
+    }
+    if(logPollCounter >= LOG_IO_DIVIDER) {
+        logPollCounter = 0;
+        if(logRecording) {
+            ILinkPoll(ID_ILINK_THALSTAT);
+            ILinkPoll(ID_ILINK_OUTPUTS0);
+            ILinkPoll(ID_ILINK_INPUTS0);
+        }
+        else if((ilink_thalstat.sensorStatus & 0x7) == 3) {
+            ILinkPoll(ID_ILINK_THALSTAT); // armable (MAV_STATE_STANDBY), so that the arming is caught quickly
+        }
+    }
+    if(logStatusCounter >= MESSAGE_LOOP_HZ) {
+        // otherwise the status stream's polls are enough, this is only for when it's turned off
+        logStatusCounter = 0;
+        ILinkPoll(ID_ILINK_THALSTAT);
+    }
+    XBeeAllow();
+}
+
+// Does at most one thing to the flash per message loop: appends a sealed block, or starts erasing the next sector.  While an
+// erase is still running this returns straight away, so the RIT never waits on one
+void LogService(void) {
+    logHeader_t * header;
+    
+    // when recording has stopped, the part-filled block is sealed so the end of the flight makes it into flash
+    if(logRecording == 0 && logReady == 0 && logFillUsed > sizeof(logHeader_t)) {
+        LogSeal();
+    }
+    
+    if(FlashBusy()) return;
+    
+    if(logReady && FlashAppendSpace() >= LOG_BLOCK_SIZE) {
+        header = (logHeader_t *)logBlock[1-logFill];
+        FlashAppendPage(logBlock[1-logFill], sizeof(logHeader_t) + header->used);
+        logReady = 0;
+    }
+    else {
+        FlashAppendService();
+    }
+}
+
+// The oldest block is just past the sectors kept erased in front of the write pointer, unless the log hasn't been round the
+// ring yet.  A few sectors are looked at since the erase ahead may have got further than FlashAppendInit was told.
+unsigned int LogOldestAddress(void) {
+    logHeader_t header;
+    unsigned int address = FlashAppendEraseAddress();
+    unsigned int i;
+    
+    for(i=0; i<=LOG_ERASE_AHEAD; i++) {
+        FlashRawRead(address, (unsigned char *)&header, sizeof(header));
+        if(header.magic == LOG_MAGIC && header.seqCheck == ~header.seq) return address;
+        address += 0x1000;
+        if(address >= LOG_FLASH_END) address = LOG_FLASH_ADDR;
+    }
+    return LOG_FLASH_ADDR;
+}
+
+unsigned int LogChunkDistance(unsigned int from, unsigned int to) {
+    return (to + LOG_CHUNKS - from) % LOG_CHUNKS;
+}
+
+void LogDownloadCommand(mavlink_command_long_t * command) {
+    float missing[LOG_RESEND_SIZE];
+    unsigned int i, j, chunk;
+    
+    switch(command->command) {
+        case LOG_CMD_DOWNLOAD:
+            mavlink_command_ack.command = command->command;
+            if(logRecording) {
+                mavlink_command_ack.result = MAV_CMD_ACK_ERR_FAIL; // not while the log is being written
+            }
+            else {
+                mavlink_command_ack.result = MAV_CMD_ACK_OK;
+                
+                // the log runs from LOGFIRST up to (not including) LOGEND, wrapping round at LOGCHUNKS, reported by LogDownloadService()
+                chunk = (FlashAppendAddress() - LOG_FLASH_ADDR) / LOG_CHUNK_SIZE;
+                logReportPending = 1;
+                
+                if(command->param1 >= 0) {
+                    logSendBase = (unsigned int)command->param1 % LOG_CHUNKS;
+                    logSendNext = logSendBase;
+                    logSendEnd = (command->param2 >= 0) ? (unsigned int)command->param2 % LOG_CHUNKS : chunk;
+                    logResendCount = 0;
+                    logSendCredit = 0;
+                    logSendTimer = 0;
+                    logSendSilence = 0;
+                    logDownloading = (logSendBase != logSendEnd);
                 }
-                break;
-            case MAVLINK_MSG_ID_SET_MODE:
-                mavlink_msg_set_mode_decode(&mavlink_rx_msg, &mavlink_set_mode);
-                if (mavlink_set_mode.target_system == mavlinkID) {
-                    //mavlink_heartbeat.base_mode = mavlink_set_mode.base_mode;
-                    //mavlink_heartbeat.custom_mode = mavlink_set_mode.custom_mode;
-                    
-                    /*ilink_thalctrl_rx.command = MAVLINK_MSG_ID_SET_MODE;
-                    ilink_thalctrl_rx.data = mavlink_set_mode.base_mode;
-                    ILinkSendMessage(ID_ILINK_THALCTRL, (unsigned short *) & ilink_thalctrl_rx, sizeof(ilink_thalctrl_rx)/2-1);*/
+            }
+            MAVSendPacket(MAVLINK_MSG_ID_COMMAND_ACK, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_command_ack, MAVLINK_MSG_ID_COMMAND_ACK_LEN);
+            break;
+            
+        case LOG_CMD_ACK:
+            if(logDownloading == 0) break;
+            
+            // everything before param1 has arrived, ignored if it's outside of what has been sent (an old acknowledgement)
+            chunk = (unsigned int)command->param1 % LOG_CHUNKS;
+            if(chunk != logSendBase && LogChunkDistance(logSendBase, chunk) <= LogChunkDistance(logSendBase, logSendNext)) {
+                logSendBase = chunk;
+                logSendTimer = 0; // only progress holds off going back over the window, chunks lost off its end aren't listed as missing
+            }
+            
+            missing[0] = command->param2;
+            missing[1] = command->param3;
+            missing[2] = command->param4;
+            missing[3] = command->param5;
+            missing[4] = command->param6;
+            missing[5] = command->param7;
+            for(i=0; i<LOG_RESEND_SIZE; i++) {
+                if(missing[i] < 0) continue;
+                chunk = (unsigned int)missing[i] % LOG_CHUNKS;
+                if(LogChunkDistance(logSendBase, chunk) >= LogChunkDistance(logSendBase, logSendNext)) continue; // not sent yet
+                
+                for(j=0; j<logResendCount; j++) {
+                    if(logResend[j] == chunk) break;
                 }
-                break;
-            case MAVLINK_MSG_ID_COMMAND_LONG:
-                // actions!
-                mavlink_msg_command_long_decode(&mavlink_rx_msg, &mavlink_command_long);
-                if (mavlink_command_long.target_system == mavlinkID) {
-                    
+                if(j == logResendCount && logResendCount < LOG_RESEND_SIZE) {
+                    logResend[logResendCount++] = chunk;
+                }
+            }
+            
+            logSendSilence = 0;
+            if(logSendBase == logSendEnd) logDownloading = 0; // all there
+            break;
+            
+        case LOG_CMD_STOP:
+            logDownloading = 0;
+            mavlink_command_ack.command = command->command;
+            mavlink_command_ack.result = MAV_CMD_ACK_OK;
+            MAVSendPacket(MAVLINK_MSG_ID_COMMAND_ACK, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_command_ack, MAVLINK_MSG_ID_COMMAND_ACK_LEN);
+            break;
+    }
+}
+
+// Sends resends first, then new chunks while the window has room, no faster than LOG_DL_RATE scaled by the link capacity so
+// the telemetry streams still get through
+void LogDownloadService(void) {
+    unsigned short chunk;
+    
+    if(logReportPending) {
+        if(allowTransmit == 0 || FlashBusy()) return;
+        logReportPending = 0;
+        MAVSendInt("LOGFIRST", (LogOldestAddress() - LOG_FLASH_ADDR) / LOG_CHUNK_SIZE);
+        MAVSendInt("LOGEND", (FlashAppendAddress() - LOG_FLASH_ADDR) / LOG_CHUNK_SIZE);
+        MAVSendInt("LOGCHUNKS", LOG_CHUNKS);
+        return; // before any of the chunks
+    }
+    
+    if(logDownloading == 0) return;
+    
+    if(++logSendSilence >= MESSAGE_LOOP_HZ*LOG_DL_ABANDON) {
+        logDownloading = 0; // the GCS has gone away
+        return;
+    }
+    if(++logSendTimer >= MESSAGE_LOOP_HZ*LOG_DL_TIMEOUT) {
+        logSendTimer = 0;
+        logSendNext = logSendBase; // go back and send the whole window again
+        logResendCount = 0;
+    }
+    
+    if(allowTransmit == 0 || FlashBusy()) return;
+    
+    logSendCredit += LOG_DL_RATE * linkCapacity;
+    while(logSendCredit >= LOG_DL_COST) {
+        if(logResendCount) {
+            chunk = logResend[--logResendCount];
+        }
+        else if(logSendNext != logSendEnd && LogChunkDistance(logSendBase, logSendNext) < LOG_DL_WINDOW) {
+            chunk = logSendNext;
+            logSendNext = (logSendNext + 1) % LOG_CHUNKS;
+        }
+        else {
+            break;
+        }
+        logSendCredit -= LOG_DL_COST;
+        LogSendChunk(chunk);
+    }
+    if(logSendCredit > LOG_DL_COST) logSendCredit = LOG_DL_COST; // no burst once the window opens again
+}
+
+void LogSendChunk(unsigned short chunk) {
+    mavlink_memory_vect.address = chunk;
+    mavlink_memory_vect.ver = LOG_VECT_VER;
+    mavlink_memory_vect.type = 0;
+    FlashRawRead(LOG_FLASH_ADDR + chunk * LOG_CHUNK_SIZE, (unsigned char *)mavlink_memory_vect.value, LOG_CHUNK_SIZE);
+    MAVSendPacket(MAVLINK_MSG_ID_MEMORY_VECT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_memory_vect, MAVLINK_MSG_ID_MEMORY_VECT_LEN);
+}
+
+// ****************************************************************************
+// *** Communications
+// ****************************************************************************
+
+// *** Mavlink messages
+// Serialises a message straight into the XBee transmit request and sends it to the coordinator.  The payload is taken
+// from the mavlink_xxx_t struct as-is (fields are aligned and we're little-endian, same as the encode functions assume)
+// and the checksum is accumulated while it's copied, so there's no mavlink_message_t or separate send buffer involved.
+// When linkTruncate is set the trailing zeros of the payload are left off and the length byte shortened to match, but
+// the checksum is still over the full length and payload, so once Hypx has put the zeros back it's a standard packet.
+void MAVSendPacket(unsigned char msgid, unsigned char compid, void * packet, unsigned char length) {
+    unsigned char * frame = xbee_transmit_request.RFData;
+    unsigned char * payload = packet;
+    unsigned short checksum;
+    unsigned int i;
+    unsigned char sendLength;
+    
+    frame[0] = MAVLINK_STX;
+    frame[1] = length;
+    frame[2] = mavlink_get_channel_status(MAVLINK_COMM_0)->current_tx_seq++;
+    frame[3] = mavlinkID;
+    frame[4] = compid;
+    frame[5] = msgid;
+    
+    crc_init(&checksum);
+    for(i=1; i<MAVLINK_NUM_HEADER_BYTES; i++) {
+        crc_accumulate(frame[i], &checksum);
+    }
+    for(i=0; i<length; i++) {
+        frame[MAVLINK_NUM_HEADER_BYTES + i] = payload[i];
+        crc_accumulate(payload[i], &checksum);
+    }
+    crc_accumulate(mavlinkCRCExtra[msgid], &checksum);
+    
+    sendLength = length;
+    if(linkTruncate) {
+        while(sendLength > 1 && payload[sendLength-1] == 0) sendLength--; // always keep one byte so the packet is never empty
+        frame[1] = sendLength;
+    }
+    
+    frame[MAVLINK_NUM_HEADER_BYTES + sendLength] = checksum & 0xff;
+    frame[MAVLINK_NUM_HEADER_BYTES + sendLength + 1] = checksum >> 8;
+    
+    xbee_transmit_request.varLen = sendLength + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+    xbee_transmit_request.destinationAddress = 0x0000000000000000ULL; //to coordinator (big-endian)
+    xbee_transmit_request.networkAddress = 0xfeff;
+    
+    XBeeInhibit(); // XBee input needs to be inhibited before transmitting as some incomming messages cause UART responses which could disrupt XBeeSendPacket if it is interrupted.
+    XBeeSendPacket();
+    XBeeAllow();
+}
+
+void MAVSendHeartbeat(void) {
+    //if(allowTransmit) {
+        MAVSendPacket(MAVLINK_MSG_ID_HEARTBEAT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_heartbeat, MAVLINK_MSG_ID_HEARTBEAT_LEN);
+    //}
+}
+
+void MAVSendFloat(char * name, float value) {
+    if(allowTransmit) {
+        unsigned int i;
+        for(i=0; i<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; i++) {
+            mavlink_named_value_float.name[i] = name[i];
+            if(name[i] == '\0') break;
+        }
+        mavlink_named_value_float.time_boot_ms = sysMS;
+        mavlink_named_value_float.value = value;
+        MAVSendPacket(MAVLINK_MSG_ID_NAMED_VALUE_FLOAT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_named_value_float, MAVLINK_MSG_ID_NAMED_VALUE_FLOAT_LEN);
+    }
+}
+
+void MAVSendInt(char * name, int value) {
+    if(allowTransmit) {
+        unsigned int i;
+        for(i=0; i<MAVLINK_MSG_NAMED_VALUE_INT_FIELD_NAME_LEN; i++) {
+            mavlink_named_value_int.name[i] = name[i];
+            if(name[i] == '\0') break;
+        }
+        mavlink_named_value_int.time_boot_ms = sysMS;
+        mavlink_named_value_int.value = value;
+        MAVSendPacket(MAVLINK_MSG_ID_NAMED_VALUE_INT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_named_value_int, MAVLINK_MSG_ID_NAMED_VALUE_INT_LEN);
+    }
+}
+
+void MAVSendVector(char * name, float valX, float valY, float valZ) {
+    if(allowTransmit) {
+        unsigned int i;
+        for(i=0; i<MAVLINK_MSG_DEBUG_VECT_FIELD_NAME_LEN; i++) {
+            mavlink_debug_vect.name[i] = name[i];
+            if(name[i] == '\0') break;
+        }
+        mavlink_debug_vect.time_usec = sysUS;
+        mavlink_debug_vect.x = valX;
+        mavlink_debug_vect.y = valY;
+        mavlink_debug_vect.z = valZ;
+        MAVSendPacket(MAVLINK_MSG_ID_DEBUG_VECT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_debug_vect, MAVLINK_MSG_ID_DEBUG_VECT_LEN);
+    }
+}
+
+void MAVSendText(unsigned char severity, char * text) {
+    if(allowTransmit) {
+        unsigned int i;
+        mavlink_statustext.severity = severity;
+        for(i=0; i<MAVLINK_MSG_STATUSTEXT_FIELD_TEXT_LEN; i++) {
+            mavlink_statustext.text[i] = text[i];
+            if(text[i] == '\0') break;
+        }
+        MAVSendPacket(MAVLINK_MSG_ID_STATUSTEXT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_statustext, MAVLINK_MSG_ID_STATUSTEXT_LEN);
+    }
+}
+
+void MAVSendMissionItem(unsigned short seq, unsigned char targetSystem, unsigned char targetComponent) {
+    missionRecord_t record;
+    
+    MissionReadItem(seq, &record);
+    
+    mavlink_mission_item.target_system = targetSystem;
+    mavlink_mission_item.target_component = targetComponent;
+    mavlink_mission_item.seq = seq;
+    mavlink_mission_item.frame = MAV_FRAME_GLOBAL;
+    mavlink_mission_item.command = record.command;
+    mavlink_mission_item.autocontinue = record.autocontinue;
+    mavlink_mission_item.param1 = record.param1;
+    mavlink_mission_item.param2 = record.param2;
+    mavlink_mission_item.param3 = record.param3;
+    mavlink_mission_item.param4 = record.param4;
+    mavlink_mission_item.x = (double)record.lat / 10000000.0;
+    mavlink_mission_item.y = (double)record.lon / 10000000.0;
+    mavlink_mission_item.z = (float)record.alt / 1000.0f;
+    
+    if(waypointCurrent == seq) {
+        mavlink_mission_item.current = 1;
+    }
+    else {
+        mavlink_mission_item.current = 0;
+    }
+    
+    MAVSendPacket(MAVLINK_MSG_ID_MISSION_ITEM, MAV_COMP_ID_MISSIONPLANNER, &mavlink_mission_item, MAVLINK_MSG_ID_MISSION_ITEM_LEN);
+}
+
+unsigned int MAVSendQueuedParams(void) {
+    unsigned int paramSent = 0;
+    
+    while(paramRelayPop != paramRelayPush && paramSent < PARAM_SEND_PER_TICK) {
+        unsigned int j;
+        for(j=0; j<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; j++) {
+            mavlink_param_value.param_id[j] = paramRelay[paramRelayPop].name[j];
+            if(paramRelay[paramRelayPop].name[j] == '\0') break;
+        }
+        mavlink_param_value.param_value = paramRelay[paramRelayPop].value;
+        mavlink_param_value.param_count = paramRelayCount;
+        mavlink_param_value.param_index = paramRelay[paramRelayPop].id;
+        mavlink_param_value.param_type = MAV_PARAM_TYPE_REAL32;
+        
+        paramRelayPop = (paramRelayPop + 1) % PARAM_RELAY_SIZE;
+        MAVSendPacket(MAVLINK_MSG_ID_PARAM_VALUE, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_param_value, MAVLINK_MSG_ID_PARAM_VALUE_LEN);
+        paramSent++;
+    }
+    
+    if(paramMirrorCount > 0) {
+        // send out queued parameters from the mirror, scanning on from where the last tick stopped so that a list goes out in order
+        unsigned int i;
+        for(i=0; i<paramMirrorCount && paramSent < PARAM_SEND_PER_TICK; i++) {
+            if(paramSendScan >= paramMirrorCount) paramSendScan = 0;
+            
+            if(PARAM_BIT_TEST(paramSendPending, paramSendScan)) {
+                unsigned int j;
+                for(j=0; j<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; j++) {
+                    mavlink_param_value.param_id[j] = paramMirror[paramSendScan].name[j];
+                    if(paramMirror[paramSendScan].name[j] == '\0') break;
+                }
+                mavlink_param_value.param_value = paramMirror[paramSendScan].value;
+                mavlink_param_value.param_count = paramMirrorCount;
+                mavlink_param_value.param_index = paramSendScan;
+                mavlink_param_value.param_type = MAV_PARAM_TYPE_REAL32;
+                
+                PARAM_BIT_CLR(paramSendPending, paramSendScan);
+                MAVSendPacket(MAVLINK_MSG_ID_PARAM_VALUE, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_param_value, MAVLINK_MSG_ID_PARAM_VALUE_LEN);
+                paramSent++;
+            }
+            paramSendScan++;
+        }
+    }
+    
+    return paramSent;
+}
+
+void ParamMirrorRequest(void) {
+    ilink_thalpareq.reqType = 0; // request all
+    ILinkSendMessage(ID_ILINK_THALPAREQ, (unsigned short *) & ilink_thalpareq, sizeof(ilink_thalpareq)/2-1);
+}
+
+void ParamQueueAll(void) {
+    unsigned int i;
+    for(i=0; i<(paramMirrorCount+7)/8; i++) paramSendPending[i] = 0xff;
+    paramSendScan = 0;
+}
+
+// *** Link capacity
+void LinkCapacityUpdate(void) {
+    unsigned short delivered = linkTxDelivered - linkLastDelivered;
+    unsigned short failed = linkTxFailed - linkLastFailed;
+    unsigned short retries = linkTxRetries - linkLastRetries;
+    
+    linkLastDelivered += delivered;
+    linkLastFailed += failed;
+    linkLastRetries += retries;
+    
+    if(failed || retries > delivered * LINK_RETRY_LIMIT) {
+        // multiplicative decrease
+        linkCapacity /= 2;
+        if(linkCapacity < LINK_CAPACITY_MIN) linkCapacity = LINK_CAPACITY_MIN;
+        LinkApplyRates();
+    }
+    else if(delivered && linkCapacity < LINK_CAPACITY_MAX) {
+        // additive increase, only while there's traffic to prove the link can take it
+        linkCapacity += LINK_CAPACITY_STEP;
+        if(linkCapacity > LINK_CAPACITY_MAX) linkCapacity = LINK_CAPACITY_MAX;
+        LinkApplyRates();
+    }
+    
+    MAVSendInt("LINKCAP", linkCapacity);
+}
+
+void LinkApplyRates(void) {
+    unsigned int i;
+    for(i=0; i<MAV_DATA_STREAM_ENUM_END; i++) {
+        streamRate[i] = (dataRate[i] * linkCapacity) / LINK_CAPACITY_MAX;
+        if(dataRate[i] && streamRate[i] == 0) streamRate[i] = 1; // throttle requested streams, don't stop them
+    }
+}
+
+// XBee frames, called from XBeeProcess() (for MAVLink)
+void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length) {
+    unsigned char * ptr = 0;
+    unsigned int j;
+    
+    switch(id) {
+        case ID_XBEE_MODEMSTATUS:
+            ptr = (unsigned char *) &xbee_modem_status;
+            xbee_modem_status.isNew = 1;
+            break;
+        case ID_XBEE_ATRESPONSE:
+            ptr = (unsigned char *) &xbee_at_response;
+            xbee_at_response.isNew = 1;
+            xbee_at_response.varLen = length - 4;
+            break;
+        case ID_XBEE_TRANSMITSTATUS:
+            // frame ID, network address, retry count, delivery status, discovery status
+            if(length >= 5) {
+                linkTxRetries += buffer[3];
+                if(buffer[4] == 0) linkTxDelivered++;
+                else linkTxFailed++;
+            }
+            break;
+        case ID_XBEE_RECEIVEPACKET:
+            /*ptr = (unsigned char *) &xbee_receive_packet;
+            xbee_receive_packet.isNew = 1;
+            xbee_receive_packet.varLen = length - 11;*/
+            
+            // parse straight out of the XBee receive ring
+            if(length > 11) MAVLinkParseBuffer(buffer + 11, length - 11);
+            break;
+    }
+    
+    if(ptr) {
+        for(j=0; j<length; j++) {
+            ptr[j] = buffer[j];
+        }
+    }
+}
+
+void MAVLinkParse(unsigned char UARTData) {
+    if(mavlink_parse_char(MAVLINK_COMM_0, UARTData, &mavlink_rx_msg, &mavlink_status)) {
+        MAVLinkDispatch();
+    }
+}
+
+// Messages that are wholly inside the buffer are checked and decoded in one go, without the per-byte state machine or
+// the copy through the channel buffer.  Anything split across XBee frames goes through MAVLinkParse() a byte at a time.
+void MAVLinkParseBuffer(unsigned char * buffer, unsigned int length) {
+    mavlink_status_t * status = mavlink_get_channel_status(MAVLINK_COMM_0);
+    unsigned int i = 0;
+    unsigned int j, len;
+    unsigned short checksum;
+    
+    while(i < length) {
+        if(status->parse_state > MAVLINK_PARSE_STATE_IDLE) {
+            MAVLinkParse(buffer[i++]); // finish off a message that started in an earlier frame
+            continue;
+        }
+        if(buffer[i] != MAVLINK_STX) {
+            i++;
+            continue;
+        }
+        if(i + 1 >= length || i + buffer[i+1] + MAVLINK_NUM_NON_PAYLOAD_BYTES > length) {
+            MAVLinkParse(buffer[i++]); // runs on into the next frame
+            continue;
+        }
+        
+        len = buffer[i+1];
+        checksum = crc_calculate(&buffer[i+1], len + MAVLINK_CORE_HEADER_LEN);
+        crc_accumulate(mavlinkCRCExtra[buffer[i+5]], &checksum);
+        // not a message after all, carry on from the first checksum byte that didn't match as mavlink_parse_char()
+        // does, rescanning from just after the STX could pick a false STX out of the payload that then runs on over
+        // the real messages in the next frame
+        if(buffer[i+len+6] != (checksum & 0xff)) {
+            i += len + 6;
+            continue;
+        }
+        if(buffer[i+len+7] != (checksum >> 8)) {
+            i += len + 7;
+            continue;
+        }
+        
+        mavlink_rx_msg.magic = MAVLINK_STX;
+        mavlink_rx_msg.len = len;
+        mavlink_rx_msg.seq = buffer[i+2];
+        mavlink_rx_msg.sysid = buffer[i+3];
+        mavlink_rx_msg.compid = buffer[i+4];
+        mavlink_rx_msg.msgid = buffer[i+5];
+        mavlink_rx_msg.checksum = checksum;
+        for(j=0; j<len; j++) {
+            _MAV_PAYLOAD_NON_CONST(&mavlink_rx_msg)[j] = buffer[i+6+j];
+        }
+        status->current_rx_seq = mavlink_rx_msg.seq;
+        status->packet_rx_success_count++;
+        i += len + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+        
+        MAVLinkDispatch();
+    }
+}
+
+void MAVLinkDispatch(void) {
+    //mavlinkSendDebugV("MSGID", mavlink_rx_msg.msgid, 0, 0);
+    switch(mavlink_rx_msg.msgid) {
+         case MAVLINK_MSG_ID_HEARTBEAT:
+            // count heartbeat messages
+            heartbeatWatchdog = 0;
+            allowTransmit = 1;
+            break;
+         case MAVLINK_MSG_ID_MANUAL_CONTROL:
+            mavlink_msg_manual_control_decode(&mavlink_rx_msg, &mavlink_manual_control);
+            if(mavlink_manual_control.target == mavlinkID) {
+                ilink_atdemand.roll = mavlink_manual_control.roll;
+                ilink_atdemand.pitch = mavlink_manual_control.pitch;
+                ilink_atdemand.yaw = mavlink_manual_control.yaw;
+                ilink_atdemand.thrust = mavlink_manual_control.thrust;
+                ILinkSendMessage(ID_ILINK_ATDEMAND, (unsigned short *) & ilink_atdemand, sizeof(ilink_atdemand)/2-1);
+            }
+            break;
+        case MAVLINK_MSG_ID_SET_MODE:
+            mavlink_msg_set_mode_decode(&mavlink_rx_msg, &mavlink_set_mode);
+            if (mavlink_set_mode.target_system == mavlinkID) {
+                //mavlink_heartbeat.base_mode = mavlink_set_mode.base_mode;
+                //mavlink_heartbeat.custom_mode = mavlink_set_mode.custom_mode;
+                
+                /*ilink_thalctrl_rx.command = MAVLINK_MSG_ID_SET_MODE;
+                ilink_thalctrl_rx.data = mavlink_set_mode.base_mode;
+                ILinkSendMessage(ID_ILINK_THALCTRL, (unsigned short *) & ilink_thalctrl_rx, sizeof(ilink_thalctrl_rx)/2-1);*/
+            }
+            break;
+        case MAVLINK_MSG_ID_COMMAND_LONG:
+            // actions!
+            mavlink_msg_command_long_decode(&mavlink_rx_msg, &mavlink_command_long);
+            if (mavlink_command_long.target_system == mavlinkID) {
+                
+                
+                switch(mavlink_command_long.command) {
+                    case 0: // custom 0, reset
+                        mavlink_command_ack.result = 0;
+                        mavlink_command_ack.command = mavlink_command_long.command;
+                        MAVSendPacket(MAVLINK_MSG_ID_COMMAND_ACK, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_command_ack, MAVLINK_MSG_ID_COMMAND_ACK_LEN);
+                        Reset();
+                        break;
+                    //case MAV_CMD_NAV_WAYPOINT:
+                        // param1 Hold time in decimal seconds.
+                        // Acceptance radius in meters
+                        //  0 to pass through the WP, if > 0 radius in meters to pass by WP
+                        // Positive value for clockwise orbit, negative value for counter-clockwise orbit
+                        // Desired yaw angle at MISSION (rotary wing)
+                        //| Latitude| Longitude| Altitude|
+                        
+                        // use this for FOLLOW-ME mode (or without mission planner)
+                     //   break;
+                        
+                    // MAV_CMD_NAV_LOITER_UNLIM=17, // Loiter around this MISSION an unlimited amount of time |Empty| Empty| Radius around MISSION, in meters. If positive loiter clockwise, else counter-clockwise| Desired yaw angle.| Latitude| Longitude| Altitude|  
+                    // MAV_CMD_NAV_LOITER_TURNS=18, // Loiter around this MISSION for X turns |Turns| Empty| Radius around MISSION, in meters. If positive loiter clockwise, else counter-clockwise| Desired yaw angle.| Latitude| Longitude| Altitude|  
+                    // MAV_CMD_NAV_LOITER_TIME=19, // Loiter around this MISSION for X seconds |Seconds (decimal)| Empty| Radius around MISSION, in meters. If positive loiter clockwise, else counter-clockwise| Desired yaw angle.| Latitude| Longitude| Altitude|  
+                    // MAV_CMD_NAV_RETURN_TO_LAUNCH=20, // Return to launch location |Empty| Empty| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_NAV_ROI=80, // Sets the region of interest (ROI) |Region of intereset mode. (see MAV_ROI enum)| MISSION index/ target ID. (see MAV_ROI enum)| ROI index (allows a vehicle to manage multiple ROI's)| Empty| x the location of the fixed ROI (see MAV_FRAME)| y| z|  
+                    // MAV_CMD_NAV_PATHPLANNING=81, // Control autonomous path planning on the MAV. |0: Disable local obstacle avoidance / local path planning (without resetting map), 1: Enable local path planning, 2: Enable and reset local path planning| 0: Disable full path planning (without resetting map), 1: Enable, 2: Enable and reset map/occupancy grid, 3: Enable and reset planned route, but not occupancy grid| Empty| Yaw angle at goal, in compass degrees, [0..360]| Latitude/X of goal| Longitude/Y of goal| Altitude/Z of goal|  
                     
-                    switch(mavlink_command_long.command) {
-                        case 0: // custom 0, reset
-                            mavlink_command_ack.result = 0;
-                            mavlink_command_ack.command = mavlink_command_long.command;
-                            mavlink_msg_command_ack_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_command_ack);
-                            mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                            XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                            Reset();
-                            break;
-                        //case MAV_CMD_NAV_WAYPOINT:
-                            // param1 Hold time in decimal seconds.
-                            // Acceptance radius in meters
-                            //  0 to pass through the WP, if > 0 radius in meters to pass by WP
-                            // Positive value for clockwise orbit, negative value for counter-clockwise orbit
-                            // Desired yaw angle at MISSION (rotary wing)
-                            //| Latitude| Longitude| Altitude|
-                            
-                            // use this for FOLLOW-ME mode (or without mission planner)
-                         //   break;
-                            
-                        // MAV_CMD_NAV_LOITER_UNLIM=17, // Loiter around this MISSION an unlimited amount of time |Empty| Empty| Radius around MISSION, in meters. If positive loiter clockwise, else counter-clockwise| Desired yaw angle.| Latitude| Longitude| Altitude|  
-                        // MAV_CMD_NAV_LOITER_TURNS=18, // Loiter around this MISSION for X turns |Turns| Empty| Radius around MISSION, in meters. If positive loiter clockwise, else counter-clockwise| Desired yaw angle.| Latitude| Longitude| Altitude|  
-                        // MAV_CMD_NAV_LOITER_TIME=19, // Loiter around this MISSION for X seconds |Seconds (decimal)| Empty| Radius around MISSION, in meters. If positive loiter clockwise, else counter-clockwise| Desired yaw angle.| Latitude| Longitude| Altitude|  
-                        // MAV_CMD_NAV_RETURN_TO_LAUNCH=20, // Return to launch location |Empty| Empty| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_NAV_ROI=80, // Sets the region of interest (ROI) |Region of intereset mode. (see MAV_ROI enum)| MISSION index/ target ID. (see MAV_ROI enum)| ROI index (allows a vehicle to manage multiple ROI's)| Empty| x the location of the fixed ROI (see MAV_FRAME)| y| z|  
-                        // MAV_CMD_NAV_PATHPLANNING=81, // Control autonomous path planning on the MAV. |0: Disable local obstacle avoidance / local path planning (without resetting map), 1: Enable local path planning, 2: Enable and reset local path planning| 0: Disable full path planning (without resetting map), 1: Enable, 2: Enable and reset map/occupancy grid, 3: Enable and reset planned route, but not occupancy grid| Empty| Yaw angle at goal, in compass degrees, [0..360]| Latitude/X of goal| Longitude/Y of goal| Altitude/Z of goal|  
+                    // MAV_CMD_CONDITION_DELAY=112, // Delay mission state machine. |Delay in seconds (decimal)| Empty| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_CONDITION_CHANGE_ALT=113, // Ascend/descend at rate.  Delay mission state machine until desired altitude reached. |Descent / Ascend rate (m/s)| Empty| Empty| Empty| Empty| Empty| Finish Altitude|  
+                    // MAV_CMD_CONDITION_DISTANCE=114, // Delay mission state machine until within desired distance of next NAV point. |Distance (meters)| Empty| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_CONDITION_YAW=115, // Reach a certain target angle. |target angle: [0-360], 0 is north| speed during yaw change:[deg per second]| direction: negative: counter clockwise, positive: clockwise [-1,1]| relative offset or absolute angle: [ 1,0]| Empty| Empty| Empty|  
+                    // MAV_CMD_CONDITION_LAST=159, // NOP - This command is only used to mark the upper limit of the CONDITION commands in the enumeration |Empty| Empty| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_SET_MODE=176, // Set system mode. |Mode, as defined by ENUM MAV_MODE| Empty| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_JUMP=177, // Jump to the desired command in the mission list.  Repeat this action only the specified number of times |Sequence number| Repeat count| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_CHANGE_SPEED=178, // Change speed and/or throttle set points. |Speed type (0=Airspeed, 1=Ground Speed)| Speed  (m/s, -1 indicates no change)| Throttle  ( Percent, -1 indicates no change)| Empty| Empty| Empty| Empty|  
+                    // case MAV_CMD_DO_SET_HOME:
+                        
+                    // MAV_CMD_DO_SET_PARAMETER=180, // Set a system parameter.  Caution!  Use of this command requires knowledge of the numeric enumeration value of the parameter. |Parameter number| Parameter value| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_SET_RELAY=181, // Set a relay to a condition. |Relay number| Setting (1=on, 0=off, others possible depending on system hardware)| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_REPEAT_RELAY=182, // Cycle a relay on and off for a desired number of cyles with a desired period. |Relay number| Cycle count| Cycle time (seconds, decimal)| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_SET_SERVO=183, // Set a servo to a desired PWM value. |Servo number| PWM (microseconds, 1000 to 2000 typical)| Empty| Empty| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_REPEAT_SERVO=184, // Cycle a between its nominal setting and a desired PWM for a desired number of cycles with a desired period. |Servo number| PWM (microseconds, 1000 to 2000 typical)| Cycle count| Cycle time (seconds)| Empty| Empty| Empty|  
+                    // MAV_CMD_DO_CONTROL_VIDEO=200, // Control onboard camera system. |Camera ID (-1 for all)| Transmission: 0: disabled, 1: enabled compressed, 2: enabled raw| Transmission mode: 0: video stream, >0: single images every n seconds (decimal)| Recording: 0: disabled, 1: enabled compressed, 2: enabled raw| Empty| Empty| Empty|  
+
+                    // MAV_CMD_PREFLIGHT_CALIBRATION=241, // Trigger calibration. This command will be only accepted if in pre-flight mode. |Gyro calibration: 0: no, 1: yes| Magnetometer calibration: 0: no, 1: yes| Ground pressure: 0: no, 1: yes| Radio calibration: 0: no, 1: yes| Empty| Empty| Empty|  
+                    // MAV_CMD_PREFLIGHT_SET_SENSOR_OFFSETS=242, // Set sensor offsets. This command will be only accepted if in pre-flight mode. |Sensor to adjust the offsets for: 0: gyros, 1: accelerometer, 2: magnetometer, 3: barometer, 4: optical flow| X axis offset (or generic dimension 1), in the sensor's raw units| Y axis offset (or generic dimension 2), in the sensor's raw units| Z axis offset (or generic dimension 3), in the sensor's raw units| Generic dimension 4, in the sensor's raw units| Generic dimension 5, in the sensor's raw units| Generic dimension 6, in the sensor's raw units|  
+
+                    case LOG_CMD_DOWNLOAD:
+                    case LOG_CMD_ACK:
+                    case LOG_CMD_STOP:
+                        LogDownloadCommand(&mavlink_command_long);
+                        break;
                         
-                        // MAV_CMD_CONDITION_DELAY=112, // Delay mission state machine. |Delay in seconds (decimal)| Empty| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_CONDITION_CHANGE_ALT=113, // Ascend/descend at rate.  Delay mission state machine until desired altitude reached. |Descent / Ascend rate (m/s)| Empty| Empty| Empty| Empty| Empty| Finish Altitude|  
-                        // MAV_CMD_CONDITION_DISTANCE=114, // Delay mission state machine until within desired distance of next NAV point. |Distance (meters)| Empty| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_CONDITION_YAW=115, // Reach a certain target angle. |target angle: [0-360], 0 is north| speed during yaw change:[deg per second]| direction: negative: counter clockwise, positive: clockwise [-1,1]| relative offset or absolute angle: [ 1,0]| Empty| Empty| Empty|  
-                        // MAV_CMD_CONDITION_LAST=159, // NOP - This command is only used to mark the upper limit of the CONDITION commands in the enumeration |Empty| Empty| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_SET_MODE=176, // Set system mode. |Mode, as defined by ENUM MAV_MODE| Empty| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_JUMP=177, // Jump to the desired command in the mission list.  Repeat this action only the specified number of times |Sequence number| Repeat count| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_CHANGE_SPEED=178, // Change speed and/or throttle set points. |Speed type (0=Airspeed, 1=Ground Speed)| Speed  (m/s, -1 indicates no change)| Throttle  ( Percent, -1 indicates no change)| Empty| Empty| Empty| Empty|  
-                        // case MAV_CMD_DO_SET_HOME:
-                            
-                        // MAV_CMD_DO_SET_PARAMETER=180, // Set a system parameter.  Caution!  Use of this command requires knowledge of the numeric enumeration value of the parameter. |Parameter number| Parameter value| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_SET_RELAY=181, // Set a relay to a condition. |Relay number| Setting (1=on, 0=off, others possible depending on system hardware)| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_REPEAT_RELAY=182, // Cycle a relay on and off for a desired number of cyles with a desired period. |Relay number| Cycle count| Cycle time (seconds, decimal)| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_SET_SERVO=183, // Set a servo to a desired PWM value. |Servo number| PWM (microseconds, 1000 to 2000 typical)| Empty| Empty| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_REPEAT_SERVO=184, // Cycle a between its nominal setting and a desired PWM for a desired number of cycles with a desired period. |Servo number| PWM (microseconds, 1000 to 2000 typical)| Cycle count| Cycle time (seconds)| Empty| Empty| Empty|  
-                        // MAV_CMD_DO_CONTROL_VIDEO=200, // Control onboard camera system. |Camera ID (-1 for all)| Transmission: 0: disabled, 1: enabled compressed, 2: enabled raw| Transmission mode: 0: video stream, >0: single images every n seconds (decimal)| Recording: 0: disabled, 1: enabled compressed, 2: enabled raw| Empty| Empty| Empty|  
-
-                        // MAV_CMD_PREFLIGHT_CALIBRATION=241, // Trigger calibration. This command will be only accepted if in pre-flight mode. |Gyro calibration: 0: no, 1: yes| Magnetometer calibration: 0: no, 1: yes| Ground pressure: 0: no, 1: yes| Radio calibration: 0: no, 1: yes| Empty| Empty| Empty|  
-                        // MAV_CMD_PREFLIGHT_SET_SENSOR_OFFSETS=242, // Set sensor offsets. This command will be only accepted if in pre-flight mode. |Sensor to adjust the offsets for: 0: gyros, 1: accelerometer, 2: magnetometer, 3: barometer, 4: optical flow| X axis offset (or generic dimension 1), in the sensor's raw units| Y axis offset (or generic dimension 2), in the sensor's raw units| Z axis offset (or generic dimension 3), in the sensor's raw units| Generic dimension 4, in the sensor's raw units| Generic dimension 5, in the sensor's raw units| Generic dimension 6, in the sensor's raw units|  
-
-                        case MAV_CMD_PREFLIGHT_STORAGE:
-                            if(mavlink_command_long.param1 == 0) ilink_thalpareq.reqType = 3; // read all
-                            else ilink_thalpareq.reqType = 2; // save all
-                            ILinkSendMessage(ID_ILINK_THALPAREQ, (unsigned short *) & ilink_thalpareq, sizeof(ilink_thalpareq)/2-1);
-                            break;
-                            
-                        case MAV_CMD_NAV_LAND:
-                        case MAV_CMD_NAV_TAKEOFF:
-                        case MAV_CMD_PREFLIGHT_REBOOT_SHUTDOWN: // KILL UAS
-                            /*ilink_thalctrl_rx.command = MAVLINK_MSG_ID_COMMAND_LONG;
-                            ilink_thalctrl_rx.data = mavlink_command_long.command;
-                            ILinkSendMessage(ID_ILINK_THALCTRL, (unsigned short *) & ilink_thalctrl_rx, sizeof(ilink_thalctrl_rx)/2-1);*/
-                            break;
+                    case MAV_CMD_PREFLIGHT_STORAGE:
+                        if(mavlink_command_long.param1 == 0) ilink_thalpareq.reqType = 3; // read all
+                        else ilink_thalpareq.reqType = 2; // save all
+                        ILinkSendMessage(ID_ILINK_THALPAREQ, (unsigned short *) & ilink_thalpareq, sizeof(ilink_thalpareq)/2-1);
+                        break;
                         
-                        case MAV_CMD_OVERRIDE_GOTO:
-                            if(mavlink_command_long.param1 == MAV_GOTO_DO_HOLD) {
-                                waypointGo = 0;
-                            }
-                            else if(mavlink_command_long.param1 == MAV_GOTO_DO_CONTINUE) {
-                                if(waypointGo == 1) {
-                                    if(waypoint[waypointCurrent].command == MAV_CMD_NAV_LOITER_UNLIM && waypointCurrent < waypointCount) {
-                                        waypointCurrent++;
-                                    }
+                    case MAV_CMD_NAV_LAND:
+                    case MAV_CMD_NAV_TAKEOFF:
+                    case MAV_CMD_PREFLIGHT_REBOOT_SHUTDOWN: // KILL UAS
+                        /*ilink_thalctrl_rx.command = MAVLINK_MSG_ID_COMMAND_LONG;
+                        ilink_thalctrl_rx.data = mavlink_command_long.command;
+                        ILinkSendMessage(ID_ILINK_THALCTRL, (unsigned short *) & ilink_thalctrl_rx, sizeof(ilink_thalctrl_rx)/2-1);*/
+                        break;
+                    
+                    case MAV_CMD_OVERRIDE_GOTO:
+                        if(mavlink_command_long.param1 == MAV_GOTO_DO_HOLD) {
+                            waypointGo = 0;
+                        }
+                        else if(mavlink_command_long.param1 == MAV_GOTO_DO_CONTINUE) {
+                            if(waypointGo == 1) {
+                                if(waypointCurrent < waypointCount && WaypointGet(waypointCurrent)->command == MAV_CMD_NAV_LOITER_UNLIM) {
+                                    waypointCurrent++;
                                 }
-                                waypointGo = 1;
-                                waypointReached = 0;
                             }
-                            break;
-                        
-                        
-                        default:
-                            mavlink_command_ack.result = MAV_CMD_ACK_ERR_NOT_SUPPORTED;
-                            mavlink_command_ack.command = mavlink_command_long.command;
-                            mavlink_msg_command_ack_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_command_ack);
-                            mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                            XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                            break; 
-                    }               
-                    break;
-                }
-                break;
-            case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
-                // request send of all parameters
-				ilink_thalpareq.reqType = 0; // request all
-				ILinkSendMessage(ID_ILINK_THALPAREQ, (unsigned short *) & ilink_thalpareq, sizeof(ilink_thalpareq)/2-1);
-                break;
-            case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
-                // request send of all parameters
-                mavlink_msg_param_request_read_decode(&mavlink_rx_msg, &mavlink_param_request_read);
-				
-				ilink_thalpareq.reqType = 1; // request one
-				unsigned short i;
-				for(i=0; i<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; i++) {
-					ilink_thalpareq.paramName[i] = mavlink_param_request_read.param_id[i];
-					if(mavlink_param_set.param_id[i] == '\0') break;
-				}
-				ilink_thalpareq.paramID = mavlink_param_request_read.param_index;
-				ILinkSendMessage(ID_ILINK_THALPAREQ, (unsigned short *) & ilink_thalpareq, sizeof(ilink_thalpareq)/2-1);
-                break;
-            case MAVLINK_MSG_ID_PARAM_SET:
-                // request set parameter
-                mavlink_msg_param_set_decode(&mavlink_rx_msg, &mavlink_param_set);
-                if(mavlink_param_set.target_system == mavlinkID) {
+                            waypointGo = 1;
+                            waypointReached = 0;
+                        }
+                        break;
+                    
                     
+                    default:
+                        mavlink_command_ack.result = MAV_CMD_ACK_ERR_NOT_SUPPORTED;
+                        mavlink_command_ack.command = mavlink_command_long.command;
+                        MAVSendPacket(MAVLINK_MSG_ID_COMMAND_ACK, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_command_ack, MAVLINK_MSG_ID_COMMAND_ACK_LEN);
+                        break; 
+                }               
+                break;
+            }
+            break;
+        case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+            // request send of all parameters
+            if(paramMirrorOverflow) {
+                ParamMirrorRequest(); // relayed as Thalamus sends them
+            }
+            else if(paramMirrorComplete) {
+                ParamQueueAll(); // straight from the mirror
+            }
+            else {
+                // mirror isn't filled yet, send the list as soon as it is
+                paramListPending = 1;
+                ParamMirrorRequest();
+            }
+            break;
+        case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+            // request send of one parameter
+            mavlink_msg_param_request_read_decode(&mavlink_rx_msg, &mavlink_param_request_read);
+            if(paramMirrorComplete && paramMirrorOverflow == 0) {
+                unsigned short i, j;
+                if(mavlink_param_request_read.param_index >= 0) {
+                    i = mavlink_param_request_read.param_index;
+                }
+                else {
+                    // look up by name
+                    for(i=0; i<paramMirrorCount; i++) {
+                        for(j=0; j<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; j++) {
+                            if(paramMirror[i].name[j] != mavlink_param_request_read.param_id[j]) break;
+                            if(paramMirror[i].name[j] == '\0') {
+                                j = MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN;
+                                break;
+                            }
+                        }
+                        if(j == MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN) break; // matched
+                    }
+                }
+                if(i < paramMirrorCount) PARAM_BIT_SET(paramSendPending, i);
+            }
+            else {
+                // mirror isn't filled yet or can't hold everything, ask Thalamus
+                ilink_thalpareq.reqType = 1; // request one
+                unsigned short i;
+                for(i=0; i<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; i++) {
+                    ilink_thalpareq.paramName[i] = mavlink_param_request_read.param_id[i];
+                    if(mavlink_param_request_read.param_id[i] == '\0') break;
+                }
+                ilink_thalpareq.paramID = mavlink_param_request_read.param_index;
+                ILinkSendMessage(ID_ILINK_THALPAREQ, (unsigned short *) & ilink_thalpareq, sizeof(ilink_thalpareq)/2-1);
+            }
+            break;
+        case MAVLINK_MSG_ID_PARAM_SET:
+            // request set parameter
+            mavlink_msg_param_set_decode(&mavlink_rx_msg, &mavlink_param_set);
+            if(mavlink_param_set.target_system == mavlinkID) {
+                
 					unsigned short i;
 					for(i=0; i<MAVLINK_MSG_NAMED_VALUE_FLOAT_FIELD_NAME_LEN; i++) {
 						ilink_thalparam_tx.paramName[i] = mavlink_param_set.param_id[i];
@@ -1237,178 +2451,258 @@ void MAVLinkParse(unsigned char UARTData) {
 					ilink_thalparam_tx.paramValue = mavlink_param_set.param_value;
 					ilink_thalparam_tx.paramCount = 0;
 					ILinkSendMessage(ID_ILINK_THALPARAM, (unsigned short *) &ilink_thalparam_tx, sizeof(ilink_thalparam_tx)/2 - 1);
+            }
+            break;
+        case MAVLINK_MSG_ID_SET_GPS_GLOBAL_ORIGIN:
+            mavlink_msg_set_gps_global_origin_decode(&mavlink_rx_msg, &mavlink_set_gps_global_origin);
+            if (mavlink_set_gps_global_origin.target_system == mavlinkID) {
+                    waypointHome.command = MAV_CMD_NAV_LAND;
+                    waypointHome.autocontinue = 0;
+                    waypointHome.param1 = 0;
+                    waypointHome.param2 = 0;
+                    waypointHome.param3 = 0;
+                    waypointHome.param4 = 0;
+                    NavSetOrigin(mavlink_set_gps_global_origin.latitude, mavlink_set_gps_global_origin.longitude, mavlink_set_gps_global_origin.altitude);
+                    waypointHome.north = 0;
+                    waypointHome.east = 0;
+                    waypointHome.down = 0;
+                    waypointHomeValid = 1;
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_CLEAR_ALL:
+            mavlink_msg_mission_clear_all_decode(&mavlink_rx_msg, &mavlink_mission_clear_all);
+            if (mavlink_mission_clear_all.target_system == mavlinkID) {
+                waypointCurrent = 0;
+                waypointCount = 0;
+                waypointValid = 0;
+                waypointUploading = 0;
+                MissionErase(0); // wipes the header so the old mission doesn't come back after a reset
+
+                mavlink_mission_ack.type = MAV_MISSION_ACCEPTED;
+                MAVSendPacket(MAVLINK_MSG_ID_MISSION_ACK, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_mission_ack, MAVLINK_MSG_ID_MISSION_ACK_LEN);
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_SET_CURRENT:
+            mavlink_msg_mission_set_current_decode(&mavlink_rx_msg, &mavlink_mission_set_current);
+            if (mavlink_mission_set_current.target_system == mavlinkID) {
+                waypointCurrent = mavlink_mission_set_current.seq;
+                mavlink_mission_current.seq = waypointCurrent;
+                MAVSendPacket(MAVLINK_MSG_ID_MISSION_CURRENT, MAV_COMP_ID_MISSIONPLANNER, &mavlink_mission_current, MAVLINK_MSG_ID_MISSION_CURRENT_LEN);     
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_COUNT:
+            mavlink_msg_mission_count_decode(&mavlink_rx_msg, &mavlink_mission_count);
+            if (mavlink_mission_count.target_system == mavlinkID) {
+                if(mavlink_mission_count.count > MAX_WAYPOINTS) {
+                    mavlink_mission_ack.target_system = mavlink_rx_msg.sysid;
+                    mavlink_mission_ack.target_component = mavlink_rx_msg.compid;
+                    mavlink_mission_ack.type = MAV_MISSION_NO_SPACE;
+                    MAVSendPacket(MAVLINK_MSG_ID_MISSION_ACK, MAV_COMP_ID_MISSIONPLANNER, &mavlink_mission_ack, MAVLINK_MSG_ID_MISSION_ACK_LEN);
+                    break;
                 }
-                break;
-            case MAVLINK_MSG_ID_SET_GPS_GLOBAL_ORIGIN:
-                mavlink_msg_set_gps_global_origin_decode(&mavlink_rx_msg, &mavlink_set_gps_global_origin);
-                if (mavlink_set_gps_global_origin.target_system == mavlinkID) {
-                        waypoint[WAYPOINT_HOME].command = MAV_CMD_NAV_LAND;
-                        waypoint[WAYPOINT_HOME].autocontinue = 0;
-                        waypoint[WAYPOINT_HOME].param1 = 0;
-                        waypoint[WAYPOINT_HOME].param2 = 0;
-                        waypoint[WAYPOINT_HOME].param3 = 0;
-                        waypoint[WAYPOINT_HOME].param4 = 0;
-                        waypoint[WAYPOINT_HOME].x = (float)mavlink_set_gps_global_origin.latitude / 10000000.0f;
-                        waypoint[WAYPOINT_HOME].y = (float)mavlink_set_gps_global_origin.longitude / 10000000.0f;
-                        waypoint[WAYPOINT_HOME].z = (float)mavlink_set_gps_global_origin.altitude / 1000.0f;
-                        waypointHomeValid = 1;
-                }
-            case MAVLINK_MSG_ID_MISSION_CLEAR_ALL:
-                mavlink_msg_mission_clear_all_decode(&mavlink_rx_msg, &mavlink_mission_clear_all);
-                if (mavlink_mission_clear_all.target_system == mavlinkID) {
+                
+                if(mavlink_mission_count.count == 0) {
+                    // nothing to request, so the empty mission is stored and acknowledged straight away
                     waypointCurrent = 0;
                     waypointCount = 0;
                     waypointValid = 0;
-
+                    waypointUploading = 0;
+                    MissionErase(0);
+                    missionCommitPending = 1;
+                    missionCommitCount = 0;
+                    
+                    mavlink_mission_ack.target_system = mavlink_rx_msg.sysid;
+                    mavlink_mission_ack.target_component = mavlink_rx_msg.compid;
                     mavlink_mission_ack.type = MAV_MISSION_ACCEPTED;
-                    mavlink_msg_mission_ack_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_mission_ack);
-                    mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                    XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
+                    MAVSendPacket(MAVLINK_MSG_ID_MISSION_ACK, MAV_COMP_ID_MISSIONPLANNER, &mavlink_mission_ack, MAVLINK_MSG_ID_MISSION_ACK_LEN);
+                    break;
                 }
-                break;
-            case MAVLINK_MSG_ID_MISSION_SET_CURRENT:
-                mavlink_msg_mission_set_current_decode(&mavlink_rx_msg, &mavlink_mission_set_current);
-                if (mavlink_mission_set_current.target_system == mavlinkID) {
-                    waypointCurrent = mavlink_mission_set_current.seq;
-                    mavlink_mission_current.seq = waypointCurrent;
-                    mavlink_msg_mission_current_encode(mavlinkID, MAV_COMP_ID_MISSIONPLANNER, &mavlink_tx_msg, &mavlink_mission_current);
-                    mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                    XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);     
+                
+                waypointCount = mavlink_mission_count.count;
+                waypointReceiveIndex = 0;
+                waypointTimer = 0;
+                waypointTries = 0;
+                waypointValid = 0;  // invalidate waypoint storage until full set is received
+                MissionErase(waypointCount);
+                
+                unsigned short i;
+                for(i=0; i<(waypointCount+7)/8; i++) waypointReceived[i] = 0;
+                waypointUploadStart = 0;
+                waypointUploadEnd = waypointCount;
+                waypointRequestCursor = 0;
+                waypointInFlight = 0;
+                waypointPartial = 0;
+                waypointUploading = 1;  // requests go out from the RIT
+                
+                waypointProviderID = mavlink_rx_msg.sysid;
+                waypointProviderComp = mavlink_rx_msg.compid;
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
+            mavlink_msg_mission_request_list_decode(&mavlink_rx_msg, &mavlink_mission_request_list);
+            if (mavlink_mission_request_list.target_system == mavlinkID) {
+                if(waypointValid == 0) {
+                    mavlink_mission_count.count = 0;
                 }
-                break;
-            case MAVLINK_MSG_ID_MISSION_COUNT:
-                mavlink_msg_mission_count_decode(&mavlink_rx_msg, &mavlink_mission_count);
-                if (mavlink_mission_count.target_system == mavlinkID) {
-                    waypointCount = mavlink_mission_count.count;
-                    waypointReceiveIndex = 0;
-                    waypointTimer = WAYPOINT_TIMEOUT; // set waypoint timeout to timed out so that request is immediate
-                    waypointTries = 0;
-                    waypointValid = 0;  // invalidate waypoint storage until full set is received
-                    
-                    waypointProviderID = mavlink_rx_msg.sysid;
-                    waypointProviderComp = mavlink_rx_msg.compid;
+                else {
+                    mavlink_mission_count.count = waypointCount;
                 }
-                break;
-            case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
-                mavlink_msg_mission_request_list_decode(&mavlink_rx_msg, &mavlink_mission_request_list);
-                if (mavlink_mission_request_list.target_system == mavlinkID) {
-                    if(waypointValid == 0) {
-                        mavlink_mission_count.count = 0;
+                
+                mavlink_mission_count.target_system = mavlink_rx_msg.sysid;
+                mavlink_mission_count.target_component = mavlink_rx_msg.compid;
+                MAVSendPacket(MAVLINK_MSG_ID_MISSION_COUNT, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_mission_count, MAVLINK_MSG_ID_MISSION_COUNT_LEN);
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_REQUEST:
+            mavlink_msg_mission_request_decode(&mavlink_rx_msg, &mavlink_mission_request);
+            if (mavlink_mission_request.target_system == mavlinkID) {
+                if(waypointValid != 0 && mavlink_mission_request.seq < waypointCount) {
+                    // sent from the RIT once the flash is free, the same as a partial list of one
+                    waypointSendCursor = mavlink_mission_request.seq;
+                    waypointSendEnd = mavlink_mission_request.seq + 1;
+                    waypointSendID = mavlink_rx_msg.sysid;
+                    waypointSendComp = mavlink_rx_msg.compid;
+                }
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_ITEM:
+            mavlink_msg_mission_item_decode(&mavlink_rx_msg, &mavlink_mission_item);
+            if (mavlink_mission_item.target_system == mavlinkID) {
+                mavlink_mission_ack.type = MAV_MISSION_ERROR;
+                unsigned char sendAck = 1;
+                if(mavlink_mission_item.frame == MAV_FRAME_GLOBAL) {
+                    if(mavlink_mission_item.seq >= MAX_WAYPOINTS) {
+                        mavlink_mission_ack.type = MAV_MISSION_NO_SPACE;
                     }
-                    else {
-                        mavlink_mission_count.count = waypointCount;
+                    else if(waypointUploading == 0 || mavlink_mission_item.seq < waypointUploadStart || mavlink_mission_item.seq >= waypointUploadEnd) {
+                        mavlink_mission_ack.type = MAV_MISSION_INVALID_SEQUENCE;
                     }
-                    
-                    mavlink_mission_count.target_system = mavlink_rx_msg.sysid;
-                    mavlink_mission_count.target_component = mavlink_rx_msg.compid;
-                    mavlink_msg_mission_count_encode(mavlinkID, MAV_COMP_ID_SYSTEM_CONTROL, &mavlink_tx_msg, &mavlink_mission_count);
-                    mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                    XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                }
-                break;
-            case MAVLINK_MSG_ID_MISSION_REQUEST:
-                mavlink_msg_mission_request_decode(&mavlink_rx_msg, &mavlink_mission_request);
-                if (mavlink_mission_request.target_system == mavlinkID) {
-                    if(waypointValid != 0) {
-                        mavlink_mission_item.target_system = mavlink_rx_msg.sysid;
-                        mavlink_mission_item.target_component = mavlink_rx_msg.compid;    
-
-                        mavlink_mission_item.seq = mavlink_mission_request.seq;
-                        mavlink_mission_item.frame = MAV_FRAME_GLOBAL;
-                        mavlink_mission_item.command = waypoint[mavlink_mission_request.seq].command;
-                        mavlink_mission_item.autocontinue = waypoint[mavlink_mission_request.seq].autocontinue;
-                        mavlink_mission_item.param1 = waypoint[mavlink_mission_request.seq].param1;
-                        mavlink_mission_item.param2 = waypoint[mavlink_mission_request.seq].param2;
-                        mavlink_mission_item.param3 = waypoint[mavlink_mission_request.seq].param3;
-                        mavlink_mission_item.param4 = waypoint[mavlink_mission_request.seq].param4;
-                        mavlink_mission_item.x = waypoint[mavlink_mission_request.seq].x;
-                        mavlink_mission_item.y = waypoint[mavlink_mission_request.seq].y;
-                        mavlink_mission_item.z = waypoint[mavlink_mission_request.seq].z;
-                        
-                        if(waypointCurrent == mavlink_mission_request.seq) {
-                            mavlink_mission_item.current = 1;
-                        }
-                        else {
-                            mavlink_mission_item.current = 0;
-                        }
-                            
-                        mavlink_msg_mission_item_encode(mavlinkID, MAV_COMP_ID_MISSIONPLANNER, &mavlink_tx_msg, &mavlink_mission_item);
-                        mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                        XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
+                    else if(missionJob == MISSION_JOB_ERASE) {
+                        sendAck = 0; // nothing has been requested yet, so this is left over from before the MISSION_COUNT
                     }
-                }
-                break;
-            case MAVLINK_MSG_ID_MISSION_ITEM:
-                mavlink_msg_mission_item_decode(&mavlink_rx_msg, &mavlink_mission_item);
-                if (mavlink_mission_item.target_system == mavlinkID) {
-                    mavlink_mission_ack.type = MAV_MISSION_ERROR;
-                    if(mavlink_mission_item.frame == MAV_FRAME_GLOBAL) {
-                        if(mavlink_mission_item.seq < MAX_WAYPOINTS) {
-                            //waypoint[mavlink_mission_item.seq].frame = mavlink_mission_item.frame;
-                            waypoint[mavlink_mission_item.seq].command = mavlink_mission_item.command;
-                            waypoint[mavlink_mission_item.seq].autocontinue = mavlink_mission_item.autocontinue;
-                            waypoint[mavlink_mission_item.seq].param1 = mavlink_mission_item.param1;
-                            waypoint[mavlink_mission_item.seq].param2 = mavlink_mission_item.param2;
-                            waypoint[mavlink_mission_item.seq].param3 = mavlink_mission_item.param3;
-                            waypoint[mavlink_mission_item.seq].param4 = mavlink_mission_item.param4;
-                            waypoint[mavlink_mission_item.seq].x = mavlink_mission_item.x;
-                            waypoint[mavlink_mission_item.seq].y = mavlink_mission_item.y;
-                            waypoint[mavlink_mission_item.seq].z = mavlink_mission_item.z;
-                            
-                            if(mavlink_mission_item.current == 1) {
-                                waypointCurrent = mavlink_mission_item.seq;
+                    else {
+                        // items can arrive in any order, and more than once if a request was repeated
+                        if(WAYPOINT_RECEIVED(mavlink_mission_item.seq) == 0) {
+                            missionRecord_t record;
+                            record.command = mavlink_mission_item.command;
+                            record.autocontinue = mavlink_mission_item.autocontinue;
+                            record.reserved = 0xff;
+                            record.param1 = mavlink_mission_item.param1;
+                            record.param2 = mavlink_mission_item.param2;
+                            record.param3 = mavlink_mission_item.param3;
+                            record.param4 = mavlink_mission_item.param4;
+                            record.lat = (double)mavlink_mission_item.x * 10000000.0;
+                            record.lon = (double)mavlink_mission_item.y * 10000000.0;
+                            record.alt = mavlink_mission_item.z * 1000.0f;
+                            // a live mission is patched, a new one written straight into the erased area, both by MissionService()
+                            if(MissionQueueItem(mavlink_mission_item.seq, &record, waypointPartial ? MISSION_SLOT_PATCH : MISSION_SLOT_WRITE)) { // otherwise it's requested again
+                                waypointReceived[mavlink_mission_item.seq >> 3] |= 1 << (mavlink_mission_item.seq & 0x7);
+                                waypointReceiveIndex++;
                             }
+                        }
                         
-                            waypointReceiveIndex++;
-                            waypointTimer = WAYPOINT_TIMEOUT; // set waypoint timeout to timed out so that request is immediate
-                            waypointTries = 0;
-                            mavlink_mission_ack.target_system = mavlink_rx_msg.sysid;
-                            mavlink_mission_ack.target_component = mavlink_rx_msg.compid;
-                            if(waypointReceiveIndex >= waypointCount) {
-                                mavlink_mission_ack.type = MAV_MISSION_ACCEPTED;
-                                waypointValid = 1;
-                            }
-                            else if(waypointReceiveIndex >= MAX_WAYPOINTS) {
-                                mavlink_mission_ack.type = MAV_MISSION_NO_SPACE;
+                        if(mavlink_mission_item.current == 1) {
+                            waypointCurrent = mavlink_mission_item.seq;
+                        }
+                        
+                        if(waypointInFlight) waypointInFlight--; // frees a slot in the request window
+                        waypointTimer = 0;
+                        waypointTries = 0;
+                        
+                        if(waypointReceiveIndex >= waypointUploadEnd - waypointUploadStart) {
+                            waypointUploading = 0;
+                            mavlink_mission_ack.type = MAV_MISSION_ACCEPTED;
+                            if(waypointPartial == 0) {
+                                // the header goes in once the queued items have been written, and the mission is valid from then
+                                missionCommitPending = 1;
+                                missionCommitCount = waypointCount;
                             }
                         }
                         else {
-                            mavlink_mission_ack.type = MAV_MISSION_NO_SPACE;
+                            sendAck = 0; // only the final item is acknowledged
                         }
                     }
-                    else {
-                        mavlink_mission_ack.type = MAV_MISSION_UNSUPPORTED_FRAME;
-                    }
-                    
-                    mavlink_msg_mission_ack_encode(mavlinkID, MAV_COMP_ID_MISSIONPLANNER, &mavlink_tx_msg, &mavlink_mission_ack);
-                    mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                    XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
                 }
-                break;
-            case MAVLINK_MSG_ID_MISSION_WRITE_PARTIAL_LIST:
-                mavlink_mission_ack.type = MAV_MISSION_UNSUPPORTED;
-                mavlink_msg_mission_ack_encode(mavlinkID, MAV_COMP_ID_MISSIONPLANNER, &mavlink_tx_msg, &mavlink_mission_ack);
-                mavlink_message_len = mavlink_msg_to_send_buffer(mavlink_message_buf, &mavlink_tx_msg);
-                XBeeWriteCoordinator(mavlink_message_buf, mavlink_message_len);
-                break;
-            case MAVLINK_MSG_ID_MISSION_ACK:
-                //ignored
-                break;
+                else {
+                    mavlink_mission_ack.type = MAV_MISSION_UNSUPPORTED_FRAME;
+                }
                 
-            case MAVLINK_MSG_ID_REQUEST_DATA_STREAM:
-                // Sets the output data rates
-                mavlink_msg_request_data_stream_decode(&mavlink_rx_msg, &mavlink_request_data_stream);
-                if (mavlink_request_data_stream.target_system == mavlinkID) {
-                    if(mavlink_request_data_stream.req_message_rate > 255) mavlink_request_data_stream.req_message_rate = 255;
-                    dataRate[mavlink_request_data_stream.req_stream_id] = mavlink_request_data_stream.req_message_rate;
+                if(sendAck) {
+                    mavlink_mission_ack.target_system = mavlink_rx_msg.sysid;
+                    mavlink_mission_ack.target_component = mavlink_rx_msg.compid;
+                    MAVSendPacket(MAVLINK_MSG_ID_MISSION_ACK, MAV_COMP_ID_MISSIONPLANNER, &mavlink_mission_ack, MAVLINK_MSG_ID_MISSION_ACK_LEN);
                 }
-                break;
-            default:
-                MAVSendInt("CMDIGNORE", mavlink_rx_msg.msgid);
-                break;
-        }
-        //if(mavlink_rx_msg.msgid != 0) MAVSendInt("CMD", mavlink_rx_msg.msgid);
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_WRITE_PARTIAL_LIST:
+            mavlink_msg_mission_write_partial_list_decode(&mavlink_rx_msg, &mavlink_mission_write_partial_list);
+            if (mavlink_mission_write_partial_list.target_system == mavlinkID) {
+                // only items of the existing mission can be replaced, and not while another upload is going on
+                if(waypointValid == 0 || waypointUploading || mavlink_mission_write_partial_list.start_index < 0 ||
+                        mavlink_mission_write_partial_list.end_index < mavlink_mission_write_partial_list.start_index ||
+                        mavlink_mission_write_partial_list.end_index >= waypointCount) {
+                    mavlink_mission_ack.target_system = mavlink_rx_msg.sysid;
+                    mavlink_mission_ack.target_component = mavlink_rx_msg.compid;
+                    mavlink_mission_ack.type = MAV_MISSION_ERROR;
+                    MAVSendPacket(MAVLINK_MSG_ID_MISSION_ACK, MAV_COMP_ID_MISSIONPLANNER, &mavlink_mission_ack, MAVLINK_MSG_ID_MISSION_ACK_LEN);
+                    break;
+                }
+                
+                // same windowed upload as MISSION_COUNT, but the mission stays valid and keeps flying while the items are patched
+                unsigned short i;
+                waypointUploadStart = mavlink_mission_write_partial_list.start_index;
+                waypointUploadEnd = mavlink_mission_write_partial_list.end_index + 1;
+                for(i=waypointUploadStart; i<waypointUploadEnd; i++) waypointReceived[i >> 3] &= ~(1 << (i & 0x7));
+                waypointReceiveIndex = 0;
+                waypointRequestCursor = waypointUploadStart;
+                waypointInFlight = 0;
+                waypointTimer = 0;
+                waypointTries = 0;
+                waypointPartial = 1;
+                waypointUploading = 1;
+                
+                waypointProviderID = mavlink_rx_msg.sysid;
+                waypointProviderComp = mavlink_rx_msg.compid;
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_REQUEST_PARTIAL_LIST:
+            mavlink_msg_mission_request_partial_list_decode(&mavlink_rx_msg, &mavlink_mission_request_partial_list);
+            if (mavlink_mission_request_partial_list.target_system == mavlinkID && waypointValid != 0) {
+                // the items are sent straight out from the RIT without waiting for a MISSION_REQUEST for each
+                waypointSendCursor = mavlink_mission_request_partial_list.start_index < 0 ? 0 : mavlink_mission_request_partial_list.start_index;
+                if(mavlink_mission_request_partial_list.end_index < 0 || mavlink_mission_request_partial_list.end_index >= waypointCount) waypointSendEnd = waypointCount; // -1 means to the end
+                else waypointSendEnd = mavlink_mission_request_partial_list.end_index + 1;
+                waypointSendID = mavlink_rx_msg.sysid;
+                waypointSendComp = mavlink_rx_msg.compid;
+            }
+            break;
+        case MAVLINK_MSG_ID_MISSION_ACK:
+            //ignored
+            break;
+            
+        case MAVLINK_MSG_ID_NAMED_VALUE_INT:
+            // Hypx announcing whether it will expand truncated payloads
+            mavlink_msg_named_value_int_decode(&mavlink_rx_msg, &mavlink_named_value_int_rx);
+            if(mavlink_rx_msg.compid == MAV_COMP_ID_UART_BRIDGE && strncmp(mavlink_named_value_int_rx.name, "TRUNCATE", MAVLINK_MSG_NAMED_VALUE_INT_FIELD_NAME_LEN) == 0) {
+                linkTruncate = mavlink_named_value_int_rx.value ? 1 : 0;
+                linkTruncateWatchdog = 0;
+            }
+            break;
+            
+        case MAVLINK_MSG_ID_REQUEST_DATA_STREAM:
+            // Sets the output data rates
+            mavlink_msg_request_data_stream_decode(&mavlink_rx_msg, &mavlink_request_data_stream);
+            if (mavlink_request_data_stream.target_system == mavlinkID) {
+                if(mavlink_request_data_stream.req_message_rate > 255) mavlink_request_data_stream.req_message_rate = 255;
+                dataRate[mavlink_request_data_stream.req_stream_id] = mavlink_request_data_stream.req_message_rate;
+                LinkApplyRates();
+            }
+            break;
+        default:
+            MAVSendInt("CMDIGNORE", mavlink_rx_msg.msgid);
+            break;
     }
+    //if(mavlink_rx_msg.msgid != 0) MAVSendInt("CMD", mavlink_rx_msg.msgid);
 }
 
 
@@ -1431,6 +2725,7 @@ void GPSMessage(unsigned short id, unsigned char * buffer, unsigned short length
             ptr[j] = buffer[j];
         }
         ptr[j] = 1; // this is the "isNew" byte
+        LogRecord(LOG_SOURCE_GPS, id, buffer, length);
     }
 }
 
@@ -1460,6 +2755,24 @@ void ILinkMessage(unsigned short id, unsigned short * buffer, unsigned short len
         ptr[j] = 1; // this is the "isNew" byte
         
         switch(id) {
+            case ID_ILINK_THALSTAT:
+                logStatusCounter = 0;
+                
+                // record for as long as Thalamus is armed (MAV_STATE_ACTIVE), each arming is a new flight in the log
+                if((ilink_thalstat.sensorStatus & 0x7) == 4) {
+                    if(logRecording == 0) LogStart();
+                }
+                else {
+                    logRecording = 0;
+                }
+                LogRecord(LOG_SOURCE_ILINK, id, buffer, length*2);
+                break;
+            case ID_ILINK_ATTITUDE:
+            case ID_ILINK_RAWIMU:
+            case ID_ILINK_INPUTS0:
+            case ID_ILINK_OUTPUTS0:
+                LogRecord(LOG_SOURCE_ILINK, id, buffer, length*2);
+                break;
             case ID_ILINK_THALCTRL:
                 switch(ilink_thalctrl_rx.command) {
                     case 0x0090: // horizontal hold
@@ -1473,14 +2786,50 @@ void ILinkMessage(unsigned short id, unsigned short * buffer, unsigned short len
                         break;
                 }
                 break;
-            case ID_ILINK_THALPARAM: // store parameters in buffer
-                if(paramPointer > 0) {
-                    paramPointer--;
-                    paramBuffer[paramPointer].value = ilink_thalparam_rx.paramValue;
-                    paramBuffer[paramPointer].id = ilink_thalparam_rx.paramID;
+            case ID_ILINK_THALPARAM: // store parameters in the mirror
+                if(ilink_thalparam_rx.paramCount > PARAM_MIRROR_SIZE) {
+                    // too many to mirror, so from now on everything Thalamus sends is passed on
+                    paramMirrorOverflow = 1;
+                    paramListPending = 0;
+                    paramRelayCount = ilink_thalparam_rx.paramCount;
+                    
+                    if((paramRelayPush + 1) % PARAM_RELAY_SIZE != paramRelayPop) { // otherwise dropped, the GCS asks again for what it's missing
+                        paramRelay[paramRelayPush].value = ilink_thalparam_rx.paramValue;
+                        paramRelay[paramRelayPush].id = ilink_thalparam_rx.paramID;
+                        for(j=0; j<16; j++) {
+                            paramRelay[paramRelayPush].name[j] = ilink_thalparam_rx.paramName[j];
+                            if(ilink_thalparam_rx.paramName[j] == '\0') break;
+                        }
+                        paramRelayPush = (paramRelayPush + 1) % PARAM_RELAY_SIZE;
+                    }
+                }
+                
+                if(ilink_thalparam_rx.paramID < PARAM_MIRROR_SIZE) {
+                    unsigned short id = ilink_thalparam_rx.paramID;
+                    
+                    paramMirror[id].value = ilink_thalparam_rx.paramValue;
                     for(j=0; j<16; j++) {
-                        paramBuffer[paramPointer].name[j] = ilink_thalparam_rx.paramName[j];
-                        if(ilink_thalparam_rx.paramName[j] == '\r') break;
+                        paramMirror[id].name[j] = ilink_thalparam_rx.paramName[j];
+                        if(ilink_thalparam_rx.paramName[j] == '\0') break;
+                    }
+                    for(; j<16; j++) paramMirror[id].name[j] = '\0';
+                    
+                    paramMirrorCount = ilink_thalparam_rx.paramCount < PARAM_MIRROR_SIZE ? ilink_thalparam_rx.paramCount : PARAM_MIRROR_SIZE;
+                    if(PARAM_BIT_TEST(paramMirrorHave, id) == 0) {
+                        PARAM_BIT_SET(paramMirrorHave, id);
+                        paramMirrorReceived++;
+                    }
+                    
+                    if(paramMirrorComplete) {
+                        // once filled, anything Thalamus sends is a change (PARAM_SET acknowledgement or EEPROM reload), pass it on
+                        if(paramMirrorOverflow == 0) PARAM_BIT_SET(paramSendPending, id);
+                    }
+                    else if(paramMirrorReceived >= paramMirrorCount) {
+                        paramMirrorComplete = 1;
+                        if(paramListPending) {
+                            paramListPending = 0;
+                            ParamQueueAll();
+                        }
                     }
                 }
                 break;
@@ -1491,6 +2840,7 @@ void ILinkMessage(unsigned short id, unsigned short * buffer, unsigned short len
                 break;
 			case ID_ILINK_IDENTIFY:
 				if(ilink_identify.firmVersion == FIRMWARE_VERSION && ilink_identify.deviceID == I_AM_THALAMUS) {
+					if(paramMirrorComplete == 0) ParamMirrorRequest(); // Thalamus is up, fill the mirror
 					mavlink_sys_status.onboard_control_sensors_present |= MAVLINK_SENSOR_GYRO | MAVLINK_SENSOR_ACCEL | MAVLINK_SENSOR_MAGNETO | MAVLINK_SENSOR_BARO | MAVLINK_CONTROL_ANGLERATE | MAVLINK_CONTROL_ATTITUDE | MAVLINK_CONTROL_YAW | MAVLINK_CONTROL_Z;
 					mavlink_sys_status.onboard_control_sensors_health = mavlink_sys_status.onboard_control_sensors_enabled;
 				}
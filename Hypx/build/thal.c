@@ -339,6 +339,9 @@ void WaitDelay(unsigned int milliseconds) {
 	void SysTick_Handler(void) {
 		FUNCSysTicks++; // increment tick timer variable for use with Delays
         if(FUNCTimeout>0) FUNCTimeout--;
+        #if (WHO_AM_I == I_AM_HYPO || WHO_AM_I == I_AM_HYPX) && UART_EN && XBEE_EN
+            if(FUNCXBeeATTimer>0) FUNCXBeeATTimer--;
+        #endif
 		if(SysTickInterrupt) SysTickInterrupt();  // Run user-supplied interrupt function if available
         if(SDTick) SDTick();
 	}
@@ -1183,7 +1186,7 @@ void PIOINT3_IRQHandler(void) {
     
     void UARTWriteByte(unsigned char data) {
         #if UART_USE_OUTBUFFER
-            while(UARTBufferWritable() == 0);
+            UARTBufferWait();
             UARTBufferPush(data);
         #else
             //LPC_USART->IER &= ~0x001;                    // Disable receive interrupt while transmitting (causes problems in loop-back mode)
@@ -1196,7 +1199,7 @@ void PIOINT3_IRQHandler(void) {
     void UARTWrite(unsigned char * data, unsigned int length) {
         #if UART_USE_OUTBUFFER
             while(length > 0) {
-                while(UARTBufferWritable() == 0);
+                UARTBufferWait();
                 UARTBufferPush(data[0]);
                 length--;
                 data++;
@@ -1251,9 +1254,20 @@ void PIOINT3_IRQHandler(void) {
             return retval;
         }
         void UARTBufferPush(unsigned char data) {
-            FUNCUARTBuffer[FUNCUARTBufferPush++] = data;
+            unsigned short next = FUNCUARTBufferPush + 1;
+            if(next >= UART_BUFFER_SIZE) next = 0;
+            FUNCUARTBuffer[FUNCUARTBufferPush] = data;
+            FUNCUARTBufferPush = next; // publish the byte before enabling THRE, or the interrupt can see an empty buffer and switch itself off
             LPC_USART->IER |= 0x02;
-            if(FUNCUARTBufferPush >= UART_BUFFER_SIZE) FUNCUARTBufferPush = 0;
+        }
+        void UARTBufferWait(void) {
+            // If the buffer is full, feed the FIFO by hand until there is room, the THRE interrupt can't empty it if
+            // the caller has the UART interrupt masked (XBeeInhibit) or is itself an interrupt of the same priority
+            while(UARTBufferWritable() == 0) {
+                __disable_irq();
+                if((LPC_USART->LSR & 0x20) && UARTBufferReadable()) LPC_USART->THR = UARTBufferPop();
+                __enable_irq();
+            }
         }
     #endif
     
@@ -2754,6 +2768,7 @@ void CDCInit(unsigned char bridge) {
     /* user defined functions */
     cdc_param.SetLineCode = VCOM_SetLineCode; 
     usb_param.USB_SOF_Event = VCOM_sof_event; 
+    usb_param.USB_Reset_Event = VCOM_reset_event;
     cdc_param.SendBreak = VCOM_SendBreak;
 
     /* USB Initialization */
@@ -2907,17 +2922,54 @@ void VCOM_uart_read(VCOM_DATA_T* pVcom) {
     pVcom->last_ser_rx = pVcom->sof_counter;
 }
 
+unsigned char FUNCCDCBuffer[CDC_BUFFER_SIZE];
+volatile unsigned short FUNCCDCBufferPush, FUNCCDCBufferPop;
+volatile unsigned int FUNCCDCBufferFrame;   // frame the oldest waiting data arrived in
+unsigned char FUNCCDCZLP;                   // last packet was full, end the transfer with a zero length packet
+volatile unsigned char FUNCCDCBusy;         // a packet is in the IN endpoint, txBuf can't be touched until the host takes it
+
+unsigned short CDCWritable(void) {
+    return (FUNCCDCBufferPop - FUNCCDCBufferPush - 1) & (CDC_BUFFER_SIZE - 1);
+}
+
 void CDCWriteByte(unsigned char byte) {
-    VCOM_DATA_T* pVcom = &g_vCOM;
+    unsigned short next = (FUNCCDCBufferPush + 1) & (CDC_BUFFER_SIZE - 1);
+    
+    if(next == FUNCCDCBufferPop) return; // buffer full, drop the byte
+    if(FUNCCDCBufferPush == FUNCCDCBufferPop) FUNCCDCBufferFrame = g_vCOM.sof_counter;
+    FUNCCDCBuffer[FUNCCDCBufferPush] = byte;
+    FUNCCDCBufferPush = next;
+}
 
-    if(pVcom->txlen < USB_MAX_BULK_PACKET) {
-        pVcom->txBuf[pVcom->txlen++] = byte;
+void VCOM_virtual_send(VCOM_DATA_T* pVcom) {
+    // Called every frame: send a packet once there's a full one waiting, or once data has waited CDC_LATENCY frames
+    // (and from VCOM_bulk_in_hdlr as soon as the last one has gone), only ever with the endpoint idle
+    unsigned short count = (FUNCCDCBufferPush - FUNCCDCBufferPop) & (CDC_BUFFER_SIZE - 1);
+    unsigned short i;
+    
+    if(FUNCCDCBusy) return;
+    
+    if(count == 0) {
+        if(FUNCCDCZLP) {
+            FUNCCDCZLP = 0;
+            FUNCCDCBusy = 1;
+            USBROM->hw->WriteEP(pVcom->hUsb, USB_CDC_EP_BULK_IN, pVcom->txBuf, 0);
+        }
+        return;
     }
-
-    if (pVcom->txlen == USB_MAX_BULK_PACKET) {
-        VCOM_usb_send(pVcom);
+    if(count < USB_MAX_BULK_PACKET && pVcom->sof_counter - FUNCCDCBufferFrame < CDC_LATENCY) return;
+    
+    if(count > USB_MAX_BULK_PACKET) count = USB_MAX_BULK_PACKET;
+    for(i=0; i<count; i++) {
+        pVcom->txBuf[i] = FUNCCDCBuffer[FUNCCDCBufferPop];
+        FUNCCDCBufferPop = (FUNCCDCBufferPop + 1) & (CDC_BUFFER_SIZE - 1);
     }
-    pVcom->last_ser_rx = pVcom->sof_counter;
+    FUNCCDCBufferFrame = pVcom->sof_counter; // anything left has waited long enough already, but give it a frame to fill up
+    FUNCCDCZLP = (count == USB_MAX_BULK_PACKET);
+    
+    FUNCCDCBusy = 1;
+    pVcom->txlen = count;
+    VCOM_usb_send(pVcom);
 }
 
 void VCOM_uart_send(VCOM_DATA_T* pVcom) {
@@ -2935,6 +2987,9 @@ void VCOM_uart_send(VCOM_DATA_T* pVcom) {
         tx_cnt = (pVcom->rxlen - pVcom->ser_pos);
         
         while(tx_cnt) {
+            // if the application can't take any more, leave the rest in the buffer: the endpoint isn't read again
+            // until it is empty, so the host is NAKed until VCOM_sof_event tries again
+            if(CDCReadReady() == 0) return;
             CDCReadByte(pbuf[pVcom->ser_pos++]);
             tx_cnt--;
         }
@@ -2958,6 +3013,8 @@ void CDCWrite(unsigned char * byte, unsigned int length) {
 
 void CDCDummy(unsigned char byte) { return; }
 void CDCReadByte(unsigned char byte) WEAK_ALIAS(CDCDummy);
+unsigned int CDCReadyDummy(void) { return 1; }
+unsigned int CDCReadReady(void) WEAK_ALIAS(CDCReadyDummy);
 
 ErrorCode_t VCOM_SetLineCode (USBD_HANDLE_T hCDC, CDC_LINE_CODING* line_coding) {
     VCOM_DATA_T* pVcom = &g_vCOM;
@@ -2991,8 +3048,18 @@ ErrorCode_t VCOM_sof_event(USBD_HANDLE_T hUsb) {
         }
     }
 
-    if ( pVcom->last_ser_rx && (diff > 5)) {
-        VCOM_usb_send(pVcom);
+    if(VCOM_isbridge) {
+        if ( pVcom->last_ser_rx && (diff > 5)) {
+            VCOM_usb_send(pVcom);
+        }
+    }
+    else {
+        VCOM_virtual_send(pVcom);
+        
+        // resume data that was held back by CDCReadReady()
+        if(pVcom->rxlen) {
+            pVcom->send_fn(pVcom);
+        }
     }
 
     return LPC_OK;
@@ -3020,7 +3087,21 @@ ErrorCode_t VCOM_SendBreak(USBD_HANDLE_T hCDC, uint16_t mstime) {
 }
 
 ErrorCode_t VCOM_bulk_in_hdlr(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
-  return LPC_OK;
+    VCOM_DATA_T* pVcom = (VCOM_DATA_T*) data;
+    
+    if(event == USB_EVT_IN) {
+        // the host has taken the last packet, the next can go straight away
+        FUNCCDCBusy = 0;
+        if(VCOM_isbridge == 0) VCOM_virtual_send(pVcom);
+    }
+    return LPC_OK;
+}
+
+ErrorCode_t VCOM_reset_event(USBD_HANDLE_T hUsb) {
+    // a packet waiting in the IN endpoint is lost with a bus reset, and no USB_EVT_IN comes for it
+    FUNCCDCBusy = 0;
+    FUNCCDCZLP = 0;
+    return LPC_OK;
 }
 
 ErrorCode_t VCOM_bulk_out_hdlr(USBD_HANDLE_T hUsb, void* data, uint32_t event) {
@@ -4542,9 +4623,20 @@ unsigned char PRGPoll(void) {
         volatile unsigned char FUNCXBeetBufCount;
         
         volatile unsigned int FUNCXBeeState;
-        volatile unsigned short FUNCXBeeLength, FUNCXBeeID, FUNCXBeePacket;
+        volatile unsigned short FUNCXBeeLength, FUNCXBeePacket;
         volatile unsigned char FUNCXBeeChecksum;
-        unsigned char FUNCXBeeBuffer[XBEE_BUFFER_SIZE];
+        
+        // Receive ring: the interrupt stores each frame (ID then data) whole and contiguous in here and records where it
+        // is, then XBeeProcess() hands it to XBeeMessage() in place.  Frames that won't fit before the end of the ring
+        // go back to the start, so the end of the last frame (push) can be behind the start of the oldest one (pop).
+        unsigned char FUNCXBeeRing[XBEE_RING_SIZE];
+        volatile unsigned short FUNCXBeeRingPush, FUNCXBeeRingPop;
+        volatile unsigned short FUNCXBeeFrameStart;
+        unsigned short FUNCXBeeFrameOffset[XBEE_FRAME_COUNT];
+        unsigned short FUNCXBeeFrameLength[XBEE_FRAME_COUNT];
+        volatile unsigned char FUNCXBeeFramePush, FUNCXBeeFramePop;
+        volatile unsigned char FUNCXBeeProcessing;
+        volatile unsigned int FUNCXBeeDrops;
         
         unsigned char XBeeSendATCommand(void) {
             xbee_at_command.frameID = Random() | 0x1;
@@ -4553,7 +4645,7 @@ unsigned char PRGPoll(void) {
             // check status
             xbee_at_response.isNew = 0;
             FUNCTimeout = 1000;
-            while(FUNCTimeout > 0 && xbee_at_response.isNew == 0);
+            while(FUNCTimeout > 0 && xbee_at_response.isNew == 0) XBeeProcess();
             if(xbee_at_response.frameID == xbee_at_command.frameID && xbee_at_response.commandStatus == 0) {
                 return 1;
             }
@@ -4585,231 +4677,192 @@ unsigned char PRGPoll(void) {
         }
         
         unsigned char XBeeSendPacket(void) {
-            xbee_transmit_request.frameID = Random() | 0x01;
-            xbee_transmit_request.broadcastRadius = 0;
-            xbee_transmit_request.options = 0x01; // disable ACK;
+            return XBeeSendRequest(&xbee_transmit_request);
+        }
+        
+        unsigned char XBeeSendRequest(xbee_transmit_request_t * request) {
+            request->frameID = Random() | 0x01;
+            request->broadcastRadius = 0;
+            #if XBEE_TX_ACK
+                request->options = 0x00; // ACK and retry, the outcome comes back in a transmit status frame
+            #else
+                request->options = 0x01; // disable ACK;
+            #endif
 
-            XBeeSendFrame(ID_XBEE_TRANSMITREQUEST, (unsigned char *)&xbee_transmit_request, sizeof(xbee_transmit_request)-2-255+xbee_transmit_request.varLen);
+            XBeeSendFrame(ID_XBEE_TRANSMITREQUEST, (unsigned char *)request, sizeof(xbee_transmit_request_t)-2-255+request->varLen);
 
             return 1;
         }
 
-        void XBeeAllowJoin() {
-            XBeeStopJoin();
+        // AT command queue: commands are sent one at a time, the response is matched on frame ID and handed to the
+        // command's callback (status 0xff if there was no response within XBEE_AT_TIMEOUT).  XBeeATPoll() sends the
+        // next command and handles timeouts, XBeeATResponse() is given AT response frames by the receive path.
+        xbee_at_queued_t FUNCXBeeATQueue[XBEE_AT_QUEUE];
+        volatile unsigned char FUNCXBeeATPush, FUNCXBeeATPop;
+        volatile unsigned char FUNCXBeeATState;     // 0 idle, 1 waiting to send the head command, 2 waiting for its response
+        volatile unsigned char FUNCXBeeATFrameID;
+        volatile unsigned short FUNCXBeeATTimer;    // counted down by SysTick
+        
+        unsigned char XBeeQueueAT(unsigned char ATCommand1, unsigned char ATCommand2, const unsigned char * parameter, unsigned char length, unsigned short delay, XBeeATCallback_t callback) {
+            unsigned int i;
+            unsigned char next;
             
-            // set NJ
-            xbee_at_command.frameID = Random() | 0x1;
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'J';
-            xbee_at_command.parameterValue[0] = XBEE_JOINPERIOD;
-            xbee_at_command.varLen = 1;
-            XBeeSendATCommand();
+            if(length > 16) return 0;
+            
+            __disable_irq(); // commands are queued from the main loop and from callbacks
+            next = (FUNCXBeeATPush + 1) % XBEE_AT_QUEUE;
+            if(next == FUNCXBeeATPop) {
+                __enable_irq();
+                return 0;
+            }
+            FUNCXBeeATQueue[FUNCXBeeATPush].ATCommand1 = ATCommand1;
+            FUNCXBeeATQueue[FUNCXBeeATPush].ATCommand2 = ATCommand2;
+            for(i=0; i<length; i++) {
+                FUNCXBeeATQueue[FUNCXBeeATPush].parameterValue[i] = parameter[i];
+            }
+            FUNCXBeeATQueue[FUNCXBeeATPush].varLen = length;
+            FUNCXBeeATQueue[FUNCXBeeATPush].delay = delay;
+            FUNCXBeeATQueue[FUNCXBeeATPush].callback = callback;
+            FUNCXBeeATPush = next;
+            __enable_irq();
+            return 1;
         }
         
-        void XBeeStopJoin() {
-            // set NJ
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'J';
-            xbee_at_command.parameterValue[0] = 0x00;
-            xbee_at_command.varLen = 1;
-            XBeeSendATCommand();
+        unsigned char XBeeQueueATByte(unsigned char ATCommand1, unsigned char ATCommand2, unsigned char value, XBeeATCallback_t callback) {
+            return XBeeQueueAT(ATCommand1, ATCommand2, &value, 1, 0, callback);
         }
-
         
-        void XBeeJoin() {
-            xbee_at_response.isNew = 0;
-            
-            // NR to network reset
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-
-            // NJ0 to prevent others joining
-            XBeeStopJoin();
-            
-            // PL# to set power level
-            xbee_at_command.ATCommand1 = 'P';
-            xbee_at_command.ATCommand2 = 'L';
-            xbee_at_command.parameterValue[0] = XBEE_POWER_LEVEL;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // JN1 to enable join notification
-            xbee_at_command.ATCommand1 = 'J';
-            xbee_at_command.ATCommand2 = 'N';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // CE0 to disable coordinator mode
-            xbee_at_command.ATCommand1 = 'C';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // ID0 to set PAN ID to 0 (autofind network)
-            xbee_at_command.ATCommand1 = 'I';
-            xbee_at_command.ATCommand2 = 'D';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+        unsigned char XBeeATBusy(void) {
+            return (FUNCXBeeATState != 0 || FUNCXBeeATPush != FUNCXBeeATPop);
+        }
+        
+        unsigned char XBeeATFree(void) {
+            // the command being sent or waited on keeps its slot until it completes
+            return XBEE_AT_QUEUE - 1 - (FUNCXBeeATPush + XBEE_AT_QUEUE - FUNCXBeeATPop) % XBEE_AT_QUEUE;
+        }
+        
+        void FUNCXBeeATComplete(unsigned char frameID, unsigned char status, unsigned char * data, unsigned short length) {
+            XBeeATCallback_t callback;
             
-            // EE1 for encryption enable
-            xbee_at_command.ATCommand1 = 'E';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            // the response and the timeout can turn up together, only the first one to get here completes the command
+            __disable_irq();
+            if(FUNCXBeeATState != 2 || FUNCXBeeATFrameID != frameID) {
+                __enable_irq();
+                return;
+            }
             
-            // KY### to set link key
-            xbee_at_command.ATCommand1 = 'K';
-            xbee_at_command.ATCommand2 = 'Y';
-            xbee_at_command.parameterValue[0] = 'U';
-            xbee_at_command.parameterValue[1] = 'N';
-            xbee_at_command.parameterValue[2] = 'I';
-            xbee_at_command.parameterValue[3] = 'V';
-            xbee_at_command.parameterValue[4] = 'E';
-            xbee_at_command.parameterValue[5] = 'R';
-            xbee_at_command.parameterValue[6] = 'S';
-            xbee_at_command.parameterValue[7] = 'A';
-            xbee_at_command.parameterValue[8] = 'L';
-            xbee_at_command.parameterValue[9] = '_';
-            xbee_at_command.parameterValue[10] = 'A';
-            xbee_at_command.parameterValue[11] = 'I';
-            xbee_at_command.parameterValue[12] = 'R';
-            xbee_at_command.parameterValue[13] = '1';
-            xbee_at_command.parameterValue[14] = '2';
-            xbee_at_command.parameterValue[15] = '3';
-            xbee_at_command.varLen = 16;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            // free the slot first, the callback may well queue another command
+            callback = FUNCXBeeATQueue[FUNCXBeeATPop].callback;
+            FUNCXBeeATFrameID = 0;
+            FUNCXBeeATPop = (FUNCXBeeATPop + 1) % XBEE_AT_QUEUE;
+            FUNCXBeeATState = 0;
+            __enable_irq();
+            if(callback) callback(status, data, length);
+        }
+        
+        void XBeeATPoll(void) {
+            unsigned int i;
             
-            // AC to apply
-            xbee_at_command.ATCommand1 = 'A';
-            xbee_at_command.ATCommand2 = 'C';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            if(FUNCXBeeATState == 0) {
+                if(FUNCXBeeATPush == FUNCXBeeATPop) return;
+                FUNCXBeeATTimer = (FUNCXBeeATQueue[FUNCXBeeATPop].delay * 1000) / SYSTICK_US;
+                FUNCXBeeATState = 1;
+            }
             
-            while(1) {
-                Delay(100);
-                
-                // AI0 to get association information
+            if(FUNCXBeeATState == 1 && FUNCXBeeATTimer == 0) {
                 xbee_at_command.frameID = Random() | 0x1;
-                xbee_at_command.ATCommand1 = 'A';
-                xbee_at_command.ATCommand2 = 'I';
-                xbee_at_command.varLen = 0;
-                //if(!XBeeSendATCommand()) XBeeCommFail();
-                if(!XBeeSendATCommand()) Delay(1000);
-                if(xbee_at_response.commandData[0] == 0) break;
+                xbee_at_command.ATCommand1 = FUNCXBeeATQueue[FUNCXBeeATPop].ATCommand1;
+                xbee_at_command.ATCommand2 = FUNCXBeeATQueue[FUNCXBeeATPop].ATCommand2;
+                for(i=0; i<FUNCXBeeATQueue[FUNCXBeeATPop].varLen; i++) {
+                    xbee_at_command.parameterValue[i] = FUNCXBeeATQueue[FUNCXBeeATPop].parameterValue[i];
+                }
+                xbee_at_command.varLen = FUNCXBeeATQueue[FUNCXBeeATPop].varLen;
+                
+                FUNCXBeeATFrameID = xbee_at_command.frameID;
+                FUNCXBeeATTimer = (XBEE_AT_TIMEOUT * 1000) / SYSTICK_US;
+                FUNCXBeeATState = 2;
+                XBeeSendFrame(ID_XBEE_ATCOMMAND, (unsigned char *)&xbee_at_command, sizeof(xbee_at_command)-2-16+xbee_at_command.varLen);
             }
-            
-            // WR to write changes
-            xbee_at_command.ATCommand1 = 'W';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            else if(FUNCXBeeATState == 2 && FUNCXBeeATTimer == 0) {
+                FUNCXBeeATComplete(FUNCXBeeATFrameID, 0xff, 0, 0);
+            }
+        }
+        
+        unsigned char XBeeATResponse(unsigned char * buffer, unsigned short length) {
+            // buffer is the AT response frame data: frame ID, AT command (2 bytes), status, then any data
+            if(FUNCXBeeATState != 2 || length < 4 || buffer[0] != FUNCXBeeATFrameID) return 0;
+            FUNCXBeeATComplete(buffer[0], buffer[3], buffer + 4, length - 4);
+            return 1;
+        }
+        
+        void XBeeATRequire(unsigned char status, unsigned char * data, unsigned short length) {
+            if(status != 0) XBeeCommFail();
         }
 
+        void XBeeAllowJoin() {
+            XBeeStopJoin();
+            XBeeQueueATByte('N', 'J', XBEE_JOINPERIOD, 0);
+        }
         
-        void XBeeCoordinatorJoin() {
-            xbee_at_response.isNew = 0;
-            
-            // NR to network reset
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set Powerlevel
-            xbee_at_command.ATCommand1 = 'P';
-            xbee_at_command.ATCommand2 = 'L';
-            xbee_at_command.parameterValue[0] = XBEE_POWER_LEVEL;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set CE mode
-            xbee_at_command.ATCommand1 = 'C';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set PAN ID
-            xbee_at_command.ATCommand1 = 'I';
-            xbee_at_command.ATCommand2 = 'D';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // encryption enable
-            xbee_at_command.ATCommand1 = 'E';
-            xbee_at_command.ATCommand2 = 'E';
-            xbee_at_command.parameterValue[0] = 1;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-
-            // encryption options
-            xbee_at_command.ATCommand1 = 'E';
-            xbee_at_command.ATCommand2 = 'O';
-            xbee_at_command.parameterValue[0] = 0x02;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set network key to zero
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'K';
-            xbee_at_command.parameterValue[0] = 0;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
-            
-            // set link key
-            xbee_at_command.ATCommand1 = 'K';
-            xbee_at_command.ATCommand2 = 'Y';
-            xbee_at_command.parameterValue[0] = 'U';
-            xbee_at_command.parameterValue[1] = 'N';
-            xbee_at_command.parameterValue[2] = 'I';
-            xbee_at_command.parameterValue[3] = 'V';
-            xbee_at_command.parameterValue[4] = 'E';
-            xbee_at_command.parameterValue[5] = 'R';
-            xbee_at_command.parameterValue[6] = 'S';
-            xbee_at_command.parameterValue[7] = 'A';
-            xbee_at_command.parameterValue[8] = 'L';
-            xbee_at_command.parameterValue[9] = '_';
-            xbee_at_command.parameterValue[10] = 'A';
-            xbee_at_command.parameterValue[11] = 'I';
-            xbee_at_command.parameterValue[12] = 'R';
-            xbee_at_command.parameterValue[13] = '1';
-            xbee_at_command.parameterValue[14] = '2';
-            xbee_at_command.parameterValue[15] = '3';
-            xbee_at_command.varLen = 16;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+        void XBeeStopJoin() {
+            XBeeQueueATByte('N', 'J', 0x00, 0);
+        }
+
+        void FUNCXBeeJoinAssociated(unsigned char status, unsigned char * data, unsigned short length) {
+            if(status == 0 && length > 0 && data[0] == 0) {
+                // WR to write changes
+                XBeeQueueAT('W', 'R', 0, 0, 0, XBeeATRequire);
+            }
+            else {
+                // AI0 to get association information, not associated yet so keep asking
+                XBeeQueueAT('A', 'I', 0, 0, status ? 1100 : 100, FUNCXBeeJoinAssociated);
+            }
+        }
+        
+        unsigned char XBeeJoin() {
+            static const unsigned char key[16] = {'U','N','I','V','E','R','S','A','L','_','A','I','R','1','2','3'};
+            unsigned char ok = 1;
             
-            // set NJ
-            xbee_at_command.ATCommand1 = 'N';
-            xbee_at_command.ATCommand2 = 'J';
-            xbee_at_command.parameterValue[0] = 0x00;
-            xbee_at_command.varLen = 1;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            // all or nothing, a sequence cut short leaves the radio half set up
+            if(XBeeATFree() < 11) return 0;
             
-            // WR to write changes
-            xbee_at_command.ATCommand1 = 'W';
-            xbee_at_command.ATCommand2 = 'R';
-            xbee_at_command.varLen = 0;
-            if(!XBeeSendATCommand()) XBeeCommFail();
+            ok &= XBeeQueueAT('N', 'R', 0, 0, 0, XBeeATRequire);   // NR to network reset
+            ok &= XBeeQueueATByte('N', 'J', 0x00, 0);             // NJ0 to prevent others joining
+            ok &= XBeeQueueATByte('P', 'L', XBEE_POWER_LEVEL, XBeeATRequire);   // PL# to set power level
+            ok &= XBeeQueueATByte('J', 'N', 1, XBeeATRequire);    // JN1 to enable join notification
+            ok &= XBeeQueueATByte('C', 'E', 0, XBeeATRequire);    // CE0 to disable coordinator mode
+            ok &= XBeeQueueATByte('I', 'D', 0, XBeeATRequire);    // ID0 to set PAN ID to 0 (autofind network)
+            ok &= XBeeQueueATByte('E', 'E', 1, XBeeATRequire);    // EE1 for encryption enable
+            ok &= XBeeQueueAT('K', 'Y', key, 16, 0, XBeeATRequire); // KY### to set link key
+            ok &= XBeeQueueAT('A', 'C', 0, 0, 0, XBeeATRequire);   // AC to apply
+            ok &= XBeeQueueAT('A', 'I', 0, 0, 100, FUNCXBeeJoinAssociated);
+            return ok;
+        }
+
+        void FUNCXBeeCoordinatorFormed(unsigned char status, unsigned char * data, unsigned short length) {
+            if(status == 0) XBeeAllowJoin();
+            else XBeeQueueAT('A', 'I', 0, 0, 100, FUNCXBeeCoordinatorFormed); // AI to get association information
+        }
+        
+        unsigned char XBeeCoordinatorJoin() {
+            static const unsigned char key[16] = {'U','N','I','V','E','R','S','A','L','_','A','I','R','1','2','3'};
+            unsigned char ok = 1;
             
-            while(1) {
-                Delay(100);
-                
-                // AI0 to get association information
-                xbee_at_command.frameID = Random() | 0x1;
-                xbee_at_command.ATCommand1 = 'A';
-                xbee_at_command.ATCommand2 = 'I';
-                xbee_at_command.varLen = 0;
-                if(XBeeSendATCommand()) break;
-            }
+            // all or nothing, a sequence cut short leaves the radio half set up and never gets to allow joins
+            if(XBeeATFree() < 11) return 0;
             
-            XBeeAllowJoin();
+            ok &= XBeeQueueAT('N', 'R', 0, 0, 0, XBeeATRequire);   // NR to network reset
+            ok &= XBeeQueueATByte('P', 'L', XBEE_POWER_LEVEL, XBeeATRequire);   // set Powerlevel
+            ok &= XBeeQueueATByte('C', 'E', 1, XBeeATRequire);    // set CE mode
+            ok &= XBeeQueueATByte('I', 'D', 0, XBeeATRequire);    // set PAN ID
+            ok &= XBeeQueueATByte('E', 'E', 1, XBeeATRequire);    // encryption enable
+            ok &= XBeeQueueATByte('E', 'O', 0x02, XBeeATRequire); // encryption options
+            ok &= XBeeQueueATByte('N', 'K', 0, XBeeATRequire);    // set network key to zero
+            ok &= XBeeQueueAT('K', 'Y', key, 16, 0, XBeeATRequire); // set link key
+            ok &= XBeeQueueATByte('N', 'J', 0x00, XBeeATRequire); // set NJ
+            ok &= XBeeQueueAT('W', 'R', 0, 0, 0, XBeeATRequire);   // WR to write changes
+            ok &= XBeeQueueAT('A', 'I', 0, 0, 100, FUNCXBeeCoordinatorFormed);
+            return ok;
         }
 
         void XBeeSendFrame(unsigned char id, unsigned char * buffer, unsigned short length) {
@@ -4970,6 +5023,11 @@ unsigned char PRGPoll(void) {
 
         void XBeeInit(void) {
             FUNCXBeeState = 0;
+            FUNCXBeeRingPush = 0;
+            FUNCXBeeRingPop = 0;
+            FUNCXBeeFramePush = 0;
+            FUNCXBeeFramePop = 0;
+            FUNCXBeeProcessing = 0;
             UARTInit(115200);
             FUNCXBeetBufCount = 0;
             
@@ -4985,7 +5043,7 @@ unsigned char PRGPoll(void) {
             // Start timeout and wait to see if XBee is already configured (should receive modem_status API frame)
             FUNCTimeout = 1000;
             xbee_modem_status.isNew = 0;
-            while(FUNCTimeout > 0 && xbee_modem_status.isNew == 0);
+            while(FUNCTimeout > 0 && xbee_modem_status.isNew == 0) XBeeProcess();
             
             if(xbee_modem_status.isNew == 0) {
                 XBeeSetDefaults();
@@ -4993,51 +5051,90 @@ unsigned char PRGPoll(void) {
         }
         
         
+        void XBeeProcess(void) {
+            // Hand complete frames to XBeeMessage, outside of the interrupt.  Frames are released in order once
+            // XBeeMessage returns, so the buffer it's given is only valid until then
+            unsigned char frame;
+            unsigned short offset, length;
+            
+            if(FUNCXBeeProcessing) return; // already running lower down (e.g. waiting for an AT response), leave it to that
+            FUNCXBeeProcessing = 1;
+            
+            while(FUNCXBeeFramePop != FUNCXBeeFramePush) {
+                frame = FUNCXBeeFramePop;
+                offset = FUNCXBeeFrameOffset[frame];
+                length = FUNCXBeeFrameLength[frame];
+                
+                if(FUNCXBeeRing[offset] != ID_XBEE_ATRESPONSE || XBeeATResponse(&FUNCXBeeRing[offset+1], length-1) == 0) {
+                    if(XBeeMessage) XBeeMessage(FUNCXBeeRing[offset], &FUNCXBeeRing[offset+1], length-1);
+                }
+                
+                FUNCXBeeRingPop = offset + length;
+                FUNCXBeeFramePop = (frame + 1) % XBEE_FRAME_COUNT;
+            }
+            
+            XBeeATPoll();
+            
+            FUNCXBeeProcessing = 0;
+        }
+        
         void UARTInterrupt(unsigned char byte) {
-            // insert into buffer
-            if(FUNCXBeetBufCount < TBUF_LEN) FUNCXBeetBuf[FUNCXBeetBufCount++] = byte;
+            unsigned short pop;
             
             switch(FUNCXBeeState) {
                 default: // fall through to 0
                 case 0: // find start character 0x7e
                     if(byte == 0x7e) FUNCXBeeState++;
+                    else if(FUNCXBeetBufCount < TBUF_LEN) FUNCXBeetBuf[FUNCXBeetBufCount++] = byte; // AT command mode replies
                     break;
                 case 1: // length MSB
                     FUNCXBeeLength = byte << 8;
                     FUNCXBeeState++;
                     break;
-                case 2: // length LSB
+                case 2: // length LSB, length value includes ID
                     FUNCXBeeLength |= byte;
-                    if(FUNCXBeeLength > 1) FUNCXBeeState++;
-                    else FUNCXBeeState = 0;
                     FUNCXBeePacket = 0;
                     FUNCXBeeChecksum = 0;
-                    break;
-                case 3: // cmd frame
-                    FUNCXBeeID = byte;
-                    FUNCXBeeLength--; // length value includes ID, we need length in terms of payload size
-                    FUNCXBeeState++;
-                    FUNCXBeeChecksum += byte;
-                    break;
-                case 4: // cmd data
-                    if(FUNCXBeePacket < XBEE_BUFFER_SIZE) {
-                        FUNCXBeeBuffer[FUNCXBeePacket] = byte;
+                    if(FUNCXBeeLength < 2 || FUNCXBeeLength > XBEE_BUFFER_SIZE) {
+                        FUNCXBeeState = 0;
+                        break;
                     }
-                    FUNCXBeePacket++;
                     
-                    if(FUNCXBeePacket >= FUNCXBeeLength) FUNCXBeeState++;
+                    // find room for the whole frame in one piece, going back to the start if it won't fit on the end
+                    pop = FUNCXBeeRingPop;
+                    FUNCXBeeState = 5;
+                    if(FUNCXBeeRingPush >= pop) {
+                        if(FUNCXBeeRingPush + FUNCXBeeLength < XBEE_RING_SIZE) FUNCXBeeState = 3;
+                        else if(FUNCXBeeLength < pop) {
+                            FUNCXBeeRingPush = 0;
+                            FUNCXBeeState = 3;
+                        }
+                    }
+                    else if(FUNCXBeeRingPush + FUNCXBeeLength < pop) FUNCXBeeState = 3;
+                    
+                    if((FUNCXBeeFramePush + 1) % XBEE_FRAME_COUNT == FUNCXBeeFramePop) FUNCXBeeState = 5;
                     
+                    if(FUNCXBeeState == 3) FUNCXBeeFrameStart = FUNCXBeeRingPush;
+                    else FUNCXBeeDrops++;
+                    break;
+                case 3: // ID and data
+                    FUNCXBeeRing[FUNCXBeeFrameStart + FUNCXBeePacket++] = byte;
                     FUNCXBeeChecksum += byte;
+                    if(FUNCXBeePacket >= FUNCXBeeLength) FUNCXBeeState++;
                     break;
-                case 5: // checksum
+                case 4: // checksum
                     if(0xff - FUNCXBeeChecksum == byte) {
-                        if(XBeeMessage) XBeeMessage(FUNCXBeeID, FUNCXBeeBuffer, FUNCXBeeLength);
-                    }
-                    else {
+                        FUNCXBeeFrameOffset[FUNCXBeeFramePush] = FUNCXBeeFrameStart;
+                        FUNCXBeeFrameLength[FUNCXBeeFramePush] = FUNCXBeeLength;
+                        FUNCXBeeRingPush = FUNCXBeeFrameStart + FUNCXBeeLength;
+                        FUNCXBeeFramePush = (FUNCXBeeFramePush + 1) % XBEE_FRAME_COUNT; // publish once it's all in
                     }
                     FUNCXBeeState = 0;
                     break;
-                case 0xff: // bypass mode
+                case 5: // no room, skip the frame and its checksum
+                    if(++FUNCXBeePacket > FUNCXBeeLength) FUNCXBeeState = 0;
+                    break;
+                case 0xff: // bypass mode, bytes go straight through so the RTS level is kept up to date
                     if(XBeeMessage) XBeeMessage(0, &byte, 1);
                     break;
             }
@@ -481,6 +481,7 @@ extern WEAK void Port3Pin3Interrupt(void);
         unsigned short UARTBufferReadable(void);
         unsigned char UARTBufferPop(void);
         void UARTBufferPush(unsigned char data);
+        void UARTBufferWait(void);
     #endif
 #endif 
 
@@ -840,7 +841,9 @@ extern unsigned char CDC_ConfigDescriptor[];
 void CDCInit(unsigned char bridge);
 
 void CDCReadByte(unsigned char byte);
+unsigned int CDCReadReady(void);
 void CDCWriteByte(unsigned char byte);
+unsigned short CDCWritable(void);
 void CDCWrite(unsigned char * byte, unsigned int length);
 
 struct VCOM_DATA;
@@ -870,6 +873,7 @@ void VCOM_uart_send(VCOM_DATA_T* pVcom);
 void VCOM_virtual_send(VCOM_DATA_T* pVcom);
 ErrorCode_t VCOM_SetLineCode (USBD_HANDLE_T hCDC, CDC_LINE_CODING* line_coding);
 ErrorCode_t VCOM_sof_event(USBD_HANDLE_T hUsb);
+ErrorCode_t VCOM_reset_event(USBD_HANDLE_T hUsb);
 ErrorCode_t VCOM_SendBreak (USBD_HANDLE_T hCDC, uint16_t mstime);
 ErrorCode_t VCOM_bulk_in_hdlr(USBD_HANDLE_T hUsb, void* data, uint32_t event) ;
 ErrorCode_t VCOM_bulk_out_hdlr(USBD_HANDLE_T hUsb, void* data, uint32_t event) ;
@@ -1437,6 +1441,17 @@ static inline void RSTReset(void) { ResetInit(); }
             unsigned short varLen;
         } PACKED xbee_node_identification_indicator_t;
         
+        typedef void (*XBeeATCallback_t)(unsigned char status, unsigned char * data, unsigned short length);
+        
+        typedef struct xbee_at_queued_struct {
+            unsigned char ATCommand1;
+            unsigned char ATCommand2;
+            unsigned char parameterValue[16];
+            unsigned char varLen;
+            unsigned short delay;           // ms to wait before sending
+            XBeeATCallback_t callback;
+        } xbee_at_queued_t;
+        
         extern xbee_modem_status_t xbee_modem_status;
         extern xbee_at_command_t xbee_at_command;
         extern xbee_at_response_t xbee_at_response;
@@ -1450,9 +1465,12 @@ static inline void RSTReset(void) { ResetInit(); }
         unsigned int XBeetBufCompare(unsigned char * compare, unsigned int length);
         
         extern volatile unsigned int FUNCXBeeState;
-        extern volatile unsigned short FUNCXBeeLength, FUNCXBeeID, FUNCXBeePacket;
+        extern volatile unsigned short FUNCXBeeLength, FUNCXBeePacket;
         extern volatile unsigned char FUNCXBeeChecksum;
-        extern unsigned char FUNCXBeeBuffer[XBEE_BUFFER_SIZE];
+        extern unsigned char FUNCXBeeRing[XBEE_RING_SIZE];
+        extern volatile unsigned short FUNCXBeeRingPush, FUNCXBeeRingPop;
+        extern volatile unsigned int FUNCXBeeDrops;
+        void XBeeProcess(void);
     
         extern WEAK void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length);
         void XBeeInit(void);
@@ -1460,13 +1478,22 @@ static inline void RSTReset(void) { ResetInit(); }
         void XBeeCommFail(void);
         void XBeeSetDefaults(void);
         void XBeeFactoryReset(void);
-        void XBeeCoordinatorJoin(void);
+        unsigned char XBeeCoordinatorJoin(void);
         void XBeeAllowJoin(void);
         void XBeeStopJoin(void);
-        void XBeeJoin(void);
+        unsigned char XBeeJoin(void);
         void XBeeSendFrame(unsigned char id, unsigned char * buffer, unsigned short length);
         unsigned char XBeeSendATCommand(void);
+        unsigned char XBeeQueueAT(unsigned char ATCommand1, unsigned char ATCommand2, const unsigned char * parameter, unsigned char length, unsigned short delay, XBeeATCallback_t callback);
+        unsigned char XBeeQueueATByte(unsigned char ATCommand1, unsigned char ATCommand2, unsigned char value, XBeeATCallback_t callback);
+        unsigned char XBeeATBusy(void);
+        unsigned char XBeeATFree(void);
+        void XBeeATPoll(void);
+        unsigned char XBeeATResponse(unsigned char * buffer, unsigned short length);
+        void XBeeATRequire(unsigned char status, unsigned char * data, unsigned short length);
+        extern volatile unsigned short FUNCXBeeATTimer;
         unsigned char XBeeSendPacket(void);
+        unsigned char XBeeSendRequest(xbee_transmit_request_t * request);
         unsigned char XBeeWriteBroadcast(unsigned char * buffer, unsigned short length);
         unsigned char XBeeWriteCoordinator(unsigned char * buffer, unsigned short length);
         
@@ -98,6 +98,8 @@
 #define MSC_BLOCK_SIZE      512         // The block size (bytes) of the MSC device
 
 #define CDC_USE_PLED        0           // Use PLED as a flashing status indicator
+#define CDC_BUFFER_SIZE     256         // Size of the CDC transmit buffer in virtual mode, must be a power of two
+#define CDC_LATENCY         2           // Frames (ms) a part-filled USB packet is held back to collect more data
 
 #define USB_PRIORITY        2           // USB interrupt priority
 
@@ -117,8 +119,8 @@
 #define UART_USE_FBR        1           // Set to 1 to use pre-defined fractional baud rates
 #define UART_PRIORITY       2           // UART interrupt priority
 
-#define UART_USE_OUTBUFFER  0           // Set to 1 to enable UART output buffer
-#define UART_BUFFER_SIZE    128          // Size of the UART output buffer
+#define UART_USE_OUTBUFFER  1           // Set to 1 to enable UART output buffer
+#define UART_BUFFER_SIZE    512          // Size of the UART output buffer
 
 // ****************************************************************************
 // *** I2C Config
@@ -289,8 +291,14 @@
     #define XBEE_EN             1           // Set to 1 to enable the XBee code
 
     #define XBEE_POWER_LEVEL    0           // Set transmit power: 4=18dBm/63mW, 3=16dBm/40mW, 2=14dBm/25mW, 1=12dBm/16mW, 0=0dBm/1mW
-    #define XBEE_BUFFER_SIZE    128         // XBee buffer size
+    #define XBEE_BUFFER_SIZE    128         // Largest XBee frame accepted (ID and data)
+    #define XBEE_RING_SIZE      512         // XBee receive ring, frames wait in here until XBeeProcess() is called
+    #define XBEE_FRAME_COUNT    16          // Number of received frames that can be waiting
     #define XBEE_JOINPERIOD     60          // Number of seconds to allow bind
+    #define XBEE_AT_QUEUE       24          // Number of AT commands that can be queued up
+    #define XBEE_AT_TIMEOUT     1000        // ms to wait for an AT command response
+    #define XBEE_TX_ACK         1           // Set to 1 to have transmits acknowledged and retried, the transmit status is then used for the link statistics
+    #define MAVLINK_CRC_TABLE   1           // Set to 1 to use a lookup table in flash for MAVLink checksums (512 bytes, one lookup per byte instead of shifts)
 #endif
 
 
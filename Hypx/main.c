@@ -1,4 +1,5 @@
 #include "thal.h"
+#include "mavlink.h"
 
 // Buttons and LED stuff
 volatile unsigned int PRGTimer;
@@ -21,35 +22,125 @@ xbee_node_identification_indicator_t xbee_node_identification_indicator;
 
 #define ADDRESSLIST_SIZE    20
 #define STRIKE_COUNT_MAX    100
+#define BROADCAST_MIN_NODES 2       // Uplink is sent as one broadcast once this many nodes are in the list, rather than a unicast to each
+#define NP_RETRY_DELAY      1000        // ms to wait before asking for NP again if the XBee didn't answer
 unsigned short networkAddressList[ADDRESSLIST_SIZE];
 unsigned long long sourceAddressList[ADDRESSLIST_SIZE];
 unsigned char strikeAddressList[ADDRESSLIST_SIZE];
+unsigned char systemAddressList[ADDRESSLIST_SIZE];  // MAVLink system ID seen from each node, 0 if not known yet
 unsigned int addressListCount;
 
+// Link statistics, one per entry in the address list.  These are sent to the GCS as NAMED_VALUE_INTs from each node's
+// system ID with the RADIO_COMP_ID component, so they show up against the vehicle they belong to.
+#define RADIO_COMP_ID       MAV_COMP_ID_UART_BRIDGE
+#define RADIO_STATS_PERIOD  1000        // ms between link statistics reports
+#define RADIO_RSSI_PERIOD   250         // ms between DB (RSSI of last received packet) queries
+#define RETRY_BUCKETS       4           // retry histogram has 0, 1, 2 and 3+ retries
+#define RADIO_STATS_ITEMS   11          // number of values in each node's report
+#define TRUNCATE_PERIOD     1000        // ms between TRUNCATE announcements, Hypo goes back to full payloads if these stop
+#define TRUNCATE_SYSTEM_ID  255         // announcements are sent as coming from the ground side of the link
+
+typedef struct {
+    unsigned int txBytes;
+    unsigned int txPackets;
+    unsigned int rxBytes;
+    unsigned int rxPackets;
+    unsigned int failures;
+    unsigned int retries[RETRY_BUCKETS];
+    unsigned int lastSeen;      // sysMS of the last packet from this node
+    unsigned char rssi;         // -dBm, 0 if not known yet
+} nodeStats_t;
+
+nodeStats_t nodeStats[ADDRESSLIST_SIZE];
+unsigned int radioStatsTimer;
+unsigned int radioStatsNode;                // node being reported, ADDRESSLIST_SIZE when idle
+unsigned int radioStatsItem;
+unsigned int radioStatsMS;
+unsigned int radioRSSITimer;
+volatile unsigned int radioLastNode;        // node the most recent packet came from, ADDRESSLIST_SIZE if nothing new
+volatile unsigned int radioRSSINode;        // node the outstanding DB query is for
+volatile unsigned char radioRSSIPending;    // a DB query is queued or waiting for its response
+unsigned char radioNPWanted;                // NP has to be asked for, loop() keeps trying until the query is queued
+volatile unsigned char radioNPPending;      // an NP query is queued or waiting for its response
+unsigned char radioSeq;
+unsigned int broadcastMaxLength;            // NP, the most a broadcast can carry (they aren't fragmented), 0 until the XBee says
+
+// *** Payload truncation stuff
+// Hypo leaves the trailing zeros off its payloads while we keep announcing that we'll put them back, its checksum covers the
+// full payload so the zero-filled packet that goes out of the CDC is standard MAVLink.
+const unsigned char mavlinkLengths[256] = MAVLINK_MESSAGE_LENGTHS;
+const unsigned char mavlinkCRCExtra[256] = MAVLINK_MESSAGE_CRCS;
+xbee_transmit_request_t truncateRequest;
+unsigned int truncateTimer;
+
 void StrikeNetworkAddress(unsigned short networkAddress);
-void AddNetworkAddress(unsigned short networkAddress, unsigned long long sourceAddress);
-void SendToList(unsigned char * buffer, unsigned int length);
+unsigned int AddNetworkAddress(unsigned short networkAddress, unsigned long long sourceAddress, unsigned char systemID);
+unsigned int FindSystem(unsigned char systemID);
+unsigned int FindNetworkAddress(unsigned short networkAddress);
+void RadioSendStats(void);
+void RadioRequestRSSI(void);
+void RadioRSSIResponse(unsigned char status, unsigned char * data, unsigned short length);
+void RadioRequestNP(void);
+void RadioQueueNP(unsigned short delay);
+void RadioNPResponse(unsigned char status, unsigned char * data, unsigned short length);
+void RadioSendInt(unsigned char systemID, char * name, int value);
+unsigned int RadioPackInt(unsigned char * frame, unsigned char systemID, char * name, int value);
+void RadioAnnounceTruncate(void);
+void RadioExpand(unsigned char * packet, unsigned int length);
+void SendToList(xbee_transmit_request_t * request, unsigned int length);
+void SendToNode(xbee_transmit_request_t * request, unsigned int index);
+void SendBroadcast(xbee_transmit_request_t * request);
+void SendToSystem(xbee_transmit_request_t * request, unsigned int length, unsigned char systemID);
+unsigned char MAVTargetSystem(unsigned char * packet);
 
-void AddNetworkAddress(unsigned short networkAddress, unsigned long long sourceAddress) {
-    unsigned int i, found;
-    found = 0;
+unsigned int AddNetworkAddress(unsigned short networkAddress, unsigned long long sourceAddress, unsigned char systemID) {
+    unsigned int i, j;
     for(i=0; i<addressListCount; i++) {
         if(sourceAddressList[i] == sourceAddress) {
             networkAddressList[i] = networkAddress;
             strikeAddressList[i] = 0;
-            found = 1;
-            break;
+            if(systemID) systemAddressList[i] = systemID;
+            nodeStats[i].lastSeen = sysMS;
+            return i;
         }
     }
     
-    if(found == 0) {
-        if(addressListCount < ADDRESSLIST_SIZE) {
-            networkAddressList[addressListCount] = networkAddress;
-            sourceAddressList[addressListCount] = sourceAddress;
-            strikeAddressList[addressListCount] = 0;
-            addressListCount++;
-        }
+    if(addressListCount < ADDRESSLIST_SIZE) {
+        i = addressListCount;
+        networkAddressList[i] = networkAddress;
+        sourceAddressList[i] = sourceAddress;
+        strikeAddressList[i] = 0;
+        systemAddressList[i] = systemID;
+        
+        nodeStats[i].txBytes = 0;
+        nodeStats[i].txPackets = 0;
+        nodeStats[i].rxBytes = 0;
+        nodeStats[i].rxPackets = 0;
+        nodeStats[i].failures = 0;
+        for(j=0; j<RETRY_BUCKETS; j++) nodeStats[i].retries[j] = 0;
+        nodeStats[i].lastSeen = sysMS;
+        nodeStats[i].rssi = 0;
+        
+        addressListCount++;
+        return i;
+    }
+    return ADDRESSLIST_SIZE; // list full
+}
+
+unsigned int FindNetworkAddress(unsigned short networkAddress) {
+    unsigned int i;
+    for(i=0; i<addressListCount; i++) {
+        if(networkAddressList[i] == networkAddress) return i;
+    }
+    return ADDRESSLIST_SIZE;
+}
+
+unsigned int FindSystem(unsigned char systemID) {
+    unsigned int i;
+    for(i=0; i<addressListCount; i++) {
+        if(systemAddressList[i] == systemID) return i;
     }
+    return ADDRESSLIST_SIZE; // nobody has claimed this system ID
 }
 
 void StrikeNetworkAddress(unsigned short networkAddress) {
@@ -65,6 +156,8 @@ void StrikeNetworkAddress(unsigned short networkAddress) {
                     networkAddressList[i] = networkAddressList[addressListCount-1];
                     sourceAddressList[i] = sourceAddressList[addressListCount-1];
                     strikeAddressList[i] = strikeAddressList[addressListCount-1];
+                    systemAddressList[i] = systemAddressList[addressListCount-1];
+                    nodeStats[i] = nodeStats[addressListCount-1];
                 }
                 
                 if(addressListCount > 0) addressListCount--;
@@ -74,27 +167,337 @@ void StrikeNetworkAddress(unsigned short networkAddress) {
     }
 }
 
-void SendToList(unsigned char * buffer, unsigned int length) {
+// The uplink data is already sitting in the request's RFData (CDCReadByte puts it there), so these only fill in the
+// addressing.  With several nodes a single broadcast reaches all of them for the UART and air time of one frame, but
+// broadcasts aren't fragmented, so anything longer than NP (or before NP is known) goes to each node in turn.
+void SendToList(xbee_transmit_request_t * request, unsigned int length) {
     unsigned int i;
-    for(i=0; i<length; i++) {
-        xbee_transmit_request.RFData[i] = buffer[i];
+    request->varLen = length;
+    
+    if(addressListCount >= BROADCAST_MIN_NODES && length <= broadcastMaxLength) {
+        SendBroadcast(request);
     }
-    xbee_transmit_request.varLen = length;
-   
+    else {
+        for(i=0; i<addressListCount; i++) {
+            SendToNode(request, i);
+        }
+    }
+}
+
+void SendToNode(xbee_transmit_request_t * request, unsigned int index) {
+    request->networkAddress = networkAddressList[index];
+    request->destinationAddress = sourceAddressList[index]; // (big-endian)
+    XBeeSendRequest(request);
+    
+    nodeStats[index].txBytes += request->varLen;
+    nodeStats[index].txPackets++;
+}
+
+void SendBroadcast(xbee_transmit_request_t * request) {
+    unsigned int i;
+    request->networkAddress = 0xfeff;
+    request->destinationAddress = 0xffff000000000000ULL; //broadcast (big-endian)
+    XBeeSendRequest(request);
+    
+    // everyone gets a copy
     for(i=0; i<addressListCount; i++) {
-        xbee_transmit_request.networkAddress = networkAddressList[i];
-        xbee_transmit_request.destinationAddress = sourceAddressList[i]; //broadcast (big-endian)
-        XBeeSendPacket();
+        nodeStats[i].txBytes += request->varLen;
+        nodeStats[i].txPackets++;
+    }
+}
+
+// Targeted data goes only to the node that the system ID was heard from, anything else (untargeted, or a system we
+// haven't heard from yet) goes to everyone
+void SendToSystem(xbee_transmit_request_t * request, unsigned int length, unsigned char systemID) {
+    unsigned int i;
+    if(systemID) {
+        i = FindSystem(systemID);
+        if(i < ADDRESSLIST_SIZE) {
+            request->varLen = length;
+            SendToNode(request, i);
+            return;
+        }
+    }
+    SendToList(request, length);
+}
+
+// MAVLink 1.0 has no common target field, so this looks up where target_system sits in the payload of the messages
+// that have one.  Returns 0 (all systems) for anything else.
+unsigned char MAVTargetSystem(unsigned char * packet) {
+    unsigned char offset;
+    switch(packet[5]) {
+        case MAVLINK_MSG_ID_CHANGE_OPERATOR_CONTROL:
+        case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+        case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
+        case MAVLINK_MSG_ID_MISSION_CLEAR_ALL:
+        case MAVLINK_MSG_ID_MISSION_ACK:
+            offset = 0; break;
+        case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+        case MAVLINK_MSG_ID_MISSION_REQUEST:
+        case MAVLINK_MSG_ID_MISSION_SET_CURRENT:
+        case MAVLINK_MSG_ID_MISSION_COUNT:
+        case MAVLINK_MSG_ID_REQUEST_DATA_STREAM:
+            offset = 2; break;
+        case MAVLINK_MSG_ID_SET_MODE:
+        case MAVLINK_MSG_ID_PARAM_SET:
+        case MAVLINK_MSG_ID_MISSION_REQUEST_PARTIAL_LIST:
+        case MAVLINK_MSG_ID_MISSION_WRITE_PARTIAL_LIST:
+            offset = 4; break;
+        case MAVLINK_MSG_ID_SET_QUAD_MOTORS_SETPOINT:
+            offset = 8; break;
+        case MAVLINK_MSG_ID_PING:
+        case MAVLINK_MSG_ID_SET_GPS_GLOBAL_ORIGIN:
+            offset = 12; break;
+        case MAVLINK_MSG_ID_SET_LOCAL_POSITION_SETPOINT:
+        case MAVLINK_MSG_ID_SET_ROLL_PITCH_YAW_THRUST:
+        case MAVLINK_MSG_ID_SET_ROLL_PITCH_YAW_SPEED_THRUST:
+        case MAVLINK_MSG_ID_MANUAL_CONTROL:
+        case MAVLINK_MSG_ID_RC_CHANNELS_OVERRIDE:
+            offset = 16; break;
+        case MAVLINK_MSG_ID_SAFETY_SET_ALLOWED_AREA:
+            offset = 24; break;
+        case MAVLINK_MSG_ID_COMMAND_LONG:
+            offset = 30; break;
+        case MAVLINK_MSG_ID_MISSION_ITEM:
+            offset = 32; break;
+        default:
+            return 0;
+    }
+    if(offset >= packet[1]) return 0;
+    return packet[MAVLINK_NUM_HEADER_BYTES + offset];
+}
+
+
+// Writes a NAMED_VALUE_INT into the CDC stream
+void RadioSendInt(unsigned char systemID, char * name, int value) {
+    unsigned char frame[MAVLINK_MSG_ID_NAMED_VALUE_INT_LEN + MAVLINK_NUM_NON_PAYLOAD_BYTES];
+    
+    CDCWrite(frame, RadioPackInt(frame, systemID, name, value));
+}
+
+// Serialises a NAMED_VALUE_INT from the radio component into frame, returns the length of the packet
+unsigned int RadioPackInt(unsigned char * frame, unsigned char systemID, char * name, int value) {
+    mavlink_named_value_int_t packet;
+    unsigned char * payload = (unsigned char *)&packet;
+    unsigned short checksum;
+    unsigned int i;
+    
+    packet.time_boot_ms = sysMS;
+    packet.value = value;
+    for(i=0; i<MAVLINK_MSG_NAMED_VALUE_INT_FIELD_NAME_LEN; i++) {
+        packet.name[i] = name[i];
+        if(name[i] == '\0') break;
+    }
+    for(; i<MAVLINK_MSG_NAMED_VALUE_INT_FIELD_NAME_LEN; i++) packet.name[i] = 0;
+    
+    frame[0] = MAVLINK_STX;
+    frame[1] = MAVLINK_MSG_ID_NAMED_VALUE_INT_LEN;
+    frame[2] = radioSeq++;
+    frame[3] = systemID;
+    frame[4] = RADIO_COMP_ID;
+    frame[5] = MAVLINK_MSG_ID_NAMED_VALUE_INT;
+    
+    crc_init(&checksum);
+    for(i=1; i<MAVLINK_NUM_HEADER_BYTES; i++) {
+        crc_accumulate(frame[i], &checksum);
+    }
+    for(i=0; i<MAVLINK_MSG_ID_NAMED_VALUE_INT_LEN; i++) {
+        frame[MAVLINK_NUM_HEADER_BYTES + i] = payload[i];
+        crc_accumulate(payload[i], &checksum);
+    }
+    crc_accumulate(mavlinkCRCExtra[MAVLINK_MSG_ID_NAMED_VALUE_INT], &checksum);
+    frame[MAVLINK_NUM_HEADER_BYTES + i] = checksum & 0xff;
+    frame[MAVLINK_NUM_HEADER_BYTES + i + 1] = checksum >> 8;
+    
+    return MAVLINK_MSG_ID_NAMED_VALUE_INT_LEN + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+}
+
+// Tells every node that truncated payloads will be expanded
+void RadioAnnounceTruncate(void) {
+    if(addressListCount == 0) return;
+    SendToSystem(&truncateRequest, RadioPackInt(truncateRequest.RFData, TRUNCATE_SYSTEM_ID, "TRUNCATE", 1), 0);
+}
+
+// Passes a received packet on to the CDC, putting back the trailing zeros if Hypo left them off.  Only a single packet
+// whose length byte accounts for the whole frame and is short of its message's length is touched, anything else goes as-is.
+void RadioExpand(unsigned char * packet, unsigned int length) {
+    unsigned int len, i;
+    
+    if(length >= MAVLINK_NUM_NON_PAYLOAD_BYTES && packet[0] == MAVLINK_STX) {
+        len = packet[1];
+        if(len + MAVLINK_NUM_NON_PAYLOAD_BYTES == length && len < mavlinkLengths[packet[5]]) {
+            CDCWriteByte(MAVLINK_STX);
+            CDCWriteByte(mavlinkLengths[packet[5]]);
+            CDCWrite(packet + 2, len + MAVLINK_NUM_HEADER_BYTES - 2);
+            for(i=len; i<mavlinkLengths[packet[5]]; i++) CDCWriteByte(0);
+            CDCWrite(packet + MAVLINK_NUM_HEADER_BYTES + len, 2);
+            return;
+        }
+    }
+    CDCWrite(packet, length);
+}
+
+// Sends the next value of the current report, one per millisecond so that the USB endpoint isn't overrun
+void RadioSendStats(void) {
+    unsigned int i = radioStatsNode;
+    unsigned char systemID;
+    
+    if(i >= addressListCount || sysMS == radioStatsMS) return;
+    radioStatsMS = sysMS;
+    systemID = systemAddressList[i];
+    
+    if(systemID) { // otherwise can't attribute it to a vehicle yet
+        switch(radioStatsItem) {
+            case 0: RadioSendInt(systemID, "RADIO_TXB", nodeStats[i].txBytes); break;
+            case 1: RadioSendInt(systemID, "RADIO_TXP", nodeStats[i].txPackets); break;
+            case 2: RadioSendInt(systemID, "RADIO_RXB", nodeStats[i].rxBytes); break;
+            case 3: RadioSendInt(systemID, "RADIO_RXP", nodeStats[i].rxPackets); break;
+            case 4: RadioSendInt(systemID, "RADIO_FAIL", nodeStats[i].failures); break;
+            case 5: RadioSendInt(systemID, "RADIO_R0", nodeStats[i].retries[0]); break;
+            case 6: RadioSendInt(systemID, "RADIO_R1", nodeStats[i].retries[1]); break;
+            case 7: RadioSendInt(systemID, "RADIO_R2", nodeStats[i].retries[2]); break;
+            case 8: RadioSendInt(systemID, "RADIO_R3+", nodeStats[i].retries[3]); break;
+            case 9: RadioSendInt(systemID, "RADIO_AGE", sysMS - nodeStats[i].lastSeen); break;
+            case 10: RadioSendInt(systemID, "RADIO_RSSI", -(int)nodeStats[i].rssi); break;
+        }
+        radioStatsItem++;
+    }
+    
+    if(systemID == 0 || radioStatsItem >= RADIO_STATS_ITEMS) {
+        radioStatsItem = 0;
+        radioStatsNode++;
+    }
+}
+
+// DB gives the RSSI of the last packet received, so it's only asked for when something has just come in and the
+// answer is put against the node that sent it
+void RadioRequestRSSI(void) {
+    if(radioRSSIPending || radioLastNode >= ADDRESSLIST_SIZE) return;
+    
+    radioRSSINode = radioLastNode;
+    radioLastNode = ADDRESSLIST_SIZE;
+    radioRSSIPending = XBeeQueueAT('D', 'B', 0, 0, 0, RadioRSSIResponse);
+}
+
+// NP depends on the firmware and on the encryption settings, so it's asked for whenever the XBee has been set up
+void RadioRequestNP(void) {
+    broadcastMaxLength = 0;
+    radioNPWanted = 1;
+    RadioQueueNP(0);
+}
+
+// Only one NP query is out at a time, and one that can't be queued (the AT queue is full just after a join) is tried
+// again from loop()
+void RadioQueueNP(unsigned short delay) {
+    if(radioNPWanted == 0 || radioNPPending) return;
+    
+    radioNPPending = XBeeQueueAT('N', 'P', 0, 0, delay, RadioNPResponse);
+    if(radioNPPending) radioNPWanted = 0;
+}
+
+void RadioNPResponse(unsigned char status, unsigned char * data, unsigned short length) {
+    radioNPPending = 0;
+    if(radioNPWanted) {
+        // asked for again since this query was queued, so its answer may be from before the XBee was set up
+        RadioQueueNP(0);
+    }
+    else if(status == 0 && length >= 2) {
+        broadcastMaxLength = (data[0] << 8) | data[1]; // (big-endian)
+    }
+    else {
+        radioNPWanted = 1;
+        RadioQueueNP(NP_RETRY_DELAY);
     }
 }
 
+void RadioRSSIResponse(unsigned char status, unsigned char * data, unsigned short length) {
+    // status is 0xff if the query timed out
+    if(status == 0 && length > 0 && radioRSSINode < addressListCount) {
+        nodeStats[radioRSSINode].rssi = data[0];
+    }
+    radioRSSIPending = 0;
+}
 
 // CDC stuff
+// Incoming bytes are collected straight into the RFData of one of two transmit requests.  The USB interrupt fills one
+// while loop() sends the other, and a buffer is handed over as soon as it holds a complete MAVLink packet (or after
+// CDCTimeout for anything that isn't framed as MAVLink).
 #define CDCBUFSIZE 255
-unsigned char CDCBuf[CDCBUFSIZE];
-volatile unsigned int CDCCount;
+volatile unsigned int CDCCount;     // bytes in the buffer being filled
 volatile unsigned int CDCFlag;
 volatile unsigned int CDCTimeout;
+unsigned int CDCDrops;              // bytes lost because both buffers were full
+
+xbee_transmit_request_t CDCRequestB;
+xbee_transmit_request_t * CDCRequest[2] = {&xbee_transmit_request, &CDCRequestB};
+volatile unsigned int CDCFill;          // index of the buffer the USB interrupt is filling
+volatile unsigned int CDCReadyLength;   // length of the other buffer while it's waiting to be sent, 0 when it's free
+volatile unsigned char CDCReadyTarget;
+
+// The CDC input is framed as MAVLink so that each packet can be routed to its target system.  A buffer is only handed
+// over holding packets for one target, if a packet for a different target completes while the other buffer is still
+// busy, the whole buffer goes to everyone instead.
+volatile unsigned int CDCComplete;  // bytes of complete packets at the start of the buffer being filled
+unsigned int CDCPacketStart;        // where the packet being received starts in the buffer
+unsigned int CDCPacketPos;          // number of bytes of it received so far, 0 while waiting for a start byte
+unsigned int CDCPacketLen;          // its total length, header and checksum included
+volatile unsigned char CDCTarget;   // target system of the complete packets in the buffer, 0 for all systems
+
+unsigned int CDCHandOver(void);
+void CDCFrame(unsigned char byte);
+
+// Passes the complete packets over to be sent and carries on filling the other buffer, fails if that one is still busy
+unsigned int CDCHandOver(void) {
+    unsigned int i;
+    unsigned char * fill = CDCRequest[CDCFill]->RFData;
+    unsigned char * next = CDCRequest[1-CDCFill]->RFData;
+    
+    if(CDCReadyLength || CDCComplete == 0) return 0;
+    
+    // carry the start of the next packet over
+    for(i=CDCComplete; i<CDCCount; i++) {
+        next[i-CDCComplete] = fill[i];
+    }
+    
+    CDCReadyTarget = CDCTarget;
+    CDCReadyLength = CDCComplete;
+    CDCFill = 1-CDCFill;
+    
+    CDCCount -= CDCComplete;
+    if(CDCPacketPos) CDCPacketStart -= CDCComplete;
+    CDCComplete = 0;
+    CDCTarget = 0;
+    return 1;
+}
+
+void CDCFrame(unsigned char byte) {
+    unsigned char target;
+    
+    if(CDCPacketPos == 0) {
+        if(byte != MAVLINK_STX) return; // not framed, just goes along with whatever is around it
+        CDCPacketStart = CDCCount - 1;
+    }
+    CDCPacketPos++;
+    
+    if(CDCPacketPos == 2) {
+        CDCPacketLen = byte + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+    }
+    else if(CDCPacketPos > 2 && CDCPacketPos == CDCPacketLen) {
+        CDCPacketPos = 0;
+        target = MAVTargetSystem(&CDCRequest[CDCFill]->RFData[CDCPacketStart]);
+        
+        if(CDCComplete == 0) {
+            CDCTarget = target;
+        }
+        else if(target != CDCTarget) {
+            CDCComplete = CDCPacketStart;
+            if(CDCHandOver()) CDCTarget = target; // the packets ahead of this one are for someone else
+            else CDCTarget = 0;
+        }
+        CDCComplete = CDCCount;
+        CDCHandOver();
+    }
+}
 
 // Mode/EEPROM stuff
 #define EEPROM_SETTING_ADDR 0x261
@@ -103,21 +506,50 @@ volatile unsigned int CDCTimeout;
 
 unsigned int XBeeBypassMode;
 
+// Bypass stuff: USB to UART goes through the UART output buffer, with the host held off by CDCReadReady() when it
+// fills.  UART to USB is queued here by the XBee interrupt and moved to the CDC buffer by loop() as it has room, with
+// the XBee held off by RTS (PIN17), which it only looks at once D6 is set to 1.  Bypass waits for that to be done.
+#define BYPASS_BUFFER_SIZE  512         // UART to USB buffer, must be a power of two
+#define BYPASS_STOP_LEVEL   384         // Ask the XBee to hold off (RTS high) once this many bytes are waiting
+#define BYPASS_START_LEVEL  128         // and let it carry on once it has drained to this
+unsigned char bypassBuffer[BYPASS_BUFFER_SIZE];
+volatile unsigned short bypassPush, bypassPop;
+volatile unsigned char bypassStarting;  // 1 while D6 is waiting to be answered, 2 once it has been and loop() can start bypass
+unsigned int bypassDrops;               // bytes lost because bypassBuffer was full, the XBee didn't stop for RTS
+
+void BypassStart(void);
+void BypassD6Response(unsigned char status, unsigned char * data, unsigned short length);
+void BypassEnter(void);
+void BypassToCDC(void);
+void BypassClear(void);
+
 void setup () {
     LEDInit(PLED);
     LEDOn(PLED);
     flashVLED = 0;
     
     XBeeInit();
+    radioNPPending = 0;
+    RadioRequestNP();
     addressListCount = 0;
+    radioLastNode = ADDRESSLIST_SIZE;
+    radioRSSIPending = 0;
+    radioStatsNode = ADDRESSLIST_SIZE;
+    truncateTimer = 0;
+    CDCPacketPos = 0;
+    CDCTarget = 0;
+    CDCComplete = 0;
+    CDCReadyLength = 0;
+    CDCFill = 0;
+    bypassPush = 0;
+    bypassPop = 0;
+    bypassStarting = 0;
+    bypassDrops = 0;
+    XBeeBypassMode = 0;
     
     // Check to see if we should go into bypass mode
     if(EEPROMReadByte(EEPROM_SETTING_ADDR) == EEPROM_BYPASS_MODE) {
-        XBeeStartBypass();
-        XBeeBypassMode = 1;
-    }
-    else {
-        XBeeBypassMode = 0;
+        BypassStart();
     }
     
     // Initialise virtual serial port
@@ -126,7 +558,7 @@ void setup () {
     
     LEDOff(PLED);
     LEDInit(VLED);
-    LEDWrite(VLED, XBeeBypassMode);
+    LEDWrite(VLED, bypassStarting);
     PRGBlankTimer = 100;
     PRGPushTime = 0;
     PRGTimer = 0;
@@ -149,7 +581,10 @@ void loop() {
             EEPROMWriteByte(EEPROM_SETTING_ADDR, EEPROM_XBEE_MODE);
             XBeeStopBypass();
             XBeeBypassMode = 0;
+            bypassStarting = 0;
+            BypassClear();
             XBeeFactoryReset();
+            RadioRequestNP();
             
             PRGPushTime = 0;
             PRGTimer = 0;
@@ -161,11 +596,11 @@ void loop() {
                 if(EEPROMReadByte(EEPROM_SETTING_ADDR) != EEPROM_XBEE_MODE) EEPROMWriteByte(EEPROM_SETTING_ADDR, EEPROM_XBEE_MODE);
                 XBeeStopBypass();
                 XBeeBypassMode = 0;
+                BypassClear();
             }
-            else {
+            else if(bypassStarting == 0) {
                 if(EEPROMReadByte(EEPROM_SETTING_ADDR) != EEPROM_BYPASS_MODE) EEPROMWriteByte(EEPROM_SETTING_ADDR, EEPROM_BYPASS_MODE);
-                XBeeStartBypass();
-                XBeeBypassMode = 1;
+                BypassStart();
             }
             
             PRGPushTime = 0;
@@ -173,9 +608,14 @@ void loop() {
             PRGBlankTimer = 100;
         }
         else if(PRGPushTime > 3000) { // Create new network
-            flashVLED = XBEE_JOINPERIOD*10;
-            XBeeCoordinatorJoin();
-            PRGMode = 1;
+            if(XBeeCoordinatorJoin()) {
+                flashVLED = XBEE_JOINPERIOD*10;
+                RadioRequestNP();
+                PRGMode = 1;
+            }
+            else {
+                flashVLED = 1; // AT queue too full to take the whole join, nothing was queued so press again
+            }
             
             PRGPushTime = 0;
             PRGTimer = 0;
@@ -199,10 +639,96 @@ void loop() {
         }
     }
     
-    if(XBeeBypassMode == 0 && CDCTimeout == 0 && CDCCount > 0) {
-        SendToList(CDCBuf, CDCCount);
-        CDCCount = 0;
+    if(bypassStarting == 1) {
+        XBeeProcess(); // the CDC is held off until bypass starts
+    }
+    else if(bypassStarting == 2) {
+        BypassEnter();
     }
+    else if(XBeeBypassMode == 0) {
+        if(sysMS - radioStatsTimer >= RADIO_STATS_PERIOD) {
+            radioStatsTimer = sysMS;
+            radioStatsNode = 0; // start a new report
+            radioStatsItem = 0;
+        }
+        RadioSendStats();
+        if(sysMS - radioRSSITimer >= RADIO_RSSI_PERIOD) {
+            radioRSSITimer = sysMS;
+            RadioRequestRSSI();
+        }
+        RadioQueueNP(0);
+        XBeeProcess(); // downlink frames go out of the CDC from here, AT responses and the queue are handled too
+        
+        if(sysMS - truncateTimer >= TRUNCATE_PERIOD) {
+            truncateTimer = sysMS;
+            RadioAnnounceTruncate();
+        }
+        
+        if(CDCReadyLength) {
+            // the USB interrupt only touches the other buffer while this one is being sent
+            SendToSystem(CDCRequest[1-CDCFill], CDCReadyLength, CDCReadyTarget);
+            CDCReadyLength = 0;
+        }
+        
+        if(CDCComplete || (CDCTimeout == 0 && CDCCount > 0)) {
+            // packets that arrived while both buffers were busy, or unframed data that has stopped coming
+            IRQDisable(USB_IRQn);
+            if(CDCTimeout == 0) {
+                CDCPacketPos = 0; // the stream stalled, so start looking for a fresh packet
+                CDCComplete = CDCCount;
+            }
+            CDCHandOver();
+            IRQEnable(USB_IRQn);
+        }
+    }
+    else {
+        BypassToCDC();
+    }
+}
+
+// The XBee only holds off for RTS with D6 set to 1, so that is sent first (as an API frame, while the XBee interrupt
+// still parses them) and bypass starts once it has been answered.  D6 isn't written to the XBee's flash, it goes back to
+// its default when the XBee is reset and is sent again the next time bypass starts.
+void BypassStart(void) {
+    Port0Init(PIN17);
+    Port0SetOut(PIN17);
+    Port0Write(PIN17, 0); // RTS asserted, the XBee can send
+    
+    bypassStarting = 1;
+    if(XBeeQueueATByte('D', '6', 1, BypassD6Response) == 0) bypassStarting = 2;
+}
+
+// Called from XBeeProcess(), which would hand any frames still behind this one to XBeeMessage() as bypass data, so
+// loop() does the rest
+void BypassD6Response(unsigned char status, unsigned char * data, unsigned short length) {
+    // if the XBee didn't take D6 bypass still starts, anything it sends past a full buffer is counted in bypassDrops
+    if(bypassStarting) bypassStarting = 2;
+}
+
+void BypassEnter(void) {
+    bypassStarting = 0;
+    BypassClear();
+    bypassDrops = 0;
+    XBeeStartBypass();
+    XBeeBypassMode = 1;
+    LEDWrite(VLED, 1);
+}
+
+void BypassToCDC(void) {
+    unsigned short count = CDCWritable();
+    
+    while(bypassPush != bypassPop && count > 0) {
+        CDCWriteByte(bypassBuffer[bypassPop]);
+        bypassPop = (bypassPop + 1) & (BYPASS_BUFFER_SIZE - 1);
+        count--;
+    }
+    
+    if(((bypassPush - bypassPop) & (BYPASS_BUFFER_SIZE - 1)) <= BYPASS_START_LEVEL) Port0Write(PIN17, 0);
+}
+
+void BypassClear(void) {
+    bypassPop = bypassPush;
+    Port0Write(PIN17, 0);
 }
 
 void SysTickInterrupt() {
@@ -239,7 +765,19 @@ void SysTickInterrupt() {
 
 void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length) {
     if(XBeeBypassMode) {
-        CDCWrite(buffer, length);
+        unsigned short next;
+        while(length--) {
+            next = (bypassPush + 1) & (BYPASS_BUFFER_SIZE - 1);
+            if(next != bypassPop) {
+                bypassBuffer[bypassPush] = *buffer;
+                bypassPush = next;
+            }
+            else {
+                bypassDrops++; // the XBee should have been held off before then
+            }
+            buffer++;
+        }
+        if(((bypassPush - bypassPop) & (BYPASS_BUFFER_SIZE - 1)) >= BYPASS_STOP_LEVEL) Port0Write(PIN17, 1);
     }
     else {
         unsigned char * ptr = 0;
@@ -269,7 +807,7 @@ void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length
                 structsize = sizeof(xbee_receive_packet);
                 xbee_receive_packet.isNew = 1;
                 xbee_receive_packet.varLen = length - 11;
-                CDCWrite(buffer + 11,length - 11);  // send direct to CDCWrite
+                RadioExpand(buffer + 11, length - 11);  // send direct to the CDC, zero-filling truncated payloads
                 break;
             case IX_XBEE_NODEIDENTIFICATIONINDICATOR:
                 ptr = (unsigned char *) &xbee_node_identification_indicator;
@@ -288,12 +826,31 @@ void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length
         // take action
         switch(id) {
             case ID_XBEE_TRANSMITSTATUS:
+                j = FindNetworkAddress(xbee_transmit_status.networkAddress);
+                if(j < ADDRESSLIST_SIZE) {
+                    if(xbee_transmit_status.deliveryStatus != 0) nodeStats[j].failures++;
+                    if(xbee_transmit_status.transmitRetryCount < RETRY_BUCKETS) nodeStats[j].retries[xbee_transmit_status.transmitRetryCount]++;
+                    else nodeStats[j].retries[RETRY_BUCKETS-1]++;
+                }
+                
                 if(xbee_transmit_status.deliveryStatus == 0x21) {
                     StrikeNetworkAddress(xbee_transmit_status.networkAddress);
                 }
                 break;
             case ID_XBEE_RECEIVEPACKET:
-                AddNetworkAddress(xbee_receive_packet.networkAddress, xbee_receive_packet.sourceAddress);
+                // learn which system ID lives on this node from the MAVLink header of whatever it sends
+                if(xbee_receive_packet.varLen > 3 && xbee_receive_packet.RFData[0] == MAVLINK_STX) {
+                    j = AddNetworkAddress(xbee_receive_packet.networkAddress, xbee_receive_packet.sourceAddress, xbee_receive_packet.RFData[3]);
+                }
+                else {
+                    j = AddNetworkAddress(xbee_receive_packet.networkAddress, xbee_receive_packet.sourceAddress, 0);
+                }
+                
+                if(j < ADDRESSLIST_SIZE) {
+                    nodeStats[j].rxBytes += xbee_receive_packet.varLen;
+                    nodeStats[j].rxPackets++;
+                    radioLastNode = j;
+                }
                 break;
             case IX_XBEE_NODEIDENTIFICATIONINDICATOR:
                 if(xbee_node_identification_indicator.sourceEvent == 0x02) { // if a join event
@@ -301,24 +858,37 @@ void XBeeMessage(unsigned char id, unsigned char * buffer, unsigned short length
                     flashVLED = 3;
                     PRGMode = 0;
                 }
-                AddNetworkAddress(xbee_node_identification_indicator.remoteNetworkAddress, xbee_node_identification_indicator.remoteSourceAddress);
+                AddNetworkAddress(xbee_node_identification_indicator.remoteNetworkAddress, xbee_node_identification_indicator.remoteSourceAddress, 0);
                 break;
         }
     }
 }
 
+unsigned int CDCReadReady(void) {
+    // in bypass mode only take what the UART output buffer has room for, the rest is held off at the USB end
+    if(bypassStarting) return 0;
+    if(XBeeBypassMode) return UARTBufferWritable();
+    return 1;
+}
+
 void CDCReadByte(unsigned char byte) {
     if(XBeeBypassMode) {
-        UARTWriteByte(byte);
+        UARTBufferPush(byte);
     }
     else {
         CDCFlag = 1;
-        if(CDCCount < 255) {
-            CDCBuf[CDCCount++] = byte;
+        if(CDCCount >= CDCBUFSIZE && CDCComplete == 0) {
+            CDCPacketPos = 0; // a single packet bigger than the buffer, or unframed data, let it through in pieces
+            CDCComplete = CDCCount;
+        }
+        if(CDCCount >= CDCBUFSIZE) CDCHandOver();
+        
+        if(CDCCount < CDCBUFSIZE) {
+            CDCRequest[CDCFill]->RFData[CDCCount++] = byte;
+            CDCFrame(byte);
         }
         else {
-            SendToList(CDCBuf, CDCCount);
-            CDCCount = 0;
+            CDCDrops++;
         }
         CDCFlag = 0;
         CDCTimeout = 10;
@@ -125,6 +125,9 @@ void Reset_Handler(void) {
 	unsigned int LoadAddr, ExeAddr, SectionLen;
 	unsigned int *SectionTableAddr;
 
+    // sram1 and usbsram are unclocked out of reset, turn them on before their sections are initialised
+    LPC_SYSCON->SYSAHBCLKCTRL |= (1 << 26) | (1 << 27);
+
 	// Load base address of Global Section Table
 	SectionTableAddr = &__data_section_table;
 
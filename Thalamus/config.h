@@ -31,6 +31,11 @@
 
 #define RAND_A              16644525    // Coefficient for the linear congruential random number generator
 #define RAND_C              32767       // Coefficient for the linear congruential random number generator
+
+#define RAMFUNC_EN          1           // Set to 1 to run functions marked RAMFUNC from sram0 (set to 0 to leave them in flash, e.g. to compare timings)
+#define RAMFUNC_OPTIMIZE    "O3"        // Optimisation level for functions marked RAMFUNC, independent of the Makefile's
+#define RAM_BANKS_EN        1           // Set to 1 to place large buffers in sram1, and in usbsram while USB_EN is 0 (set to 0 to keep everything in sram0)
+#define THAL_RAMFUNC_EN     1           // Set to 1 to also run the I2C interrupt and fast trigonometry functions from RAM (set to 0 to save some RAM)
  
 #define CRP                 0xffffffff  // Code read protection settings
                                         // 0xffffffff = No CRP
@@ -289,7 +294,10 @@
     // *** Flash Functions (Hypo only)
     // ****************************************************************************
     
-    #define FLASH_EN            0           // Set to 1 to enable flash, NOTE: flash operation requires the use of 4kb of RAM for sector buffer!
+    #define FLASH_EN            0           // Set to 1 to enable flash
+    #define FLASH_BUFFERED      0           // Set to 1 for the buffered FlashWrite/FlashRead functions (random in-place updates), NOTE: these require the use of 4kb of RAM for sector buffer! (the FlashRaw and FlashAppend functions don't)
+    #define FLASH_PAGE_SIZE     256         // Size of the pages that FlashAppendPage programs, must divide into 4k
+    #define FLASH_FAST_READ     1           // Set to 1 to read with the fast read command (0x0b, one dummy byte after the address), 0 for the plain read command (0x03)
     
 #endif
 
@@ -297,8 +305,13 @@
     #define XBEE_EN             1           // Set to 1 to enable the XBee code
 
     #define XBEE_POWER_LEVEL    0           // Set transmit power: 4=18dBm/63mW, 3=16dBm/40mW, 2=14dBm/25mW, 1=12dBm/16mW, 0=0dBm/1mW
-    #define XBEE_BUFFER_SIZE    128         // XBee buffer size
+    #define XBEE_BUFFER_SIZE    128         // Largest XBee frame accepted (ID and data)
+    #define XBEE_RING_SIZE      512         // XBee receive ring, frames wait in here until XBeeProcess() is called
+    #define XBEE_FRAME_COUNT    16          // Number of received frames that can be waiting
     #define XBEE_JOINPERIOD     30          // Number of seconds to allow bind
+    #define XBEE_AT_QUEUE       24          // Number of AT commands that can be queued up
+    #define XBEE_AT_TIMEOUT     1000        // ms to wait for an AT command response
+    #define MAVLINK_CRC_TABLE   1           // Set to 1 to use a lookup table in flash for MAVLink checksums (512 bytes, one lookup per byte instead of shifts)
 #endif
 
 
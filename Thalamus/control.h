@@ -32,7 +32,7 @@ void control_throttle(){
 // *** Attitude PID Control
 // ****************************************************************************	
 
-void control_attitude(){
+RAMFUNC void control_attitude(){
 
 	//TODO: use real states
 	if (auxState == 1)
@@ -221,7 +221,7 @@ void control_attitude(){
 // *** Handle throttle and motor outputs
 // ****************************************************************************	
 
-void control_motors(){	
+RAMFUNC void control_motors(){	
 
 	// Combine attitude stabilisation demands from PID loop with throttle demands
 	tempN = (signed short)motorNav + (signed short)throttle + THROTTLEOFFSET + (signed short)throttle_angle;
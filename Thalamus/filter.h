@@ -15,7 +15,7 @@ void filter_GPS_baro(){
 	
 }
 
-void AHRS(){
+RAMFUNC void AHRS(){
 
 // ****************************************************************************
 // *** ATTITUDE HEADING REFERENCE SYSTEM
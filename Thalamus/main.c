@@ -57,6 +57,9 @@
 
 #define SLOW_DIVIDER		FAST_RATE/SLOW_RATE
 
+#define LOOP_TIMING		 0		   // Set to 1 to report the fast loop's run time in CPU cycles on DEBUG3 (average) and DEBUG4 (peak)
+#define LOOP_TIMING_TICK	60		  // CPU cycles per Timer0 tick (Timer0Init prescale + 1)
+
 // TODO: check ESC response at THROTTLEOFFSET, consider raising THROTTLEOFFSET to 1000
 #define THROTTLEOFFSET	900		// Corresponds to zero output PWM. Nominally 1000=1ms, but 800 works better
 #define IDLETHROTTLE		175		// Minimum PWM output to ESC when in-flight to avoid motors turning off
@@ -194,7 +197,7 @@ typedef struct{
 	sensorStructAccel Z;
 	unsigned int count;
 } threeAxisSensorStructAccel;
-threeAxisSensorStructAccel Accel;
+threeAxisSensorStructAccel Accel BSS_SRAM1;
 
 
 typedef struct{
@@ -211,7 +214,7 @@ typedef struct{
 	sensorStructMag Z;
 	unsigned int count;
 } threeAxisSensorStructMag;
-threeAxisSensorStructMag Mag;
+threeAxisSensorStructMag Mag BSS_SRAM1;
 
 typedef struct paramStorage_struct {
 	char name[16];
@@ -227,6 +230,7 @@ unsigned long long sysUS;
 unsigned short RxWatchdog;
 unsigned short UltraWatchdog;
 unsigned short slowSoftscale;
+unsigned int loopTicks, loopTicksPeak, loopCount;
 
 unsigned int paramSendCount;
 unsigned int paramCount;
@@ -287,7 +291,7 @@ unsigned int PRGPushTime; // Contains the time that a button was pushed for, pop
 
 /////////////////////////////////////////// TUNABLE PARAMETERS ////////////////////////////////////
 
-struct paramStorage_struct paramStorage[] = {
+struct paramStorage_struct paramStorage[] DATA_USBSRAM = {
 	{"DRIFT_AKp",		   0.4f},
 	{"DRIFT_MKp",	  		0.2f},   
 	#define DRIFT_AccelKp   paramStorage[0].value	
@@ -551,7 +555,7 @@ void RITInterrupt(void) {
 
 
 //Main functional periodic loop
-void Timer0Interrupt0() { // Runs at about 400Hz
+RAMFUNC void Timer0Interrupt0() { // Runs at about 400Hz
 
 	// We collect some data at a slower rate
 	if(++slowSoftscale >= SLOW_DIVIDER) {
@@ -576,6 +580,19 @@ void Timer0Interrupt0() { // Runs at about 400Hz
 	control_attitude();
 	control_motors();
 
+#if LOOP_TIMING
+	// Timer0 resets on the match that fired this interrupt, so its count is the time spent in the loop
+	unsigned int ticks = LPC_CT16B0->TC;
+	loopTicks += ticks;
+	if(ticks > loopTicksPeak) loopTicksPeak = ticks;
+	if(++loopCount >= FAST_RATE) {
+		ilink_debug.debug3 = (float)(loopTicks * LOOP_TIMING_TICK) / loopCount;
+		ilink_debug.debug4 = loopTicksPeak * LOOP_TIMING_TICK;
+		loopTicks = 0;
+		loopTicksPeak = 0;
+		loopCount = 0;
+	}
+#endif
 }
 
 
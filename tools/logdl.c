@@ -0,0 +1,322 @@
+// Downloads Hypo's flight log over a serial link (the XBee, or Hypo's USB CDC port) and writes it out oldest block
+// first, then walks it and prints what's in it.  This is the reference receiver for the LOG_CMD_* commands in
+// Hypo/main.c:
+//   logdl [-b baud] [-s sysid] <device> <output>    download the log from the Hypo with the given MAVLink system id
+//   logdl -d <file>                                 decode a log written out by an earlier download
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include "mavlink.h"
+#include "logrx.h"
+
+#define LOGDL_SYSID         255     // GCS system and component ids used for our own messages
+#define LOGDL_COMPID        190
+#define LOGDL_ACK_MS        100     // acknowledgement interval, well inside Hypo's LOG_DL_TIMEOUT
+#define LOGDL_REPORT_MS     1000    // interval between requests for LOGFIRST, LOGEND and LOGCHUNKS
+#define LOGDL_RESUME_MS     3000    // silence before asking again from the first missing chunk
+#define LOGDL_GIVEUP_MS     30000   // silence before giving up altogether
+
+int serial = -1;
+unsigned int targetID = 10;
+
+unsigned int NowMS(void) {
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int SerialOpen(const char * device, unsigned int baud) {
+    struct termios tio;
+    speed_t speed;
+
+    switch(baud) {
+        case 9600:   speed = B9600;   break;
+        case 19200:  speed = B19200;  break;
+        case 38400:  speed = B38400;  break;
+        case 57600:  speed = B57600;  break;
+        case 115200: speed = B115200; break;
+        case 230400: speed = B230400; break;
+        default:
+            fprintf(stderr, "unsupported baud rate %u\n", baud);
+            return -1;
+    }
+
+    serial = open(device, O_RDWR | O_NOCTTY);
+    if(serial < 0) {
+        perror(device);
+        return -1;
+    }
+    if(tcgetattr(serial, &tio) < 0) {
+        perror(device);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if(tcsetattr(serial, TCSANOW, &tio) < 0) {
+        perror(device);
+        return -1;
+    }
+    tcflush(serial, TCIOFLUSH);
+    return 0;
+}
+
+void SendMessage(mavlink_message_t * msg) {
+    unsigned char buffer[MAVLINK_MAX_PACKET_LEN];
+    unsigned int length;
+
+    length = mavlink_msg_to_send_buffer(buffer, msg);
+    if(write(serial, buffer, length) != length) perror("write");
+}
+
+void SendHeartbeat(void) {
+    mavlink_message_t msg;
+    mavlink_msg_heartbeat_pack(LOGDL_SYSID, LOGDL_COMPID, &msg, MAV_TYPE_GCS, MAV_AUTOPILOT_INVALID, 0, 0, MAV_STATE_ACTIVE);
+    SendMessage(&msg);
+}
+
+void SendCommand(unsigned short command, float * param) {
+    mavlink_message_t msg;
+    mavlink_msg_command_long_pack(LOGDL_SYSID, LOGDL_COMPID, &msg, targetID, 0, command, 0,
+                                  param[0], param[1], param[2], param[3], param[4], param[5], param[6]);
+    SendMessage(&msg);
+}
+
+void SendDownload(float first, float end) {
+    float param[7] = {first, end, 0, 0, 0, 0, 0};
+    SendCommand(LOG_CMD_DOWNLOAD, param);
+}
+
+void SendAck(logRx_t * rx) {
+    float param[7];
+    LogRxAck(rx, param);
+    SendCommand(LOG_CMD_ACK, param);
+}
+
+void SendStop(void) {
+    float param[7] = {0, 0, 0, 0, 0, 0, 0};
+    SendCommand(LOG_CMD_STOP, param);
+}
+
+// Reads whatever has arrived within timeout ms, returns 1 with a message from the target in msg
+int ReceiveMessage(mavlink_message_t * msg, unsigned int timeout) {
+    mavlink_status_t status;
+    struct timeval tv;
+    fd_set fds;
+    unsigned char c;
+
+    while(1) {
+        FD_ZERO(&fds);
+        FD_SET(serial, &fds);
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        if(select(serial + 1, &fds, 0, 0, &tv) <= 0) return 0;
+
+        while(read(serial, &c, 1) == 1) {
+            if(mavlink_parse_char(MAVLINK_COMM_0, c, msg, &status) && msg->sysid == targetID) return 1;
+        }
+    }
+}
+
+// *** Decoding
+typedef struct {
+    unsigned int records, flights, lastFlight;
+    unsigned int start, end;                    // sysMS of the first and last record of the current flight
+    unsigned int ilink, gps;
+} logStats_t;
+
+void LogStatsFlight(logStats_t * stats) {
+    if(stats->flights == 0) return;
+    printf("  flight %u: %.1fs\n", stats->lastFlight, (stats->end - stats->start) / 1000.0);
+}
+
+void LogStatsRecord(const logHeader_t * header, const logRecord_t * record, const unsigned char * data, void * context) {
+    logStats_t * stats = context;
+
+    if(stats->flights == 0 || header->flight != stats->lastFlight) {
+        LogStatsFlight(stats);
+        stats->flights++;
+        stats->lastFlight = header->flight;
+        stats->start = record->time;
+    }
+    stats->end = record->time;
+    stats->records++;
+    if(record->source == LOG_SOURCE_ILINK) stats->ilink++;
+    if(record->source == LOG_SOURCE_GPS) stats->gps++;
+}
+
+void LogPrint(const unsigned char * log, unsigned int length) {
+    logStats_t stats;
+    unsigned int blocks, bad;
+
+    memset(&stats, 0, sizeof(stats));
+    blocks = LogDecode(log, length, LogStatsRecord, &stats, &bad);
+    LogStatsFlight(&stats);
+
+    printf("%u good blocks, %u bad, %u records in %u flights\n", blocks, bad, stats.records, stats.flights);
+    printf("  %u ILink records, %u GPS records\n", stats.ilink, stats.gps);
+}
+
+int LogDecodeFile(const char * filename) {
+    unsigned char * log;
+    FILE * file;
+    long length;
+
+    file = fopen(filename, "rb");
+    if(file == 0) {
+        perror(filename);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    log = malloc(length > 0 ? length : 1);
+    if(log == 0 || fread(log, 1, length, file) != length) {
+        perror(filename);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    LogPrint(log, length);
+    free(log);
+    return 0;
+}
+
+// *** Download
+int LogDownload(const char * filename) {
+    mavlink_message_t msg;
+    mavlink_named_value_int_t named;
+    mavlink_memory_vect_t vect;
+    logRx_t rx;
+    unsigned int now, heartbeatTime = 0, requestTime = 0, ackTime = 0, chunkTime, resumeTime;
+    unsigned int got = 0, first = 0, end = 0, chunks = 0, length, received;
+    unsigned char * log;
+    FILE * file;
+
+    // ask for where the log is until all three have come back
+    while(got != 7) {
+        now = NowMS();
+        if(now - heartbeatTime >= 1000) {
+            SendHeartbeat();
+            heartbeatTime = now;
+        }
+        if(now - requestTime >= LOGDL_REPORT_MS) {
+            SendDownload(-1, -1);
+            requestTime = now;
+        }
+        if(ReceiveMessage(&msg, 50) && msg.msgid == MAVLINK_MSG_ID_NAMED_VALUE_INT) {
+            mavlink_msg_named_value_int_decode(&msg, &named);
+            if(strncmp(named.name, "LOGFIRST", sizeof(named.name)) == 0)        { first = named.value;  got |= 1; }
+            else if(strncmp(named.name, "LOGEND", sizeof(named.name)) == 0)     { end = named.value;    got |= 2; }
+            else if(strncmp(named.name, "LOGCHUNKS", sizeof(named.name)) == 0)  { chunks = named.value; got |= 4; }
+        }
+    }
+
+    if(LogRxInit(&rx, first, end, chunks) == 0) {
+        fprintf(stderr, "bad log report: first %u end %u chunks %u\n", first, end, chunks);
+        return 1;
+    }
+    printf("log is chunks %u to %u of %u, %u to fetch\n", first, end, chunks, rx.total);
+
+    SendDownload(first, end);
+    chunkTime = resumeTime = NowMS();
+    received = 0;
+    while(LogRxDone(&rx) == 0) {
+        now = NowMS();
+        if(now - heartbeatTime >= 1000) {
+            SendHeartbeat();
+            heartbeatTime = now;
+            printf("\r%u of %u chunks", rx.next, rx.total);
+            fflush(stdout);
+        }
+        if(now - ackTime >= LOGDL_ACK_MS) {
+            SendAck(&rx);
+            ackTime = now;
+        }
+        if(now - chunkTime >= LOGDL_GIVEUP_MS) {
+            fprintf(stderr, "\nno chunks for %us, giving up at %u of %u\n", LOGDL_GIVEUP_MS / 1000, rx.next, rx.total);
+            SendStop();
+            LogRxFree(&rx);
+            return 1;
+        }
+        if(now - chunkTime >= LOGDL_RESUME_MS && now - resumeTime >= LOGDL_REPORT_MS) {
+            // Hypo has abandoned the download (or never got the request), start again from the first missing chunk
+            SendDownload(LogRxResume(&rx), end);
+            resumeTime = now;
+        }
+
+        if(ReceiveMessage(&msg, 10) && msg.msgid == MAVLINK_MSG_ID_MEMORY_VECT) {
+            mavlink_msg_memory_vect_decode(&msg, &vect);
+            if(vect.ver != LOG_VECT_VER) continue;
+            LogRxChunk(&rx, vect.address, (unsigned char *)vect.value);
+            if(rx.received != received) {
+                received = rx.received;
+                chunkTime = now;
+            }
+        }
+    }
+    SendAck(&rx);
+    printf("\r%u of %u chunks\n", rx.next, rx.total);
+
+    log = malloc(rx.total * LOG_CHUNK_SIZE);
+    if(log == 0) {
+        perror("malloc");
+        LogRxFree(&rx);
+        return 1;
+    }
+    length = LogRxCopy(&rx, log);
+    LogRxFree(&rx);
+
+    file = fopen(filename, "wb");
+    if(file == 0 || fwrite(log, 1, length, file) != length) {
+        perror(filename);
+        if(file) fclose(file);
+        free(log);
+        return 1;
+    }
+    fclose(file);
+    printf("wrote %u bytes to %s\n", length, filename);
+
+    LogPrint(log, length);
+    free(log);
+    return 0;
+}
+
+void Usage(void) {
+    fprintf(stderr, "usage: logdl [-b baud] [-s sysid] <device> <output>\n");
+    fprintf(stderr, "       logdl -d <file>\n");
+}
+
+int main(int argc, char ** argv) {
+    unsigned int baud = 57600;
+    int opt;
+
+    while((opt = getopt(argc, argv, "b:s:d:")) != -1) {
+        switch(opt) {
+            case 'b': baud = atoi(optarg); break;
+            case 's': targetID = atoi(optarg); break;
+            case 'd': return LogDecodeFile(optarg);
+            default:
+                Usage();
+                return 1;
+        }
+    }
+    if(argc - optind != 2) {
+        Usage();
+        return 1;
+    }
+
+    if(SerialOpen(argv[optind], baud) < 0) return 1;
+    return LogDownload(argv[optind + 1]);
+}
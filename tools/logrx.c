@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mavlink/checksum.h"
+#include "logrx.h"
+
+#define LOGRX_BIT(map, i)   ((map)[(i) >> 3] & (1 << ((i) & 0x7)))
+
+int LogRxInit(logRx_t * rx, unsigned int first, unsigned int end, unsigned int chunks) {
+    memset(rx, 0, sizeof(logRx_t));
+    if(chunks == 0 || first >= chunks || end >= chunks) return 0;
+
+    rx->first = first;
+    rx->end = end;
+    rx->chunks = chunks;
+    rx->total = (end + chunks - first) % chunks;
+    rx->have = calloc((chunks + 7) / 8, 1);
+    rx->image = malloc(chunks * LOG_CHUNK_SIZE);
+    if(rx->have == 0 || rx->image == 0) {
+        LogRxFree(rx);
+        return 0;
+    }
+    memset(rx->image, 0xff, chunks * LOG_CHUNK_SIZE);
+    return 1;
+}
+
+void LogRxFree(logRx_t * rx) {
+    free(rx->have);
+    free(rx->image);
+    rx->have = 0;
+    rx->image = 0;
+}
+
+// Puts a MEMORY_VECT's 32 bytes in place, repeats and anything outside the log are ignored
+void LogRxChunk(logRx_t * rx, unsigned int chunk, const unsigned char * data) {
+    unsigned int distance;
+
+    if(chunk >= rx->chunks) return;
+    distance = (chunk + rx->chunks - rx->first) % rx->chunks;
+    if(distance >= rx->total || LOGRX_BIT(rx->have, chunk)) return;
+
+    memcpy(&rx->image[chunk * LOG_CHUNK_SIZE], data, LOG_CHUNK_SIZE);
+    rx->have[chunk >> 3] |= 1 << (chunk & 0x7);
+    rx->received++;
+    if(distance + 1 > rx->top) rx->top = distance + 1;
+
+    while(rx->next < rx->total && LOGRX_BIT(rx->have, (rx->first + rx->next) % rx->chunks)) rx->next++;
+}
+
+// Fills param1 to param7 of a LOG_CMD_ACK: the first chunk still wanted, then up to six gaps behind the furthest chunk
+// that has arrived (the first of which is param1 itself), which Hypo sends again straight away
+void LogRxAck(logRx_t * rx, float * param) {
+    unsigned int distance, chunk, count = 0;
+
+    param[0] = (rx->first + rx->next) % rx->chunks;
+    for(distance = rx->next; distance < rx->top && count < 6; distance++) {
+        chunk = (rx->first + distance) % rx->chunks;
+        if(LOGRX_BIT(rx->have, chunk) == 0) param[1 + count++] = chunk;
+    }
+    while(count < 6) param[1 + count++] = -1;
+}
+
+// Chunk to start a LOG_CMD_DOWNLOAD from to pick up where this left off
+unsigned int LogRxResume(logRx_t * rx) {
+    return (rx->first + rx->next) % rx->chunks;
+}
+
+int LogRxDone(logRx_t * rx) {
+    return (rx->next >= rx->total);
+}
+
+// Copies the log out in order from LOGFIRST, so that it starts with the oldest block, returns its length in bytes
+unsigned int LogRxCopy(logRx_t * rx, unsigned char * out) {
+    unsigned int distance, chunk;
+
+    for(distance = 0; distance < rx->total; distance++) {
+        chunk = (rx->first + distance) % rx->chunks;
+        memcpy(&out[distance * LOG_CHUNK_SIZE], &rx->image[chunk * LOG_CHUNK_SIZE], LOG_CHUNK_SIZE);
+    }
+    return rx->total * LOG_CHUNK_SIZE;
+}
+
+// Walks a log copied out by LogRxCopy, calling func for every record of every block that checks out.  Erased blocks
+// are skipped, anything else that fails (a block torn by a power cut, or a bad transfer) is counted in bad.  Returns
+// the number of good blocks.
+unsigned int LogDecode(const unsigned char * log, unsigned int length, logDecodeFunc_t func, void * context, unsigned int * bad) {
+    const logHeader_t * header;
+    const logRecord_t * record;
+    unsigned int offset, used, blocks = 0;
+    unsigned short checksum;
+
+    *bad = 0;
+    for(offset = 0; offset + LOG_BLOCK_SIZE <= length; offset += LOG_BLOCK_SIZE) {
+        header = (const logHeader_t *)&log[offset];
+        if(header->magic == 0xffff && header->seq == 0xffffffff) continue;
+
+        if(header->magic != LOG_MAGIC || header->seqCheck != ~header->seq || header->used > LOG_BLOCK_SIZE - sizeof(logHeader_t)) {
+            (*bad)++;
+            continue;
+        }
+        checksum = crc_calculate((uint8_t *)header, sizeof(logHeader_t) - 2);
+        for(used = 0; used < header->used; used++) {
+            crc_accumulate(log[offset + sizeof(logHeader_t) + used], &checksum);
+        }
+        if(checksum != header->crc) {
+            (*bad)++;
+            continue;
+        }
+
+        blocks++;
+        for(used = 0; used + sizeof(logRecord_t) <= header->used; used += sizeof(logRecord_t) + record->length) {
+            record = (const logRecord_t *)&log[offset + sizeof(logHeader_t) + used];
+            if(used + sizeof(logRecord_t) + record->length > header->used) break;
+            if(func) func(header, record, (const unsigned char *)(record + 1), context);
+        }
+    }
+    return blocks;
+}
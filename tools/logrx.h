@@ -0,0 +1,32 @@
+// Host side of the flight log download, see "Log download" in Hypo/main.c.  The chunks are put back in place as they
+// arrive in any order, the acknowledgements are worked out from what's still missing, and the finished log is walked
+// block by block checking each header and CRC.
+
+#ifndef __LOGRX_H__
+#define __LOGRX_H__
+
+#include "hypo_log.h"
+
+typedef struct {
+    unsigned int first, end, chunks;    // LOGFIRST, LOGEND and LOGCHUNKS as reported by Hypo
+    unsigned int total;                 // chunks from first up to end
+    unsigned int next;                  // chunks from first that have all arrived
+    unsigned int top;                   // one past the furthest chunk that has arrived, counted from first
+    unsigned int received;
+    unsigned char * have;               // bitmap by chunk number
+    unsigned char * image;              // the whole log area, by chunk number
+} logRx_t;
+
+// Called for each record of each good block by LogDecode
+typedef void (*logDecodeFunc_t)(const logHeader_t * header, const logRecord_t * record, const unsigned char * data, void * context);
+
+int LogRxInit(logRx_t * rx, unsigned int first, unsigned int end, unsigned int chunks);
+void LogRxFree(logRx_t * rx);
+void LogRxChunk(logRx_t * rx, unsigned int chunk, const unsigned char * data);
+void LogRxAck(logRx_t * rx, float * param);
+unsigned int LogRxResume(logRx_t * rx);
+int LogRxDone(logRx_t * rx);
+unsigned int LogRxCopy(logRx_t * rx, unsigned char * out);
+unsigned int LogDecode(const unsigned char * log, unsigned int length, logDecodeFunc_t func, void * context, unsigned int * bad);
+
+#endif
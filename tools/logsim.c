@@ -0,0 +1,333 @@
+// Runs Hypo's flight recorder and log download, taken straight out of Hypo/main.c and Hypo/build/thal.c by the Makefile,
+// against a simulated SPI flash and a lossy link to the receiver in logrx.c.  Each scenario records some flights,
+// restarts the recorder as after a reset, downloads the log and then checks that:
+//   - the recorder picks up again exactly where it left off
+//   - nothing touched the flash while an erase was running, so the real RIT would never have waited on one
+//   - nothing was programmed without being erased first
+//   - the reassembled log matches the flash byte for byte
+//   - every block checks out, and the records read back are the last ones recorded, in order
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mavlink.h"
+#include "logrx.h"
+
+// *** What the log code needs from the rest of Hypo
+unsigned int sysMS;
+unsigned int allowTransmit = 1;
+unsigned int linkCapacity = LINK_CAPACITY_MAX;
+mavlink_command_ack_t mavlink_command_ack;
+mavlink_memory_vect_t mavlink_memory_vect;
+unsigned int FUNCFlashAppendStart, FUNCFlashAppendEnd;
+unsigned int FUNCFlashAppendAddr;
+unsigned int FUNCFlashEraseAddr;
+unsigned int FUNCFlashEraseAhead;
+
+unsigned char FlashBusy(void);
+void FlashErase4k(unsigned int address);
+void FlashRawRead(unsigned int address, unsigned char * data, unsigned int length);
+void FlashRawWrite(unsigned int address, unsigned char * data, unsigned int length);
+void FlashAppendInit(unsigned int start, unsigned int end, unsigned int address, unsigned int erased, unsigned int eraseAhead);
+unsigned int FlashAppendAddress(void);
+unsigned int FlashAppendEraseAddress(void);
+unsigned int FlashAppendSpace(void);
+unsigned char FlashAppendService(void);
+unsigned char FlashAppendPage(unsigned char * data, unsigned int length);
+void MAVSendPacket(unsigned char msgid, unsigned char compid, void * packet, unsigned char length);
+void MAVSendInt(char * name, int value);
+
+#include "hypo_log.inc"
+
+// *** Simulated flash, erases take SIM_ERASE_US and everything else is instant
+#define SIM_TICK_US     (1000000 / MESSAGE_LOOP_HZ)
+#define SIM_ERASE_US    25000   // typical 4k sector erase time for the SST25 parts
+#define SIM_RECORD_MAX  64
+
+unsigned char simFlash[LOG_FLASH_END];
+unsigned int simTime, simBusyUntil;
+unsigned int simWaits, simOverwrites;
+
+unsigned char FlashBusy(void) {
+    return (simTime < simBusyUntil);
+}
+
+void FlashErase4k(unsigned int address) {
+    if(FlashBusy()) simWaits++;
+    memset(&simFlash[address & 0xfffff000], 0xff, 0x1000);
+    simBusyUntil = simTime + SIM_ERASE_US;
+}
+
+void FlashRawRead(unsigned int address, unsigned char * data, unsigned int length) {
+    if(FlashBusy()) simWaits++;
+    memcpy(data, &simFlash[address], length);
+}
+
+void FlashRawWrite(unsigned int address, unsigned char * data, unsigned int length) {
+    unsigned int i;
+    if(FlashBusy()) simWaits++;
+    for(i=0; i<length; i++) {
+        if((simFlash[address + i] & data[i]) != data[i]) simOverwrites++; // would need a 0 turned back into a 1
+        simFlash[address + i] &= data[i];
+    }
+}
+
+// *** Simulated link, chunks and acknowledgements are dropped at random
+typedef struct {
+    unsigned char source;
+    unsigned char length;
+    unsigned short id;
+    unsigned int time;
+    unsigned char data[SIM_RECORD_MAX];
+} simRecord_t;
+
+logRx_t simRx;
+unsigned int simChunkLoss, simAckLoss;     // percent
+unsigned int simChunksSent, simAckResult;
+int simFirst, simEnd, simChunks;
+unsigned int simSeed = 1;
+
+simRecord_t * simRecords;                   // everything given to LogRecord that wasn't dropped
+unsigned int simRecordCount, simRecordSize;
+unsigned int simDecoded, simMismatches;
+unsigned int simLastSeq, simSeqGaps;
+
+unsigned int SimRandom(void) {
+    simSeed = simSeed * 1103515245 + 12345;
+    return (simSeed >> 16) & 0x7fff;
+}
+
+void MAVSendPacket(unsigned char msgid, unsigned char compid, void * packet, unsigned char length) {
+    mavlink_memory_vect_t * vect;
+
+    if(msgid == MAVLINK_MSG_ID_MEMORY_VECT) {
+        vect = (mavlink_memory_vect_t *)packet;
+        simChunksSent++;
+        if(vect->ver == LOG_VECT_VER && SimRandom() % 100 >= simChunkLoss) {
+            LogRxChunk(&simRx, vect->address, (unsigned char *)vect->value);
+        }
+    }
+    else if(msgid == MAVLINK_MSG_ID_COMMAND_ACK) {
+        simAckResult = ((mavlink_command_ack_t *)packet)->result;
+    }
+}
+
+void MAVSendInt(char * name, int value) {
+    if(strcmp(name, "LOGFIRST") == 0) simFirst = value;
+    if(strcmp(name, "LOGEND") == 0) simEnd = value;
+    if(strcmp(name, "LOGCHUNKS") == 0) simChunks = value;
+}
+
+void SimTick(void) {
+    sysMS += SIM_TICK_US / 1000;
+    simTime += SIM_TICK_US;
+}
+
+void SimCommand(unsigned short command, float param1, float param2) {
+    mavlink_command_long_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.command = command;
+    cmd.param1 = param1;
+    cmd.param2 = param2;
+    LogDownloadCommand(&cmd);
+}
+
+// *** Recording
+void SimLog(unsigned char source, unsigned short id, unsigned int length) {
+    unsigned char data[SIM_RECORD_MAX];
+    unsigned int i, drops = logDrops;
+
+    for(i=0; i<length; i++) data[i] = SimRandom();
+    LogRecord(source, id, data, length);
+    if(logDrops != drops) return;
+
+    if(simRecordCount == simRecordSize) {
+        simRecordSize = simRecordSize ? simRecordSize * 2 : 4096;
+        simRecords = realloc(simRecords, simRecordSize * sizeof(simRecord_t));
+    }
+    simRecords[simRecordCount].source = source;
+    simRecords[simRecordCount].length = length;
+    simRecords[simRecordCount].id = id;
+    simRecords[simRecordCount].time = sysMS;
+    memcpy(simRecords[simRecordCount].data, data, length);
+    simRecordCount++;
+}
+
+// The same mix the RIT logs: attitude and raw IMU every message loop, status and IO every LOG_IO_DIVIDER, GPS at 5Hz
+void SimFlight(unsigned int ticks) {
+    unsigned int t;
+
+    LogStart();
+    for(t=0; t<ticks; t++) {
+        SimLog(LOG_SOURCE_ILINK, 0x21, 24);
+        SimLog(LOG_SOURCE_ILINK, 0x22, 18);
+        if(t % LOG_IO_DIVIDER == 0) {
+            SimLog(LOG_SOURCE_ILINK, 0x11, 10);
+            SimLog(LOG_SOURCE_ILINK, 0x31, 16);
+            SimLog(LOG_SOURCE_ILINK, 0x32, 16);
+        }
+        if(t % (MESSAGE_LOOP_HZ / 5) == 0) SimLog(LOG_SOURCE_GPS, 0x0102, 28 + SimRandom() % 8);
+        LogService();
+        SimTick();
+    }
+
+    logRecording = 0; // disarmed
+    for(t=0; t<MESSAGE_LOOP_HZ; t++) {
+        LogService();
+        SimTick();
+    }
+}
+
+// *** Checking
+void SimDecoded(const logHeader_t * header, const logRecord_t * record, const unsigned char * data, void * context) {
+    unsigned int base = *(unsigned int *)context;
+    simRecord_t * expect;
+
+    if(simDecoded && header->seq != simLastSeq && header->seq != simLastSeq + 1) simSeqGaps++;
+    simLastSeq = header->seq;
+
+    if(base + simDecoded >= simRecordCount) {
+        simMismatches++;
+    }
+    else {
+        expect = &simRecords[base + simDecoded];
+        if(record->source != expect->source || record->id != expect->id || record->time != expect->time ||
+                record->length != expect->length || memcmp(data, expect->data, record->length) != 0) {
+            simMismatches++;
+        }
+    }
+    simDecoded++;
+}
+
+void SimCount(const logHeader_t * header, const logRecord_t * record, const unsigned char * data, void * context) {
+    (*(unsigned int *)context)++;
+}
+
+int SimScenario(const char * name, unsigned int flights, unsigned int ticks, unsigned int chunkLoss, unsigned int ackLoss) {
+    unsigned int i, t, address, seq, limit, resumed = 0, failed = 0;
+    unsigned int length, blocks, bad, count, base;
+    unsigned char * log;
+
+    printf("%s: %u flights of %us, %u%% chunk loss, %u%% acknowledgement loss\n", name, flights, ticks / MESSAGE_LOOP_HZ, chunkLoss, ackLoss);
+
+    memset(simFlash, 0xff, sizeof(simFlash));
+    simTime = simBusyUntil = simWaits = simOverwrites = 0;
+    simRecordCount = 0;
+    sysMS = 0;
+
+    LogInit();
+    for(i=0; i<flights; i++) SimFlight(ticks);
+    if(logDrops) printf("  %u records dropped while recording\n", logDrops);
+
+    // as after a reset, once the last erase has had time to finish
+    address = FlashAppendAddress();
+    seq = logSeq;
+    simTime += SIM_ERASE_US;
+    LogInit();
+    if(FlashAppendAddress() != address || logSeq != seq) {
+        printf("  FAIL: restarted at 0x%06x seq %u, was at 0x%06x seq %u\n", FlashAppendAddress(), logSeq, address, seq);
+        failed = 1;
+    }
+
+    // ask for the extent first, the same as a GCS would
+    simFirst = simEnd = simChunks = -1;
+    SimCommand(LOG_CMD_DOWNLOAD, -1, -1);
+    for(t=0; t<MESSAGE_LOOP_HZ && simChunks < 0; t++) {
+        LogDownloadService();
+        SimTick();
+    }
+    if(simAckResult != MAV_CMD_ACK_OK || simChunks != LOG_CHUNKS || LogRxInit(&simRx, simFirst, simEnd, simChunks) == 0) {
+        printf("  FAIL: no usable report (first %d end %d chunks %d)\n", simFirst, simEnd, simChunks);
+        return 1;
+    }
+    printf("  log is chunks %d to %d of %d, %u to fetch\n", simFirst, simEnd, simChunks, simRx.total);
+
+    // then fetch it, acknowledging every few message loops and breaking off half way to resume
+    simChunkLoss = chunkLoss;
+    simAckLoss = ackLoss;
+    simChunksSent = 0;
+    SimCommand(LOG_CMD_DOWNLOAD, simFirst, -1);
+    limit = simRx.total * 4 + 1000;
+    for(t=0; t<limit && LogRxDone(&simRx) == 0; t++) {
+        LogDownloadService();
+        SimTick();
+
+        if(t % 5 == 4) {
+            mavlink_command_long_t ack;
+            memset(&ack, 0, sizeof(ack));
+            ack.command = LOG_CMD_ACK;
+            LogRxAck(&simRx, &ack.param1);
+            if(SimRandom() % 100 >= simAckLoss) LogDownloadCommand(&ack);
+        }
+
+        if(resumed == 0 && simRx.received > simRx.total / 2) {
+            resumed = 1;
+            SimCommand(LOG_CMD_STOP, 0, 0);
+            for(i=0; i<MESSAGE_LOOP_HZ; i++) {
+                LogDownloadService();
+                SimTick();
+            }
+            SimCommand(LOG_CMD_DOWNLOAD, LogRxResume(&simRx), simEnd);
+        }
+    }
+    if(LogRxDone(&simRx) == 0) {
+        printf("  FAIL: download stalled at %u of %u chunks\n", simRx.next, simRx.total);
+        return 1;
+    }
+    {
+        mavlink_command_long_t ack;
+        memset(&ack, 0, sizeof(ack));
+        ack.command = LOG_CMD_ACK;
+        LogRxAck(&simRx, &ack.param1);
+        LogDownloadCommand(&ack);
+    }
+    printf("  downloaded in %us, %u chunks sent for %u\n", t / MESSAGE_LOOP_HZ, simChunksSent, simRx.total);
+    if(logDownloading) {
+        printf("  FAIL: Hypo is still sending after the final acknowledgement\n");
+        failed = 1;
+    }
+
+    // the download has to match the flash exactly
+    for(i=0; i<simRx.total; i++) {
+        address = (simFirst + i) % simChunks;
+        if(memcmp(&simRx.image[address * LOG_CHUNK_SIZE], &simFlash[LOG_FLASH_ADDR + address * LOG_CHUNK_SIZE], LOG_CHUNK_SIZE) != 0) {
+            printf("  FAIL: chunk %u differs from the flash\n", address);
+            failed = 1;
+            break;
+        }
+    }
+
+    // and read back as the most recent records, in order
+    log = malloc(simRx.total * LOG_CHUNK_SIZE);
+    length = LogRxCopy(&simRx, log);
+    count = 0;
+    LogDecode(log, length, SimCount, &count, &bad);
+    base = simRecordCount - count;
+    simDecoded = simMismatches = simSeqGaps = 0;
+    blocks = LogDecode(log, length, SimDecoded, &base, &bad);
+    printf("  %u blocks, %u records read back of %u recorded\n", blocks, simDecoded, simRecordCount);
+    if(bad || simMismatches || simSeqGaps || simDecoded == 0) {
+        printf("  FAIL: %u bad blocks, %u records differ, %u gaps in the block sequence\n", bad, simMismatches, simSeqGaps);
+        failed = 1;
+    }
+    if(simWaits || simOverwrites) {
+        printf("  FAIL: %u flash accesses during an erase, %u writes to unerased flash\n", simWaits, simOverwrites);
+        failed = 1;
+    }
+
+    free(log);
+    LogRxFree(&simRx);
+    printf("  %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
+
+int main(void) {
+    int failed = 0;
+
+    failed |= SimScenario("short log", 2, 60 * MESSAGE_LOOP_HZ, 10, 10);
+    failed |= SimScenario("wrapped log", 7, 100 * MESSAGE_LOOP_HZ, 10, 10);
+    failed |= SimScenario("clean link", 1, 20 * MESSAGE_LOOP_HZ, 0, 0);
+
+    return failed;
+}
@@ -0,0 +1,296 @@
+// Checks Hypo's MAVLink receive path on the host, built once with MAVLINK_CRC_TABLE 0 and once with 1 so both ways of
+// working out the X.25 CRC in checksum.h are covered:
+//   - crc_accumulate() against a plain bit-at-a-time X.25 for every CRC state and byte value
+//   - MAVLinkParseBuffer(), taken straight out of Hypo/main.c by the Makefile, against mavlink_parse_char() a byte at a
+//     time, on a stream cut up into XBee frames of random sizes.  Both have to come up with exactly the same messages.
+//   - then both are timed over the same stream and frames: MAVLinkParse() a byte at a time, as Hypo used to, against
+//     MAVLinkParseBuffer().  mavparse0's by byte figure against mavparse1's by frame one is the old receive path
+//     against the new.
+//   mavparse [capture]     the stream is read from a capture of what the GCS sends (raw bytes, as written by a serial
+//                          logger) if given, otherwise made up streams of every message type are used, one clean and
+//                          one with junk, false starts and damaged messages
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "mavlink.h"
+
+#define MAVPARSE_FRAME_MAX  100     // largest RF payload of an XBee frame
+#define MAVPARSE_MESSAGES   20000   // messages in a made up stream
+#define MAVPARSE_MAX        (MAVPARSE_MESSAGES * 2)
+#define MAVPARSE_PASSES     20      // timed passes over the stream, the fastest is the one reported
+
+// *** What the parser needs from the rest of Hypo
+mavlink_message_t mavlink_rx_msg;
+mavlink_status_t mavlink_status;
+void MAVLinkParse(unsigned char UARTData);
+void MAVLinkParseBuffer(unsigned char * buffer, unsigned int length);
+void MAVLinkDispatch(void);
+
+#include "hypo_mavparse.inc"
+
+// Messages as they come out of each parser
+typedef struct {
+    mavlink_message_t msg[MAVPARSE_MAX];
+    unsigned int count;
+} mavList_t;
+
+mavList_t sent, byBuffer, byChar;
+unsigned int timing, timedMessages;     // while timing, messages are only counted
+
+void MAVListAdd(mavList_t * list, mavlink_message_t * msg) {
+    if(list->count < MAVPARSE_MAX) list->msg[list->count++] = *msg;
+}
+
+int MAVSame(mavlink_message_t * a, mavlink_message_t * b) {
+    return a->len == b->len && a->seq == b->seq && a->sysid == b->sysid && a->compid == b->compid &&
+           a->msgid == b->msgid &&
+           memcmp(_MAV_PAYLOAD(a), _MAV_PAYLOAD(b), a->len) == 0;
+}
+
+int MAVListSame(mavList_t * a, mavList_t * b) {
+    unsigned int i;
+    if(a->count != b->count) return 0;
+    for(i = 0; i < a->count; i++) {
+        if(MAVSame(&a->msg[i], &b->msg[i]) == 0 || a->msg[i].checksum != b->msg[i].checksum) return 0;
+    }
+    return 1;
+}
+
+// Whether every message in part turns up in whole, in the same order
+int MAVListWithin(mavList_t * part, mavList_t * whole) {
+    unsigned int i, j = 0;
+    for(i = 0; i < part->count; i++) {
+        while(j < whole->count && MAVSame(&part->msg[i], &whole->msg[j]) == 0) j++;
+        if(j == whole->count) return 0;
+        j++;
+    }
+    return 1;
+}
+
+void MAVLinkDispatch(void) {
+    if(timing) timedMessages++;
+    else MAVListAdd(&byBuffer, &mavlink_rx_msg);
+}
+
+// *** CRC
+unsigned short X25Bitwise(unsigned short crc, unsigned char data) {
+    unsigned int bit;
+    crc ^= data;
+    for(bit = 0; bit < 8; bit++) {
+        if(crc & 1) crc = (crc >> 1) ^ 0x8408;
+        else crc >>= 1;
+    }
+    return crc;
+}
+
+int CRCCheck(void) {
+    unsigned int crc, data;
+    unsigned short accum;
+
+    for(crc = 0; crc < 0x10000; crc++) {
+        for(data = 0; data < 0x100; data++) {
+            accum = crc;
+            crc_accumulate(data, &accum);
+            if(accum != X25Bitwise(crc, data)) {
+                printf("  FAIL: crc 0x%04x byte 0x%02x gives 0x%04x, should be 0x%04x\n", crc, data, accum, X25Bitwise(crc, data));
+                return 0;
+            }
+        }
+    }
+    // the check value for the X.25 variant MAVLink uses
+    if(crc_calculate((const uint8_t *)"123456789", 9) != 0x6f91) {
+        printf("  FAIL: check value 0x%04x, should be 0x6f91\n", crc_calculate((const uint8_t *)"123456789", 9));
+        return 0;
+    }
+    return 1;
+}
+
+// *** Streams
+unsigned char * StreamMake(unsigned int * length, int junky) {
+    static const unsigned char lengths[256] = MAVLINK_MESSAGE_LENGTHS;
+    unsigned char * stream;
+    unsigned int i, j, size = 0, junk;
+    unsigned char msgid;
+    mavlink_message_t msg;
+
+    stream = malloc(MAVPARSE_MESSAGES * (MAVLINK_MAX_PACKET_LEN + 16));
+    if(stream == 0) return 0;
+    sent.count = 0;
+
+    for(i = 0; i < MAVPARSE_MESSAGES; i++) {
+        // some junk between messages, now and again including what looks like the start of one
+        junk = (junky && rand() % 8 == 0) ? rand() % 16 : 0;
+        for(j = 0; j < junk; j++) {
+            stream[size] = rand();
+            if(stream[size] == MAVLINK_STX) stream[size]++;
+            size++;
+        }
+        if(junky && rand() % 64 == 0) stream[size++] = MAVLINK_STX;
+
+        do msgid = rand(); while(lengths[msgid] == 0);
+        for(j = 0; j < lengths[msgid]; j++) _MAV_PAYLOAD_NON_CONST(&msg)[j] = rand();
+        msg.msgid = msgid;
+        mavlink_finalize_message_chan(&msg, 255, 190, MAVLINK_COMM_2, lengths[msgid], mavlinkCRCExtra[msgid]);
+        size += mavlink_msg_to_send_buffer(&stream[size], &msg);
+        MAVListAdd(&sent, &msg);
+
+        // and the odd one damaged on the way
+        if(junky && rand() % 64 == 0) stream[size - 1 - rand() % (lengths[msgid] + MAVLINK_NUM_NON_PAYLOAD_BYTES)] ^= 1 << (rand() % 8);
+    }
+    *length = size;
+    return stream;
+}
+
+unsigned char * StreamRead(const char * filename, unsigned int * length) {
+    unsigned char * stream;
+    FILE * file;
+    long size;
+
+    file = fopen(filename, "rb");
+    if(file == 0) {
+        perror(filename);
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    stream = malloc(size > 0 ? size : 1);
+    if(stream == 0 || fread(stream, 1, size, file) != size) {
+        perror(filename);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    *length = size;
+    return stream;
+}
+
+// Feeds the stream through both parsers, returns 1 if MAVLinkParseBuffer found just what mavlink_parse_char did
+// made is 1 for a made up stream and 2 for a clean one, where every message has to come through
+int ParseCheck(unsigned char * stream, unsigned int length, int made) {
+    mavlink_message_t msg;
+    mavlink_status_t status;
+    unsigned char frame[MAVPARSE_FRAME_MAX];
+    unsigned int i, size;
+
+    memset(mavlink_get_channel_status(MAVLINK_COMM_0), 0, sizeof(mavlink_status_t));
+    memset(mavlink_get_channel_status(MAVLINK_COMM_1), 0, sizeof(mavlink_status_t));
+    byChar.count = 0;
+    byBuffer.count = 0;
+
+    for(i = 0; i < length; i++) {
+        if(mavlink_parse_char(MAVLINK_COMM_1, stream[i], &msg, &status)) MAVListAdd(&byChar, &msg);
+    }
+
+    // frames are copied out as Hypo gets each one's RF data in its own buffer
+    for(i = 0; i < length; i += size) {
+        size = 1 + rand() % MAVPARSE_FRAME_MAX;
+        if(size > length - i) size = length - i;
+        memcpy(frame, &stream[i], size);
+        MAVLinkParseBuffer(frame, size);
+    }
+
+    printf("  %u bytes, %u messages by byte, %u by frame", length, byChar.count, byBuffer.count);
+    if(made) printf(", %u sent", sent.count);
+    printf("\n");
+
+    if(MAVListSame(&byChar, &byBuffer) == 0) {
+        printf("  FAIL: MAVLinkParseBuffer and mavlink_parse_char found different messages\n");
+        return 0;
+    }
+    if(made && MAVListWithin(&byBuffer, &sent) == 0) {
+        printf("  FAIL: messages found that weren't sent\n");
+        return 0;
+    }
+    if(made == 2 && byBuffer.count != sent.count) {
+        printf("  FAIL: messages lost from a clean stream\n");
+        return 0;
+    }
+    return 1;
+}
+
+// *** Timing
+double NowNS(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void TimePrint(const char * name, double ns, unsigned int length, unsigned int messages) {
+    printf("  %-30s %6.2f ns/byte, %7.2f MB/s, %u messages\n", name, ns / length, length / ns * 1e3, messages);
+}
+
+// Times both receive paths over the stream, cut into the same frames for every pass
+void ParseTime(unsigned char * stream, unsigned int length) {
+    unsigned char * sizes;
+    unsigned int i, pass, byteMessages = 0;
+    double start, ns, byteNS = 0, frameNS = 0;
+
+    sizes = malloc(length);
+    if(sizes == 0) return;
+    for(i = 0; i < length; i += sizes[i]) sizes[i] = 1 + rand() % MAVPARSE_FRAME_MAX;
+
+    timing = 1;
+    for(pass = 0; pass < MAVPARSE_PASSES; pass++) {
+        memset(mavlink_get_channel_status(MAVLINK_COMM_0), 0, sizeof(mavlink_status_t));
+        timedMessages = 0;
+        start = NowNS();
+        for(i = 0; i < length; i++) MAVLinkParse(stream[i]);
+        ns = NowNS() - start;
+        if(pass == 0 || ns < byteNS) byteNS = ns;
+        byteMessages = timedMessages;
+
+        // the frames are parsed where they lie, the copy Hypo gets them in isn't part of the parse
+        memset(mavlink_get_channel_status(MAVLINK_COMM_0), 0, sizeof(mavlink_status_t));
+        timedMessages = 0;
+        start = NowNS();
+        for(i = 0; i < length; i += sizes[i]) MAVLinkParseBuffer(&stream[i], sizes[i] < length - i ? sizes[i] : length - i);
+        ns = NowNS() - start;
+        if(pass == 0 || ns < frameNS) frameNS = ns;
+    }
+    timing = 0;
+    free(sizes);
+
+    TimePrint("by byte (MAVLinkParse)", byteNS, length, byteMessages);
+    TimePrint("by frame (MAVLinkParseBuffer)", frameNS, length, timedMessages);
+    printf("  by frame is %.2f times as fast as by byte\n", byteNS / frameNS);
+}
+
+int main(int argc, char ** argv) {
+    unsigned char * stream;
+    unsigned int length;
+    int ok = 1, junky;
+
+    printf("MAVLINK_CRC_TABLE %u\n", MAVLINK_CRC_TABLE);
+    srand(1);
+
+    printf("crc_accumulate against bitwise X.25\n");
+    if(CRCCheck()) printf("  ok\n");
+    else ok = 0;
+
+    if(argc > 1) {
+        printf("parsers on %s\n", argv[1]);
+        stream = StreamRead(argv[1], &length);
+        if(stream == 0) return 1;
+        if(ParseCheck(stream, length, 0)) printf("  ok\n");
+        else ok = 0;
+        ParseTime(stream, length);
+        free(stream);
+    }
+    else {
+        for(junky = 0; junky < 2; junky++) {
+            printf("parsers on a made up stream, %s\n", junky ? "with junk" : "clean");
+            stream = StreamMake(&length, junky);
+            if(stream == 0) return 1;
+            if(ParseCheck(stream, length, junky ? 1 : 2)) printf("  ok\n");
+            else ok = 0;
+            ParseTime(stream, length);
+            free(stream);
+        }
+    }
+
+    return ok ? 0 : 1;
+}